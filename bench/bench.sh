@@ -0,0 +1,114 @@
+#!/bin/sh
+#
+# Time ls over the synthetic tree built by mktree. Run through "make bench",
+# which sets the variables below. Reports the median wall time of BENCH_RUNS
+# runs, entries per second, peak RSS and, if ktrace(1) is there, the number
+# of system calls. Each case is compared to BENCH_BASELINE when it exists,
+# and the script fails if one got more than BENCH_THRESHOLD percent slower.
+# With BENCH_SAVE=1 the results are written to BENCH_BASELINE instead.
+
+set -e
+
+: "${LS:=./ls}"
+: "${BENCH_DIR:=/tmp/ls-bench}"
+: "${BENCH_SCALE:=1}"
+: "${BENCH_RUNS:=5}"
+: "${BENCH_THRESHOLD:=10}"
+: "${BENCH_BASELINE:=bench/baseline}"
+: "${BENCH_SAVE:=0}"
+: "${MKTREE:=bench/mktree}"
+: "${BENCHRUN:=bench/benchrun}"
+
+# name, flags and directory of every case
+CASES="
+l-wide		-l		wide
+lh-wide		-lh		wide
+S-wide		-S		wide
+t-wide		-t		wide
+f-wide		-f		wide
+lR-tree		-lR		tree
+R-deep		-R		deep
+l-links		-l		links
+lF-special	-lF		special
+l-owners	-l		owners
+ln-owners	-ln		owners
+lR-parallel	-lR,--parallel	tree
+"
+
+abspath() {
+	case "$1" in
+	/*) echo "$1" ;;
+	*) echo "$(pwd)/$1" ;;
+	esac
+}
+
+LS=$(abspath "$LS")
+MKTREE=$(abspath "$MKTREE")
+BENCHRUN=$(abspath "$BENCHRUN")
+BENCH_BASELINE=$(abspath "$BENCH_BASELINE")
+
+# the tree is only rebuilt when the scale changes
+if [ "$(cat "$BENCH_DIR/.scale" 2>/dev/null)" != "$BENCH_SCALE" ]; then
+	echo "building scale $BENCH_SCALE tree in $BENCH_DIR" >&2
+	rm -rf "$BENCH_DIR"
+	"$MKTREE" -s "$BENCH_SCALE" "$BENCH_DIR"
+	echo "$BENCH_SCALE" >"$BENCH_DIR/.scale"
+fi
+cd "$BENCH_DIR"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+syscalls() {
+	if ! command -v ktrace >/dev/null 2>&1; then
+		echo -
+		return
+	fi
+	ktrace -i -t c -f "$tmp/ktrace.out" "$LS" "$@" >/dev/null 2>&1 || true
+	kdump -f "$tmp/ktrace.out" | grep -c ' CALL '
+	rm -f "$tmp/ktrace.out"
+}
+
+printf '%-12s %9s %9s %8s %11s %9s %9s %9s %7s\n' case median_ms min_ms \
+    entries entries/s maxrss_kb syscalls base_ms change
+failed=0
+echo "$CASES" | while read -r name flags dir; do
+	[ -n "$name" ] || continue
+	flags=$(echo "$flags" | tr , ' ')
+
+	# entries listed: everything but blank, "total" and "dir:" lines
+	entries=$("$LS" $flags "$dir" 2>/dev/null |
+	    grep -cv -e '^$' -e '^total ' -e ':$' || true)
+	set -- $("$BENCHRUN" "$BENCH_RUNS" "$LS" $flags "$dir")
+	median=$1 min=$2 rss=$3
+	rate=$(echo "$entries $median" | awk '{ printf "%d", $1 / ($2 / 1000) }')
+	calls=$(syscalls $flags "$dir")
+
+	base=$(awk -v n="$name" '$1 == n { print $2 }' "$BENCH_BASELINE" \
+	    2>/dev/null || true)
+	change=-
+	if [ -n "$base" ]; then
+		change=$(echo "$median $base" |
+		    awk '{ printf "%+.1f%%", ($1 - $2) * 100 / $2 }')
+		if echo "$median $base $BENCH_THRESHOLD" |
+		    awk '{ exit !($1 > $2 * (1 + $3 / 100)) }'; then
+			change="$change!"
+			echo "$name" >>"$tmp/regressed"
+		fi
+	else
+		base=-
+	fi
+	printf '%-12s %9s %9s %8s %11s %9s %9s %9s %7s\n' "$name" "$median" \
+	    "$min" "$entries" "$rate" "$rss" "$calls" "$base" "$change"
+	echo "$name $median" >>"$tmp/results"
+done
+
+if [ "$BENCH_SAVE" = 1 ]; then
+	cp "$tmp/results" "$BENCH_BASELINE"
+	echo "baseline saved to $BENCH_BASELINE" >&2
+elif [ -s "$tmp/regressed" ]; then
+	echo "more than $BENCH_THRESHOLD% slower than the baseline:" \
+	    $(cat "$tmp/regressed") >&2
+	failed=1
+fi
+exit $failed
@@ -0,0 +1,115 @@
+/*
+ * Run a command a number of times with its output thrown away and print
+ * "median_ms min_ms maxrss_kb" for bench.sh. Wall time comes from
+ * CLOCK_MONOTONIC around fork and wait, peak RSS from wait4.
+ */
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+double run_once(char *[], long *);
+int cmp_double(const void *, const void *);
+void usage(void);
+int main(int, char *[]);
+
+/*
+ * Run argv once and return its wall time in ms. *maxrss is raised to its
+ * peak RSS. A failing ls still counts, some cases list unreadable files.
+ */
+double
+run_once(char *argv[], long *maxrss)
+{
+	int fd, status;
+	pid_t pid;
+	struct rusage ru;
+	struct timespec start, end;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start) < 0) {
+		err(EXIT_FAILURE, "clock_gettime");
+	}
+	if ((pid = fork()) < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+	if (pid == 0) {
+		if ((fd = open("/dev/null", O_WRONLY)) < 0 ||
+		    dup2(fd, STDOUT_FILENO) < 0) {
+			err(EXIT_FAILURE, "/dev/null");
+		}
+		(void)execvp(argv[0], argv);
+		err(EXIT_FAILURE, "%s", argv[0]);
+	}
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		err(EXIT_FAILURE, "wait4");
+	}
+	if (clock_gettime(CLOCK_MONOTONIC, &end) < 0) {
+		err(EXIT_FAILURE, "clock_gettime");
+	}
+	if (!WIFEXITED(status)) {
+		errx(EXIT_FAILURE, "%s died", argv[0]);
+	}
+	if (ru.ru_maxrss > *maxrss) {
+		*maxrss = ru.ru_maxrss;
+	}
+	return (end.tv_sec - start.tv_sec) * 1e3 +
+	       (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+/*
+ * qsort comparator for the run times
+ */
+int
+cmp_double(const void *a, const void *b)
+{
+	double d1, d2;
+
+	d1 = *(const double *)a;
+	d2 = *(const double *)b;
+	return (d1 > d2) - (d1 < d2);
+}
+
+/*
+ * Print the usage message and exit.
+ */
+void
+usage(void)
+{
+	(void)fprintf(stderr, "usage: %s runs command [arg ...]\n",
+	              getprogname());
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i, runs;
+	long maxrss;
+	double *times;
+
+	setprogname(argv[0]);
+	if (argc < 3 || (runs = atoi(argv[1])) < 1) {
+		usage();
+	}
+	if ((times = calloc(runs, sizeof(double))) == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	/* one untimed run so every timed one sees a warm cache */
+	maxrss = 0;
+	(void)run_once(argv + 2, &maxrss);
+	for (i = 0; i < runs; ++i) {
+		times[i] = run_once(argv + 2, &maxrss);
+	}
+	qsort(times, runs, sizeof(double), cmp_double);
+
+	(void)printf("%.2f %.2f %ld\n", times[runs / 2], times[0], maxrss);
+	free(times);
+	return EXIT_SUCCESS;
+}
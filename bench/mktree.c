@@ -0,0 +1,322 @@
+/*
+ * Build the synthetic tree the benchmarks list. Every name, size, time and
+ * owner comes from a fixed-seed generator, so the same scale always gives
+ * the same tree.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SEED 0x2545f4914f6cdd1dULL
+/* mtimes fall in the three years before this */
+#define TIME_BASE 1700000000
+#define TIME_SPREAD (3 * 365 * 86400)
+#define OWNER_BASE 1000
+#define NOWNERS 200
+#define NAME_LEN 32
+
+/* entry counts at scale 1 */
+#define WIDE_FILES 20000
+#define DEEP_LEVELS 100
+#define DEEP_FILES 10
+#define TREE_FANOUT 10
+#define TREE_FILES 50
+#define LINKS 5000
+#define SPECIALS 100
+#define OWNED_FILES 2000
+
+uint64_t rng_state = SEED;
+
+uint64_t rng(void);
+void random_name(char *, const char *);
+void make_file(int, const char *);
+int make_dir(int, const char *);
+void make_wide(int, int);
+void make_deep(int, int);
+void make_tree(int, int);
+void make_links(int, int);
+void make_specials(int);
+void make_owned(int, int);
+void usage(void);
+int main(int, char *[]);
+
+/*
+ * xorshift64*, good enough for names and sizes and the same everywhere
+ */
+uint64_t
+rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * prefix followed by 4 to 23 random characters, some of them unusual for
+ * file names so -q has something to do
+ */
+void
+random_name(char *buf, const char *prefix)
+{
+	int i, len, off;
+	const char *alphabet = "abcdefghijklmnopqrstuvwxyz"
+	                       "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._- ";
+
+	off = snprintf(buf, NAME_LEN, "%s", prefix);
+	len = 4 + rng() % 20;
+	for (i = 0; i < len && off + i < NAME_LEN - 1; ++i) {
+		buf[off + i] = alphabet[rng() % strlen(alphabet)];
+	}
+	buf[off + i] = '\0';
+}
+
+/*
+ * Create a sparse file of random size and time in the directory dirfd.
+ */
+void
+make_file(int dirfd, const char *name)
+{
+	int fd;
+	struct timespec times[2];
+
+	if ((fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) <
+	    0) {
+		err(EXIT_FAILURE, "%s", name);
+	}
+	/* mostly small files with the odd huge one, like a real tree */
+	if (ftruncate(fd, rng() % 8 == 0 ? rng() % (1ULL << 34)
+	                                 : rng() % 65536) < 0) {
+		err(EXIT_FAILURE, "ftruncate %s", name);
+	}
+	times[0].tv_sec = TIME_BASE - rng() % TIME_SPREAD;
+	times[0].tv_nsec = rng() % 1000000000;
+	times[1] = times[0];
+	if (futimens(fd, times) < 0) {
+		err(EXIT_FAILURE, "futimens %s", name);
+	}
+	(void)close(fd);
+}
+
+/*
+ * Create the directory name in dirfd and return an fd open on it.
+ */
+int
+make_dir(int dirfd, const char *name)
+{
+	int fd;
+
+	if (mkdirat(dirfd, name, 0755) < 0 && errno != EEXIST) {
+		err(EXIT_FAILURE, "mkdir %s", name);
+	}
+	if ((fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY)) < 0) {
+		err(EXIT_FAILURE, "%s", name);
+	}
+	return fd;
+}
+
+/*
+ * one flat directory, for sorting and -f
+ */
+void
+make_wide(int root, int scale)
+{
+	int i, fd;
+	char name[NAME_LEN];
+
+	fd = make_dir(root, "wide");
+	for (i = 0; i < WIDE_FILES * scale; ++i) {
+		random_name(name, "w");
+		make_file(fd, name);
+	}
+	(void)close(fd);
+}
+
+/*
+ * a long chain of directories with a few files each, for -R overhead
+ */
+void
+make_deep(int root, int scale)
+{
+	int i, j, fd, next;
+	char name[NAME_LEN];
+
+	fd = make_dir(root, "deep");
+	for (i = 0; i < DEEP_LEVELS; ++i) {
+		for (j = 0; j < DEEP_FILES * scale; ++j) {
+			random_name(name, "f");
+			make_file(fd, name);
+		}
+		next = make_dir(fd, "d");
+		(void)close(fd);
+		fd = next;
+	}
+	(void)close(fd);
+}
+
+/*
+ * a bushy two level tree, for -lR
+ */
+void
+make_tree(int root, int scale)
+{
+	int i, j, k, fd, sub, leaf;
+	char name[NAME_LEN];
+
+	fd = make_dir(root, "tree");
+	for (i = 0; i < TREE_FANOUT; ++i) {
+		(void)snprintf(name, sizeof(name), "s%d", i);
+		sub = make_dir(fd, name);
+		for (j = 0; j < TREE_FANOUT; ++j) {
+			(void)snprintf(name, sizeof(name), "t%d", j);
+			leaf = make_dir(sub, name);
+			for (k = 0; k < TREE_FILES * scale; ++k) {
+				random_name(name, "");
+				make_file(leaf, name);
+			}
+			(void)close(leaf);
+		}
+		(void)close(sub);
+	}
+	(void)close(fd);
+}
+
+/*
+ * symlinks to files, to directories and to nothing, for -l and -F
+ */
+void
+make_links(int root, int scale)
+{
+	int i, fd;
+	char name[NAME_LEN];
+	char target[PATH_MAX];
+
+	fd = make_dir(root, "links");
+	for (i = 0; i < LINKS * scale; ++i) {
+		switch (rng() % 3) {
+		case 0:
+			(void)snprintf(target, sizeof(target),
+			               "../tree/s%d/t%d", (int)(rng() % 10),
+			               (int)(rng() % 10));
+			break;
+		case 1:
+			random_name(target, "../wide/w");
+			break;
+		default:
+			random_name(target, "nowhere/");
+			break;
+		}
+		(void)snprintf(name, sizeof(name), "l%06d", i);
+		if (symlinkat(target, fd, name) < 0 && errno != EEXIST) {
+			err(EXIT_FAILURE, "symlink %s", name);
+		}
+	}
+	(void)close(fd);
+}
+
+/*
+ * fifos and, when run as root, device nodes for the major, minor column
+ */
+void
+make_specials(int root)
+{
+	int i, fd;
+	char name[NAME_LEN];
+
+	fd = make_dir(root, "special");
+	for (i = 0; i < SPECIALS; ++i) {
+		(void)snprintf(name, sizeof(name), "fifo%03d", i);
+		if (mkfifoat(fd, name, 0644) < 0 && errno != EEXIST) {
+			err(EXIT_FAILURE, "mkfifo %s", name);
+		}
+		if (geteuid() != 0) {
+			continue;
+		}
+		(void)snprintf(name, sizeof(name), "dev%03d", i);
+		if (mknodat(fd, name, (i % 2 ? S_IFCHR : S_IFBLK) | 0600,
+		            makedev(i % 40, i * 7)) < 0 &&
+		    errno != EEXIST) {
+			err(EXIT_FAILURE, "mknod %s", name);
+		}
+	}
+	(void)close(fd);
+}
+
+/*
+ * files with many different owners, for the name caches. Only root can
+ * give them away, otherwise they all stay the caller's.
+ */
+void
+make_owned(int root, int scale)
+{
+	int i, fd;
+	char name[NAME_LEN];
+
+	fd = make_dir(root, "owners");
+	for (i = 0; i < OWNED_FILES * scale; ++i) {
+		(void)snprintf(name, sizeof(name), "o%06d", i);
+		make_file(fd, name);
+		if (geteuid() == 0 &&
+		    fchownat(fd, name, OWNER_BASE + rng() % NOWNERS,
+		             OWNER_BASE + rng() % NOWNERS,
+		             AT_SYMLINK_NOFOLLOW) < 0) {
+			err(EXIT_FAILURE, "chown %s", name);
+		}
+	}
+	(void)close(fd);
+}
+
+/*
+ * Print the usage message and exit.
+ */
+void
+usage(void)
+{
+	(void)fprintf(stderr, "usage: %s [-s scale] dir\n", getprogname());
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, root, scale;
+
+	setprogname(argv[0]);
+	scale = 1;
+	while ((c = getopt(argc, argv, "s:")) != -1) {
+		switch (c) {
+		case 's':
+			if ((scale = atoi(optarg)) < 1) {
+				errx(EXIT_FAILURE, "invalid scale: %s", optarg);
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1) {
+		usage();
+	}
+
+	root = make_dir(AT_FDCWD, argv[0]);
+	make_wide(root, scale);
+	make_deep(root, scale);
+	make_tree(root, scale);
+	make_links(root, scale);
+	make_specials(root);
+	make_owned(root, scale);
+	(void)close(root);
+	return EXIT_SUCCESS;
+}
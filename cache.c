@@ -0,0 +1,703 @@
+#include "cache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ls.h"
+
+extern config_t ls_config;
+
+#define CACHE_MAGIC "lscache1"
+#define CACHE_MIN_SLOTS 16
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+/*
+ * The cache file is a header, a hash table locating directories by device
+ * and inode, then the directory records. Everything is in host byte order
+ * and 8 byte aligned, the file is only read on the machine that wrote it.
+ */
+typedef struct cache_header_t {
+	char magic[8];
+	uint32_t stat_size; /* sizeof(struct stat) of the writer */
+	uint32_t nslots;    /* a power of 2 */
+	uint64_t size;      /* of the whole file */
+} cache_header_t;
+
+typedef struct cache_slot_t {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t off; /* of the record, 0 if the slot is empty */
+} cache_slot_t;
+
+/*
+ * One directory, followed by its entries. It is only used while the
+ * directory's own mtime and ctime are what they were when it was read.
+ */
+typedef struct cache_dir_t {
+	uint64_t dev;
+	uint64_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	int64_t used; /* start of the last run that stored or rewrote it */
+	uint64_t len; /* of the whole record */
+	uint32_t nentries;
+	uint8_t needs; /* META_* bits the entries were read with */
+	uint8_t dots;  /* . and .. are among the entries */
+} cache_dir_t;
+
+typedef struct cache_entry_t {
+	struct stat st;
+	uint64_t ino;
+	uint32_t type;
+	int32_t err;
+	uint16_t name_len;
+	uint16_t link_len;
+	uint8_t has_stat;
+	uint8_t has_link;
+	/* then the name and the link target, each nul-terminated */
+} cache_entry_t;
+
+/*
+ * A directory read live this run, to go into the next cache file
+ */
+typedef struct cache_fresh_t {
+	cache_dir_t *dir;
+	struct cache_fresh_t *next;
+} cache_fresh_t;
+
+/*
+ * A record that goes into the new file, and when it was last listed
+ */
+typedef struct cache_keep_t {
+	const cache_dir_t *dir;
+	int64_t used;
+} cache_keep_t;
+
+/* what a run did with each slot of the old file */
+#define SLOT_UNUSED 0
+#define SLOT_HIT 1
+#define SLOT_REPLACED 2
+#define NO_SLOT ((size_t)-1)
+
+/*
+ * --cache state. The old file is mapped read-only and never changes under
+ * us, directories read live are kept in memory and everything is written to
+ * a new file that replaces the old one at exit.
+ */
+typedef struct cache_t {
+	const char *path;
+	uint8_t *map;
+	size_t map_len;
+	const cache_header_t *hdr; /* NULL if there was no usable file */
+	const cache_slot_t *slots;
+	uint8_t *slot_state; /* SLOT_* per slot */
+	pthread_mutex_t lock; /* slot_state, fresh and nstale */
+	cache_fresh_t *fresh;
+	int nstale;
+} cache_t;
+
+cache_t cache;
+
+uint64_t cache_hash(uint64_t, uint64_t);
+void cache_open(const char *);
+const cache_dir_t *cache_record(uint64_t);
+const cache_dir_t *cache_find(const struct stat *, uint8_t, size_t *);
+size_t cache_entry_len(const cache_entry_t *);
+bool cache_load(const cache_dir_t *, dentries_t *);
+cache_dir_t *cache_pack(const struct stat *, const dentries_t *, uint8_t);
+bool dentry_differs(const dentry_t *, const dentry_t *);
+const char *dentries_diff(const dentries_t *, const dentries_t *);
+bool dentries_link_failed(const dentries_t *);
+int cache_read(int, dentries_t *, uint8_t);
+int cache_used_cmp(const void *, const void *);
+void cache_write(void);
+int cache_close(void);
+
+/*
+ * slot a directory hashes to, before probing
+ */
+uint64_t
+cache_hash(uint64_t dev, uint64_t ino)
+{
+	return (dev * 0x9e3779b97f4a7c15ULL ^ ino) * 0xff51afd7ed558ccdULL;
+}
+
+/*
+ * Map the cache file at path. A missing, foreign or damaged file is treated
+ * as empty and replaced at exit.
+ */
+void
+cache_open(const char *path)
+{
+	int fd;
+	struct stat st;
+	const cache_header_t *hdr;
+
+	(void)memset(&cache, 0, sizeof(cache_t));
+	cache.path = path;
+	pthread_mutex_init(&cache.lock, NULL);
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT) {
+			warn("%s", path);
+		}
+		return;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(cache_header_t)) {
+		(void)close(fd);
+		return;
+	}
+	cache.map_len = st.st_size;
+	cache.map = mmap(NULL, cache.map_len, PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (cache.map == MAP_FAILED) {
+		warn("%s", path);
+		cache.map = NULL;
+		return;
+	}
+
+	hdr = (const cache_header_t *)cache.map;
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->stat_size != sizeof(struct stat) ||
+	    hdr->size != cache.map_len || hdr->nslots == 0 ||
+	    (hdr->nslots & (hdr->nslots - 1)) != 0 ||
+	    hdr->nslots > (cache.map_len - sizeof(cache_header_t)) /
+	                      sizeof(cache_slot_t)) {
+		warnx("%s: not a usable cache, it will be rebuilt", path);
+		return;
+	}
+	cache.hdr = hdr;
+	cache.slots = (const cache_slot_t *)(cache.map +
+	                                     ALIGN8(sizeof(cache_header_t)));
+	if ((cache.slot_state = calloc(hdr->nslots, sizeof(uint8_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate cache");
+	}
+}
+
+/*
+ * the record at off, or NULL if it doesn't fit in the file
+ */
+const cache_dir_t *
+cache_record(uint64_t off)
+{
+	const cache_dir_t *dir;
+
+	if (off % 8 != 0 || off > cache.map_len - sizeof(cache_dir_t)) {
+		return NULL;
+	}
+	dir = (const cache_dir_t *)(cache.map + off);
+	if (dir->len < ALIGN8(sizeof(cache_dir_t)) ||
+	    dir->len > cache.map_len - off) {
+		return NULL;
+	}
+	return dir;
+}
+
+/*
+ * Find the record of the directory st describes if it is still current and
+ * was read with at least needs. *slotp is set to the directory's slot, even
+ * if the record is out of date, and to NO_SLOT if it has none.
+ */
+const cache_dir_t *
+cache_find(const struct stat *st, uint8_t needs, size_t *slotp)
+{
+	size_t i, n, mask;
+	const cache_slot_t *slot;
+	const cache_dir_t *dir;
+
+	*slotp = NO_SLOT;
+	if (cache.hdr == NULL) {
+		return NULL;
+	}
+	mask = cache.hdr->nslots - 1;
+	/* a damaged table may have no empty slot to stop at */
+	for (i = cache_hash(st->st_dev, st->st_ino) & mask, n = 0;;
+	     i = (i + 1) & mask, ++n) {
+		if (n == cache.hdr->nslots) {
+			return NULL;
+		}
+		slot = &cache.slots[i];
+		if (slot->off == 0) {
+			return NULL;
+		}
+		if (slot->dev == (uint64_t)st->st_dev &&
+		    slot->ino == (uint64_t)st->st_ino) {
+			break;
+		}
+	}
+	*slotp = i;
+	if ((dir = cache_record(slot->off)) == NULL ||
+	    dir->dev != (uint64_t)st->st_dev ||
+	    dir->ino != (uint64_t)st->st_ino ||
+	    dir->mtime.tv_sec != st->st_mtim.tv_sec ||
+	    dir->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+	    dir->ctime.tv_sec != st->st_ctim.tv_sec ||
+	    dir->ctime.tv_nsec != st->st_ctim.tv_nsec ||
+	    (dir->needs & needs) != needs ||
+	    (ls_config.dots == ALL_DOTS && !dir->dots)) {
+		return NULL;
+	}
+	return dir;
+}
+
+/*
+ * bytes an entry takes up in a record
+ */
+size_t
+cache_entry_len(const cache_entry_t *entry)
+{
+	return ALIGN8(sizeof(cache_entry_t) + entry->name_len + 1 +
+	              (entry->has_link ? entry->link_len + 1 : 0));
+}
+
+/*
+ * Fill dentries from a record, the way dentries_scan would have. Returns
+ * false, with dentries left empty, if the record is damaged.
+ */
+bool
+cache_load(const cache_dir_t *dir, dentries_t *dentries)
+{
+	uint32_t i;
+	size_t off;
+	const cache_entry_t *entry;
+	const char *name, *link;
+	dentry_t *dentry;
+
+	dentries->cap = dir->nentries > 0 ? dir->nentries : 1;
+	if ((dentries->arr = malloc(dentries->cap * sizeof(dentry_t))) ==
+	    NULL) {
+		err(EXIT_FAILURE, "failed to allocate cached entries");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+
+	off = ALIGN8(sizeof(cache_dir_t));
+	for (i = 0; i < dir->nentries; ++i) {
+		entry = (const cache_entry_t *)((const uint8_t *)dir + off);
+		if (off + sizeof(cache_entry_t) > dir->len ||
+		    off + cache_entry_len(entry) > dir->len) {
+			dentries_free(dentries);
+			return false;
+		}
+		off += cache_entry_len(entry);
+		name = (const char *)(entry + 1);
+		link = name + entry->name_len + 1;
+		/* both strings end where their lengths say */
+		if (memchr(name, '\0', entry->name_len + 1) !=
+		        name + entry->name_len ||
+		    (entry->has_link &&
+		     memchr(link, '\0', entry->link_len + 1) !=
+		         link + entry->link_len)) {
+			dentries_free(dentries);
+			return false;
+		}
+		if (ls_config.dots != ALL_DOTS &&
+		    (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) {
+			continue;
+		}
+		dentry = &dentries->arr[dentries->size++];
+		STRDUP("couldn't strdup entry name", dentry->name, name);
+		dentry->ino = entry->ino;
+		dentry->type = entry->type;
+		dentry->err = entry->err;
+		dentry->has_stat = entry->has_stat;
+		dentry->st = entry->st;
+		dentry->link = NULL;
+		dentry->link_err = 0;
+		if (entry->has_link) {
+			STRDUP("couldn't strdup symlink target", dentry->link,
+			       link);
+		}
+		if (dentry->err != 0) {
+			dentries->nerrs++;
+		}
+	}
+	return true;
+}
+
+/*
+ * Build the record of the directory st describes from its entries.
+ */
+cache_dir_t *
+cache_pack(const struct stat *st, const dentries_t *dentries, uint8_t needs)
+{
+	int i;
+	size_t len, off;
+	cache_dir_t *dir;
+	cache_entry_t *entry;
+	const dentry_t *dentry;
+	char *name;
+
+	len = ALIGN8(sizeof(cache_dir_t));
+	for (i = 0; i < dentries->size; ++i) {
+		dentry = &dentries->arr[i];
+		len += sizeof(cache_entry_t) + strlen(dentry->name) + 1;
+		if (dentry->link != NULL) {
+			len += strlen(dentry->link) + 1;
+		}
+		len = ALIGN8(len);
+	}
+	/* zeroed, so the padding written to the file is too */
+	if ((dir = calloc(1, len)) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate cache record");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+	dir->dev = st->st_dev;
+	dir->ino = st->st_ino;
+	dir->mtime = st->st_mtim;
+	dir->ctime = st->st_ctim;
+	dir->used = ls_config.now;
+	dir->len = len;
+	dir->nentries = dentries->size;
+	dir->needs = needs;
+	dir->dots = ls_config.dots == ALL_DOTS;
+
+	off = ALIGN8(sizeof(cache_dir_t));
+	for (i = 0; i < dentries->size; ++i) {
+		dentry = &dentries->arr[i];
+		entry = (cache_entry_t *)((uint8_t *)dir + off);
+		entry->st = dentry->st;
+		entry->ino = dentry->ino;
+		entry->type = dentry->type;
+		entry->err = dentry->err;
+		entry->has_stat = dentry->has_stat;
+		entry->name_len = strlen(dentry->name);
+		name = (char *)(entry + 1);
+		(void)memcpy(name, dentry->name, entry->name_len + 1);
+		if (dentry->link != NULL) {
+			entry->has_link = 1;
+			entry->link_len = strlen(dentry->link);
+			(void)memcpy(name + entry->name_len + 1, dentry->link,
+			             entry->link_len + 1);
+		}
+		off += cache_entry_len(entry);
+	}
+	return dir;
+}
+
+/*
+ * Whether two reads of an entry disagree on anything a listing shows. The
+ * access time is left out, reading a file changes it without making a
+ * listing stale.
+ */
+bool
+dentry_differs(const dentry_t *a, const dentry_t *b)
+{
+	if (strcmp(a->name, b->name) != 0 || a->type != b->type ||
+	    a->err != b->err || a->has_stat != b->has_stat ||
+	    (a->link == NULL) != (b->link == NULL) ||
+	    (a->link != NULL && strcmp(a->link, b->link) != 0)) {
+		return true;
+	}
+	return a->has_stat &&
+	       (a->st.st_ino != b->st.st_ino ||
+	        a->st.st_mode != b->st.st_mode ||
+	        a->st.st_nlink != b->st.st_nlink ||
+	        a->st.st_uid != b->st.st_uid || a->st.st_gid != b->st.st_gid ||
+	        a->st.st_rdev != b->st.st_rdev ||
+	        a->st.st_size != b->st.st_size ||
+	        a->st.st_blocks != b->st.st_blocks ||
+	        a->st.st_mtim.tv_sec != b->st.st_mtim.tv_sec ||
+	        a->st.st_mtim.tv_nsec != b->st.st_mtim.tv_nsec ||
+	        a->st.st_ctim.tv_sec != b->st.st_ctim.tv_sec ||
+	        a->st.st_ctim.tv_nsec != b->st.st_ctim.tv_nsec);
+}
+
+/*
+ * For --cache-verify: the name of the first entry the cached and the live
+ * read disagree on, NULL if they match.
+ */
+const char *
+dentries_diff(const dentries_t *cached, const dentries_t *live)
+{
+	int i;
+
+	for (i = 0; i < cached->size && i < live->size; ++i) {
+		if (dentry_differs(&cached->arr[i], &live->arr[i])) {
+			return live->arr[i].name;
+		}
+	}
+	if (cached->size > live->size) {
+		return cached->arr[i].name;
+	}
+	if (live->size > cached->size) {
+		return live->arr[i].name;
+	}
+	return NULL;
+}
+
+/*
+ * Whether a symlink target couldn't be read. A hit would list it without the
+ * warning, so such directories aren't kept.
+ */
+bool
+dentries_link_failed(const dentries_t *dentries)
+{
+	int i;
+
+	for (i = 0; i < dentries->size; ++i) {
+		if (dentries->arr[i].link_err != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * dentries_read with --cache: serve the directory open on fd from the cache
+ * if it hasn't changed, otherwise read it and keep it for the next run. With
+ * --cache-verify it is always read and compared to the cached entries. fd is
+ * closed.
+ */
+int
+cache_read(int fd, dentries_t *dentries, uint8_t needs)
+{
+	int ret;
+	int keep;
+	size_t slot;
+	struct stat before, after;
+	const cache_dir_t *dir;
+	const char *stale;
+	dentries_t cached;
+	cache_fresh_t *fresh;
+
+	if (fstat(fd, &before) < 0) {
+		return dentries_scan(fd, dentries, needs);
+	}
+	dir = cache_find(&before, needs, &slot);
+	if (dir != NULL && !ls_config.cache_verify) {
+		if (cache_load(dir, dentries)) {
+			(void)close(fd);
+			pthread_mutex_lock(&cache.lock);
+			cache.slot_state[slot] = SLOT_HIT;
+			pthread_mutex_unlock(&cache.lock);
+			return 0;
+		}
+		dir = NULL; /* damaged, read it again and replace it */
+	}
+
+	/* the scan closes fd, a second one is kept to check the directory
+	 * didn't change while it was read */
+	if ((keep = dup(fd)) < 0) {
+		err(EXIT_FAILURE, "dup");
+	}
+	ret = dentries_scan(fd, dentries, needs);
+	if (fstat(keep, &after) < 0 || ret != 0 || dentries->nerrs > 0 ||
+	    dentries_link_failed(dentries) ||
+	    after.st_mtim.tv_sec != before.st_mtim.tv_sec ||
+	    after.st_mtim.tv_nsec != before.st_mtim.tv_nsec ||
+	    after.st_ctim.tv_sec != before.st_ctim.tv_sec ||
+	    after.st_ctim.tv_nsec != before.st_ctim.tv_nsec) {
+		(void)close(keep);
+		return ret;
+	}
+	(void)close(keep);
+
+	(void)memset(&cached, 0, sizeof(dentries_t));
+	if (dir != NULL && !cache_load(dir, &cached)) {
+		dir = NULL;
+	}
+	if (dir != NULL) {
+		stale = dentries_diff(&cached, dentries);
+		if (stale != NULL) {
+			warnx("%s: stale cache entry for %s", cache.path,
+			      stale);
+		}
+		dentries_free(&cached);
+		if (stale == NULL) {
+			pthread_mutex_lock(&cache.lock);
+			cache.slot_state[slot] = SLOT_HIT;
+			pthread_mutex_unlock(&cache.lock);
+			return 0;
+		}
+	}
+
+	if ((fresh = malloc(sizeof(cache_fresh_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate cache record");
+	}
+	fresh->dir = cache_pack(&before, dentries, needs);
+	pthread_mutex_lock(&cache.lock);
+	if (slot != NO_SLOT) {
+		cache.slot_state[slot] = SLOT_REPLACED;
+	}
+	if (dir != NULL) {
+		cache.nstale++;
+	}
+	fresh->next = cache.fresh;
+	cache.fresh = fresh;
+	pthread_mutex_unlock(&cache.lock);
+	return 0;
+}
+
+/*
+ * qsort comparator putting the most recently used records first
+ */
+int
+cache_used_cmp(const void *a, const void *b)
+{
+	const cache_keep_t *keep1, *keep2;
+
+	keep1 = a;
+	keep2 = b;
+	return (keep1->used < keep2->used) - (keep1->used > keep2->used);
+}
+
+/*
+ * Write the directories read this run and the old records that are still
+ * current to a new file, which then replaces the old one. Once the records
+ * reach --cache-size the ones listed longest ago are dropped.
+ */
+void
+cache_write(void)
+{
+	int fd;
+	bool ok;
+	size_t i, n, cap, nslots, mask, slot;
+	uint64_t limit, total, off;
+	cache_header_t hdr;
+	cache_slot_t *slots;
+	cache_keep_t *keeps;
+	const cache_dir_t *dir;
+	cache_dir_t head;
+	cache_fresh_t *fresh;
+	char *tmp;
+	FILE *fp;
+
+	cap = cache.hdr == NULL ? 0 : cache.hdr->nslots;
+	for (fresh = cache.fresh; fresh != NULL; fresh = fresh->next) {
+		cap++;
+	}
+	if ((keeps = malloc(cap * sizeof(cache_keep_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate cache");
+	}
+	n = 0;
+	for (fresh = cache.fresh; fresh != NULL; fresh = fresh->next) {
+		keeps[n].dir = fresh->dir;
+		keeps[n++].used = ls_config.now;
+	}
+	for (i = 0; cache.hdr != NULL && i < cache.hdr->nslots; ++i) {
+		if (cache.slots[i].off == 0 ||
+		    cache.slot_state[i] == SLOT_REPLACED ||
+		    (dir = cache_record(cache.slots[i].off)) == NULL) {
+			continue;
+		}
+		keeps[n].dir = dir;
+		keeps[n++].used =
+		    cache.slot_state[i] == SLOT_HIT ? ls_config.now : dir->used;
+	}
+	qsort(keeps, n, sizeof(cache_keep_t), cache_used_cmp);
+
+	limit = (uint64_t)ls_config.cache_size * 1024 * 1024;
+	total = 0;
+	for (i = 0; i < n && total + keeps[i].dir->len <= limit; ++i) {
+		total += keeps[i].dir->len;
+	}
+	n = i;
+
+	/* at most half full, so probes stay short */
+	for (nslots = CACHE_MIN_SLOTS; nslots < 2 * n; nslots *= 2) {
+		continue;
+	}
+	if ((slots = calloc(nslots, sizeof(cache_slot_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate cache");
+	}
+	mask = nslots - 1;
+	off = ALIGN8(sizeof(cache_header_t)) + nslots * sizeof(cache_slot_t);
+	for (i = 0; i < n; ++i) {
+		dir = keeps[i].dir;
+		for (slot = cache_hash(dir->dev, dir->ino) & mask;
+		     slots[slot].off != 0 && (slots[slot].dev != dir->dev ||
+		                              slots[slot].ino != dir->ino);
+		     slot = (slot + 1) & mask) {
+			continue;
+		}
+		if (slots[slot].off != 0) {
+			/* listed twice this run */
+			keeps[i].dir = NULL;
+			continue;
+		}
+		slots[slot].dev = dir->dev;
+		slots[slot].ino = dir->ino;
+		slots[slot].off = off;
+		off += dir->len;
+	}
+
+	(void)memset(&hdr, 0, sizeof(cache_header_t));
+	(void)memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.stat_size = sizeof(struct stat);
+	hdr.nslots = nslots;
+	hdr.size = off;
+
+	/* written next to the old file and renamed over it, so other runs
+	 * only ever see a complete file */
+	ASPRINTF("couldn't alloc cache file name", &tmp, "%s.XXXXXX",
+	         cache.path);
+	if ((fd = mkstemp(tmp)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		err(EXIT_FAILURE, "%s", tmp);
+	}
+	/* a short write leaves the old file in place */
+	ok = fwrite(&hdr, sizeof(cache_header_t), 1, fp) == 1;
+	for (i = sizeof(cache_header_t); i < ALIGN8(sizeof(cache_header_t));
+	     ++i) {
+		ok = ok && fputc('\0', fp) != EOF;
+	}
+	ok = ok && fwrite(slots, sizeof(cache_slot_t), nslots, fp) == nslots;
+	for (i = 0; ok && i < n; ++i) {
+		if ((dir = keeps[i].dir) == NULL) {
+			continue;
+		}
+		head = *dir;
+		head.used = keeps[i].used;
+		ok = fwrite(&head, sizeof(cache_dir_t), 1, fp) == 1 &&
+		     fwrite((const uint8_t *)dir + sizeof(cache_dir_t),
+		            dir->len - sizeof(cache_dir_t), 1, fp) == 1;
+	}
+	if (!ok || ferror(fp)) {
+		warn("%s", tmp);
+		(void)fclose(fp);
+		(void)unlink(tmp);
+	} else if (fclose(fp) == EOF || rename(tmp, cache.path) < 0) {
+		warn("%s", cache.path);
+		(void)unlink(tmp);
+	}
+	free(tmp);
+	free(slots);
+	free(keeps);
+}
+
+/*
+ * Write the cache out if this run read any directory live or it is over
+ * --cache-size, and release it. Returns the number of stale directories
+ * --cache-verify found.
+ */
+int
+cache_close(void)
+{
+	cache_fresh_t *fresh;
+
+	if (cache.fresh != NULL ||
+	    (cache.hdr != NULL &&
+	     cache.hdr->size > (uint64_t)ls_config.cache_size * 1024 * 1024)) {
+		cache_write();
+	}
+	while ((fresh = cache.fresh) != NULL) {
+		cache.fresh = fresh->next;
+		free(fresh->dir);
+		free(fresh);
+	}
+	if (cache.map != NULL) {
+		(void)munmap(cache.map, cache.map_len);
+	}
+	free(cache.slot_state);
+	return cache.nstale;
+}
@@ -0,0 +1,16 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dir.h"
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+/* --cache-size when it isn't given, in MiB */
+#define CACHE_DEFAULT_SIZE 64
+
+void cache_open(const char *);
+int cache_read(int, dentries_t *, uint8_t);
+int cache_close(void);
+
+#endif /* _CACHE_H_ */
@@ -3,17 +3,81 @@
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <getopt.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "dir.h"
+#include "fetch.h"
+#include "filter.h"
 #include "sort.h"
 
 config_t ls_config;
 
+enum long_opt {
+	OPT_PARALLEL = CHAR_MAX + 1,
+	OPT_THREADS,
+	OPT_ASYNC,
+	OPT_QUEUE_DEPTH,
+	OPT_STATS,
+	OPT_TRACE,
+	OPT_NDJSON,
+	OPT_BINARY,
+	OPT_CACHE,
+	OPT_CACHE_SIZE,
+	OPT_CACHE_VERIFY,
+	OPT_WATCH,
+	OPT_HEAD,
+	OPT_HEAD_GLOBAL,
+	OPT_DU,
+	OPT_MEM_LIMIT,
+	OPT_INODE_ORDER,
+	OPT_INCLUDE,
+	OPT_EXCLUDE,
+	OPT_TYPE,
+	OPT_MIN_SIZE,
+	OPT_MAX_SIZE,
+	OPT_MIN_AGE,
+	OPT_MAX_AGE
+};
+
+struct option long_options[] = {
+	{ "parallel", no_argument, NULL, OPT_PARALLEL },
+	{ "threads", required_argument, NULL, OPT_THREADS },
+	{ "async", no_argument, NULL, OPT_ASYNC },
+	{ "queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH },
+	{ "inode-order", no_argument, NULL, OPT_INODE_ORDER },
+	{ "stats", optional_argument, NULL, OPT_STATS },
+	{ "trace", required_argument, NULL, OPT_TRACE },
+	{ "ndjson", no_argument, NULL, OPT_NDJSON },
+	{ "binary", no_argument, NULL, OPT_BINARY },
+	{ "cache", required_argument, NULL, OPT_CACHE },
+	{ "cache-size", required_argument, NULL, OPT_CACHE_SIZE },
+	{ "cache-verify", no_argument, NULL, OPT_CACHE_VERIFY },
+	{ "watch", no_argument, NULL, OPT_WATCH },
+	{ "head", required_argument, NULL, OPT_HEAD },
+	{ "head-global", required_argument, NULL, OPT_HEAD_GLOBAL },
+	{ "du", no_argument, NULL, OPT_DU },
+	{ "mem-limit", required_argument, NULL, OPT_MEM_LIMIT },
+	{ "include", required_argument, NULL, OPT_INCLUDE },
+	{ "exclude", required_argument, NULL, OPT_EXCLUDE },
+	{ "type", required_argument, NULL, OPT_TYPE },
+	{ "min-size", required_argument, NULL, OPT_MIN_SIZE },
+	{ "max-size", required_argument, NULL, OPT_MAX_SIZE },
+	{ "min-age", required_argument, NULL, OPT_MIN_AGE },
+	{ "max-age", required_argument, NULL, OPT_MAX_AGE },
+	{ NULL, 0, NULL, 0 }
+};
+
 void default_config(void);
+int parse_count(const char *, const char *);
+int cap_count(const char *, int, int);
+void usage(void);
 
 /*
  * Set the default options for the ls_config following the manpage.
@@ -22,6 +86,7 @@ void
 default_config(void)
 {
 	int istty;
+	struct timespec now;
 
 	ls_config.opts = 0;
 	ls_config.dots = NO_DOTS;
@@ -29,6 +94,20 @@ default_config(void)
 	ls_config.time = MTIME;
 	ls_config.blkcount_fmt = BLKSIZE_ENV;
 	ls_config.sort = LEXICO_SORT;
+	ls_config.parallel = false;
+	ls_config.fetch_depth = 0;
+	ls_config.cache_size = CACHE_DEFAULT_SIZE;
+	if ((ls_config.nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+		ls_config.nthreads = 1;
+	} else if (ls_config.nthreads > MAX_THREADS) {
+		ls_config.nthreads = MAX_THREADS;
+	}
+
+	/* the same cutoff is used for every file, however long the run takes */
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0) {
+		err(EXIT_FAILURE, "couldn't get current time");
+	}
+	ls_config.now = now.tv_sec;
 
 	/* if superuser, -A is always set */
 	if (geteuid() == 0) {
@@ -49,6 +128,60 @@ default_config(void)
 	}
 }
 
+/*
+ * Parse a strictly positive integer option argument.
+ */
+int
+parse_count(const char *optname, const char *arg)
+{
+	long n;
+	char *end;
+
+	errno = 0;
+	n = strtol(arg, &end, 10);
+	if (errno != 0 || *arg == '\0' || *end != '\0' || n < 1 ||
+	    n > INT_MAX) {
+		errx(EXIT_FAILURE, "invalid %s count: %s", optname, arg);
+	}
+	return (int)n;
+}
+
+/*
+ * Lower a count option to max, the most threads it is allowed to start,
+ * with a warning.
+ */
+int
+cap_count(const char *optname, int n, int max)
+{
+	if (n > max) {
+		warnx("%s count %d lowered to %d", optname, n, max);
+		return max;
+	}
+	return n;
+}
+
+/*
+ * Print the usage message and exit.
+ */
+void
+usage(void)
+{
+	(void)fprintf(stderr,
+	              "usage: %s [-AabcdFfhiklnqRrSstuw] [--parallel] "
+	              "[--threads n] [--async] [--queue-depth n] "
+	              "[--inode-order] [--stats[=file]] [--trace file] "
+	              "[--ndjson | --binary] [--cache file] [--cache-size n] "
+	              "[--cache-verify] "
+	              "[--watch] [--head n | --head-global n] [--du] "
+	              "[--mem-limit n] [--include glob] [--exclude glob] "
+	              "[--type t] [--min-size n] [--max-size n] "
+	              "[--min-age n] [--max-age n] [file ...]\n"
+	              "--du counts only what is listed, see -a, -A, -R and "
+	              "the filters\n",
+	              getprogname());
+	exit(EXIT_FAILURE);
+}
+
 /*
  * Parse the arguments using getopts(3)
  * Pass in pointers to argc and argv directly from main.
@@ -72,7 +205,8 @@ argparse(int *argc, char ***argv)
 	ls_config.blocksize = blocksize_env;
 
 	opterr = 0;
-	while ((c = getopt(*argc, *argv, "AacdFfhiklnqRrSstuw")) != -1) {
+	while ((c = getopt_long(*argc, *argv, "AabcdFfhiklnqRrSstuw",
+	                        long_options, NULL)) != -1) {
 		switch (c) {
 		case 'A': /* don't show dotdirs */
 			if (!has_set_a) {
@@ -146,20 +280,119 @@ argparse(int *argc, char ***argv)
 			/* non-print chars flags - here we change the default */
 		case 'q':
 			UNSET(ls_config.opts, RAW_PRINT);
+			ls_config.escape = false;
 			break;
 		case 'w':
 			SET(ls_config.opts, RAW_PRINT);
+			ls_config.escape = false;
+			break;
+		case 'b':
+			UNSET(ls_config.opts, RAW_PRINT);
+			ls_config.escape = true;
+			break;
+			/* traversal engine */
+		case OPT_PARALLEL:
+			ls_config.parallel = true;
+			break;
+		case OPT_THREADS: /* implies --parallel */
+			ls_config.parallel = true;
+			ls_config.nthreads = cap_count(
+			    "thread", parse_count("thread", optarg),
+			    MAX_THREADS);
+			break;
+			/* metadata backend */
+		case OPT_ASYNC:
+			if (ls_config.fetch_depth == 0) {
+				ls_config.fetch_depth = FETCH_DEFAULT_DEPTH;
+			}
+			break;
+		case OPT_QUEUE_DEPTH: /* implies --async */
+			ls_config.fetch_depth = cap_count(
+			    "queue depth", parse_count("queue depth", optarg),
+			    FETCH_MAX_DEPTH);
+			break;
+		case OPT_INODE_ORDER:
+			ls_config.inode_order = true;
+			break;
+			/* instrumentation */
+		case OPT_STATS:
+			ls_config.stats = true;
+			ls_config.stats_file = optarg;
+			break;
+		case OPT_TRACE:
+			ls_config.trace_file = optarg;
+			break;
+			/* output format */
+		case OPT_NDJSON:
+			ls_config.records = NDJSON_RECORDS;
+			break;
+		case OPT_BINARY:
+			ls_config.records = BINARY_RECORDS;
+			break;
+			/* metadata cache */
+		case OPT_CACHE:
+			ls_config.cache_file = optarg;
+			break;
+		case OPT_CACHE_SIZE:
+			ls_config.cache_size =
+			    parse_count("cache size", optarg);
+			break;
+		case OPT_CACHE_VERIFY:
+			ls_config.cache_verify = true;
+			break;
+			/* watch mode */
+		case OPT_WATCH:
+			ls_config.watch = true;
+			break;
+			/* top entries only */
+		case OPT_HEAD:
+			ls_config.head = parse_count("head", optarg);
+			ls_config.head_global = 0;
+			break;
+		case OPT_HEAD_GLOBAL:
+			ls_config.head_global = parse_count("head", optarg);
+			ls_config.head = 0;
+			break;
+			/* disk usage */
+		case OPT_DU:
+			ls_config.du = true;
+			break;
+			/* external sort */
+		case OPT_MEM_LIMIT:
+			ls_config.mem_limit =
+			    parse_count("memory limit", optarg);
+			break;
+			/* filters */
+		case OPT_INCLUDE:
+		case OPT_EXCLUDE:
+			filter_glob(optarg, c == OPT_EXCLUDE);
+			ls_config.filter = true;
+			break;
+		case OPT_TYPE:
+			filter_types(optarg);
+			ls_config.filter = true;
+			break;
+		case OPT_MIN_SIZE:
+		case OPT_MAX_SIZE:
+			filter_size(optarg, c == OPT_MAX_SIZE);
+			ls_config.filter = true;
+			break;
+		case OPT_MIN_AGE:
+		case OPT_MAX_AGE:
+			filter_age(optarg, c == OPT_MAX_AGE);
+			ls_config.filter = true;
 			break;
 		case '?':
-			if (isprint(optopt)) {
+			if (optopt == 0) {
+				warnx("unknown option -- %s", (*argv)[optind - 1]);
+			} else if (isprint(optopt)) {
 				warnx("unknown option -- %c", optopt);
 			} else {
 				warnx("unknown option -- \\x%x", optopt);
 			}
-			(void)fprintf(stderr,
-			        "usage: %s [-AacdFfhiklnqRrSstuw] [file ...]\n",
-			        getprogname());
-			exit(EXIT_FAILURE);
+			usage();
+			/* NOTREACHED */
+			break;
 		default:
 			errx(EXIT_FAILURE, "getopt");
 		}
@@ -167,21 +400,99 @@ argparse(int *argc, char ***argv)
 	*argc -= optind;
 	*argv += optind;
 
+	if (ls_config.cache_verify && ls_config.cache_file == NULL) {
+		warnx("--cache-verify needs --cache");
+		usage();
+	}
+	if (ls_config.watch && ls_config.head_global > 0) {
+		warnx("--head-global can't be used with --watch");
+		usage();
+	}
+	/* the totals are of what is listed, and printed once */
+	if (ls_config.du &&
+	    (ls_config.watch || ls_config.head > 0 ||
+	     ls_config.head_global > 0 || ls_config.records != NO_RECORDS)) {
+		warnx("--du can't be used with --watch, --head, --head-global, "
+		      "--ndjson or --binary");
+		usage();
+	}
+	/* --head already keeps only what it lists, and the others keep every
+	 * entry somewhere else */
+	if (ls_config.mem_limit > 0 &&
+	    (ls_config.watch || ls_config.head > 0 ||
+	     ls_config.head_global > 0 || ls_config.cache_file != NULL)) {
+		warnx("--mem-limit can't be used with --watch, --head, "
+		      "--head-global or --cache");
+		usage();
+	}
+
 	switch (ls_config.sort) {
 	case LEXICO_SORT:
 		ls_config.compare = lexico_sort_func;
+		ls_config.entry_compare = lexico_entry_cmp;
 		break;
 	case TIME_SORT:
 		ls_config.compare = time_sort_func;
+		ls_config.entry_compare = time_entry_cmp;
 		break;
 	case SIZE_SORT:
 		ls_config.compare = size_sort_func;
+		ls_config.entry_compare = size_entry_cmp;
 		break;
 	}
 
 	/* the -f flag overrides any sorting options. */
 	if (GET(ls_config.opts, NO_SORT)) {
 		ls_config.compare = NULL;
+		ls_config.entry_compare = NULL;
+	}
+
+	/* records carry every field, so they need what -l needs, and so do
+	 * the entries --head-global keeps until the end and --du's sums */
+	ls_config.names_only =
+	    !GET(ls_config.opts, LONG_FORMAT | SHOW_INODES | SHOW_BLKCOUNT) &&
+	    ls_config.records == NO_RECORDS && ls_config.head_global == 0 &&
+	    !ls_config.du;
+	ls_config.headers =
+	    ls_config.records == NO_RECORDS && ls_config.head_global == 0;
+
+	/* without sorting or aligned columns nothing has to wait for the rest
+	 * of the directory */
+	ls_config.stream = ls_config.names_only && ls_config.compare == NULL;
+
+	/* stats that wait until the whole directory has been read */
+	ls_config.fetch_later =
+	    ls_config.fetch_depth > 0 || ls_config.inode_order;
+
+	/* work out the least each entry has to be stat-ed for */
+	ls_config.stat_needs = 0;
+	if (!ls_config.names_only) {
+		SET(ls_config.stat_needs, META_ALL);
+	}
+	if (GET(ls_config.opts, LONG_FORMAT) ||
+	    ls_config.records != NO_RECORDS) {
+		SET(ls_config.stat_needs, META_LINK);
+	}
+	if (GET(ls_config.opts, SHOW_FILETYPE_SYM)) {
+		SET(ls_config.stat_needs, META_TYPE | META_EXEC);
+	}
+	if (ls_config.recurse == FULL_DEPTH) {
+		SET(ls_config.stat_needs, META_TYPE);
+	}
+	if (ls_config.compare != NULL) {
+		switch (ls_config.sort) {
+		case LEXICO_SORT:
+			break;
+		case TIME_SORT:
+			SET(ls_config.stat_needs, META_TIME);
+			break;
+		case SIZE_SORT:
+			SET(ls_config.stat_needs, META_SIZE);
+			break;
+		}
+	}
+	if (ls_config.filter) {
+		SET(ls_config.stat_needs, filter_needs());
 	}
 
 	switch (ls_config.recurse) {
@@ -1,7 +1,9 @@
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <fts.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifndef _CONFIG_H_
 #define _CONFIG_H_
@@ -13,7 +15,9 @@
 #define SHOW_FILETYPE_SYM (1 << 4) /* -F flag */
 #define REVERSE_SORT (1 << 5)      /* -r flag */
 #define NO_SORT (1 << 6)           /* -f flag */
-#define RAW_PRINT (1 << 7)         /* -q or -w flags */
+#define RAW_PRINT (1 << 7)         /* -q, -w or -b flags */
+
+#define MAX_THREADS 256 /* most --threads accepts */
 
 #define GET(states, bits) ((states & (bits)) != 0)
 #define SET(states, bits) states = (states | (bits))
@@ -55,6 +59,13 @@ typedef enum blkcount_fmt_opt {
 	                  regular size */
 } blkcount_fmt_opt;
 
+typedef enum record_opt {
+	NO_RECORDS,     /* the usual listing */
+	NDJSON_RECORDS, /* --ndjson flag - a JSON object per entry */
+	BINARY_RECORDS  /* --binary flag - length-prefixed records, see record.h
+	                 */
+} record_opt;
+
 typedef struct config_t {
 	uint8_t opts;
 	dots_opt dots;
@@ -65,7 +76,33 @@ typedef struct config_t {
 	blksize_t blocksize;
 	int max_depth;
 	int (*compare)(const FTSENT **, const FTSENT **);
+	int (*entry_compare)(const char *, const struct stat *, const char *,
+	                     const struct stat *);
 	bool istty;
+	bool escape;   /* -b flag - escape what -q would print as ? */
+	bool parallel; /* --parallel flag - read -R subtrees on worker threads */
+	int nthreads;  /* --threads flag - worker count for --parallel */
+	int fetch_depth; /* --async/--queue-depth - stats in flight, 0 if off */
+	bool inode_order; /* --inode-order flag - stat by ascending inode */
+	bool stats;             /* --stats flag - report where the time went */
+	const char *stats_file; /* --stats=file - JSON report, NULL for stderr */
+	const char *trace_file; /* --trace flag - Chrome trace, NULL if off */
+	record_opt records;
+	const char *cache_file; /* --cache flag - metadata cache, NULL if off */
+	int cache_size;         /* --cache-size flag - in MiB */
+	bool cache_verify;      /* --cache-verify flag - check hits live */
+	bool watch;             /* --watch flag - list again on changes */
+	int head;        /* --head flag - entries listed per directory, or 0 */
+	int head_global; /* --head-global flag - entries listed in all, or 0 */
+	bool du;         /* --du flag - subtree totals of every directory */
+	int mem_limit;   /* --mem-limit flag - in MiB per directory, or 0 */
+	bool filter;     /* --include, --exclude, --type and the bounds */
+	bool headers;       /* "path:" lines, unless records or --head-global */
+	bool names_only;    /* no -l, -s or -i columns to align */
+	bool stream;        /* unsorted names only, print entries as read */
+	bool fetch_later;   /* stat once the directory is read, see above */
+	uint8_t stat_needs; /* META_* bits the listing needs per entry */
+	time_t now;         /* read once, for the 6 month cutoff of -l */
 } config_t;
 
 void argparse(int *, char ***);
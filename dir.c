@@ -0,0 +1,457 @@
+#include "dir.h"
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "config.h"
+#include "fetch.h"
+#include "filter.h"
+#include "ls.h"
+#include "sort.h"
+#include "spill.h"
+#include "trace.h"
+
+extern config_t ls_config;
+
+/*
+ * Where an entry is in dentries, for stat-ing them by inode
+ */
+typedef struct dentry_order_t {
+	ino_t ino;
+	int idx;
+} dentry_order_t;
+
+bool needs_stat(uint8_t, unsigned char);
+int dentries_read(int, dentries_t *, uint8_t);
+int dentries_scan(int, dentries_t *, uint8_t);
+dentry_t *dentries_append(dentries_t *, const struct dirent *);
+int dentry_fetch(int, dentry_t *, uint8_t);
+int dentry_ino_cmp(const void *, const void *);
+int dentries_fetch(int, dentries_t *, uint8_t);
+void dentries_sort(dentries_t *);
+void dentries_head(dentries_t *, int);
+void dentries_free(dentries_t *);
+int dir_list(const FTSENT *, fileinfos_t *);
+
+/*
+ * Decide whether an entry has to be stat-ed to provide the needed metadata or
+ * if its d_type already says enough.
+ */
+bool
+needs_stat(uint8_t needs, unsigned char d_type)
+{
+	if (GET(needs, META_ALL | META_SIZE | META_TIME)) {
+		return true;
+	}
+	switch (d_type) {
+	case DT_UNKNOWN:
+		return needs != 0;
+	case DT_REG:
+		return GET(needs, META_EXEC);
+	case DT_DIR:
+		return GET(needs, META_DIRS);
+	default:
+		return false;
+	}
+}
+
+/*
+ * Read every entry of the directory open on fd into dentries, only stat-ing
+ * the ones the needs call for, or take them from the --cache. fd is closed.
+ * Returns 0 or the errno of the failed read.
+ */
+int
+dentries_read(int fd, dentries_t *dentries, uint8_t needs)
+{
+	if (ls_config.cache_file != NULL) {
+		return cache_read(fd, dentries, needs);
+	}
+	return dentries_scan(fd, dentries, needs);
+}
+
+/*
+ * dentries_read without the cache
+ */
+int
+dentries_scan(int fd, dentries_t *dentries, uint8_t needs)
+{
+	int ret;
+	DIR *dirp;
+	struct dirent *dp;
+	dentry_t *dentry;
+	stats_phase_t prev;
+
+	if ((dirp = fdopendir(fd)) == NULL) {
+		ret = errno;
+		(void)close(fd);
+		return ret;
+	}
+	prev = STATS_ENTER(PHASE_TRAVERSE);
+
+	for (;;) {
+		errno = 0;
+		if ((dp = readdir(dirp)) == NULL) {
+			ret = errno;
+			break;
+		}
+		if (ls_config.dots != ALL_DOTS &&
+		    (strcmp(dp->d_name, ".") == 0 ||
+		     strcmp(dp->d_name, "..") == 0)) {
+			continue;
+		}
+		/* what the name and d_type rule out is never stat-ed. The
+		 * cache keeps every entry, whatever the filters of the run
+		 * that stored it. */
+		if (ls_config.filter && ls_config.cache_file == NULL &&
+		    !filter_name(dp->d_name, DTTOIF(dp->d_type))) {
+			continue;
+		}
+		/* once the entries outnumber those --head lists twice over,
+		 * the rest is dropped rather than grown into. Stats issued
+		 * later aren't there yet and the cache stores them all. */
+		if (dentries->size == dentries->cap && dentries->keep > 0 &&
+		    dentries->size >= 2 * dentries->keep &&
+		    !ls_config.fetch_later &&
+		    ls_config.cache_file == NULL) {
+			dentries_head(dentries, dentries->keep);
+		}
+		dentry = dentries_append(dentries, dp);
+		if (!ls_config.fetch_later && needs_stat(needs, dp->d_type) &&
+		    dentry_fetch(dirfd(dirp), dentry, needs) != 0) {
+			dentries->nerrs++;
+		}
+	}
+
+	/* with --async or --inode-order the stats are issued once every name
+	 * is known */
+	if (ls_config.fetch_later) {
+		dentries->nerrs += dentries_fetch(dirfd(dirp), dentries, needs);
+	}
+
+	(void)closedir(dirp);
+	STATS_LEAVE(prev);
+	return ret;
+}
+
+/*
+ * Add the entry dp to the end of dentries, not stat-ed yet
+ */
+dentry_t *
+dentries_append(dentries_t *dentries, const struct dirent *dp)
+{
+	dentry_t *dentry;
+
+	if (dentries->size == dentries->cap) {
+		dentries->cap *= 2;
+		if (dentries->cap == 0) {
+			dentries->cap = INIT_CAP;
+		}
+		dentries->arr =
+		    realloc(dentries->arr, dentries->cap * sizeof(dentry_t));
+		if (dentries->arr == NULL) {
+			err(EXIT_FAILURE, "failed to realloc dynamic array");
+		}
+		STATS_COUNT(COUNT_ALLOC, 1);
+	}
+	dentry = &dentries->arr[dentries->size++];
+	STRDUP("couldn't strdup entry name", dentry->name, dp->d_name);
+	dentry->ino = dp->d_fileno;
+	dentry->type = DTTOIF(dp->d_type);
+	dentry->err = 0;
+	dentry->has_stat = false;
+	dentry->link = NULL;
+	dentry->link_err = 0;
+	(void)memset(&dentry->st, 0, sizeof(struct stat));
+	return dentry;
+}
+
+/*
+ * Stat one entry of the directory open on dirfd, and read its target if it
+ * is a symlink and needs has META_LINK. Returns 0 or the errno of the failed
+ * stat. Safe to call from any thread.
+ */
+int
+dentry_fetch(int dirfd, dentry_t *dentry, uint8_t needs)
+{
+	ssize_t len;
+	char buf[PATH_MAX];
+	stats_phase_t prev;
+
+	prev = STATS_ENTER(PHASE_STAT);
+	STATS_COUNT(COUNT_STAT, 1);
+	if (fstatat(dirfd, dentry->name, &dentry->st, AT_SYMLINK_NOFOLLOW) <
+	    0) {
+		dentry->err = errno;
+		(void)memset(&dentry->st, 0, sizeof(struct stat));
+		STATS_LEAVE(prev);
+		return dentry->err;
+	}
+	dentry->has_stat = true;
+	dentry->type = dentry->st.st_mode & S_IFMT;
+
+	/* a failed readlink is reported when the entry is printed */
+	if (GET(needs, META_LINK) && S_ISLNK(dentry->type)) {
+		STATS_COUNT(COUNT_READLINK, 1);
+		if ((len = readlinkat(dirfd, dentry->name, buf, sizeof(buf))) <
+		    0) {
+			dentry->link_err = errno;
+		} else {
+			if ((dentry->link = malloc(len + 1)) == NULL) {
+				err(EXIT_FAILURE,
+				    "failed to allocate symlink target");
+			}
+			STATS_COUNT(COUNT_ALLOC, 1);
+			(void)memcpy(dentry->link, buf, len);
+			dentry->link[len] = '\0';
+		}
+	}
+	STATS_LEAVE(prev);
+	return 0;
+}
+
+/*
+ * qsort comparator for ascending inode numbers of dentry_order_t
+ */
+int
+dentry_ino_cmp(const void *a, const void *b)
+{
+	const dentry_order_t *order1, *order2;
+
+	order1 = a;
+	order2 = b;
+	if (order1->ino != order2->ino) {
+		return order1->ino < order2->ino ? -1 : 1;
+	}
+	return order1->idx - order2->idx;
+}
+
+/*
+ * Stat the entries dentries_scan left for once the directory is read: on the
+ * --async pool, and with --inode-order by ascending d_fileno, so the inode
+ * table is read in one sweep rather than in directory order. The entries
+ * stay where they are. Returns the number of failed stats.
+ */
+int
+dentries_fetch(int dirfd, dentries_t *dentries, uint8_t needs)
+{
+	int i, nerrs;
+	dentry_t *dentry;
+	dentry_order_t *order;
+	dentries_t byino;
+
+	if (!ls_config.inode_order) {
+		return fetch_dentries(dirfd, dentries, needs);
+	}
+	if (dentries->size == 0) {
+		return 0;
+	}
+	if ((order = malloc(dentries->size * sizeof(dentry_order_t))) ==
+	    NULL) {
+		err(EXIT_FAILURE, "failed to allocate inode order");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+	for (i = 0; i < dentries->size; ++i) {
+		order[i].ino = dentries->arr[i].ino;
+		order[i].idx = i;
+	}
+	qsort(order, dentries->size, sizeof(dentry_order_t), dentry_ino_cmp);
+
+	nerrs = 0;
+	if (ls_config.fetch_depth > 0) {
+		/* the pool hands out the array in order, so it is put in
+		 * inode order for the fetch and back afterwards */
+		(void)memset(&byino, 0, sizeof(dentries_t));
+		byino.size = byino.cap = dentries->size;
+		if ((byino.arr = malloc(byino.cap * sizeof(dentry_t))) ==
+		    NULL) {
+			err(EXIT_FAILURE, "failed to allocate inode order");
+		}
+		STATS_COUNT(COUNT_ALLOC, 1);
+		for (i = 0; i < dentries->size; ++i) {
+			byino.arr[i] = dentries->arr[order[i].idx];
+		}
+		nerrs = fetch_dentries(dirfd, &byino, needs);
+		for (i = 0; i < dentries->size; ++i) {
+			dentries->arr[order[i].idx] = byino.arr[i];
+		}
+		free(byino.arr);
+	} else {
+		for (i = 0; i < dentries->size; ++i) {
+			dentry = &dentries->arr[order[i].idx];
+			if (needs_stat(needs, IFTODT(dentry->type)) &&
+			    dentry_fetch(dirfd, dentry, needs) != 0) {
+				nerrs++;
+			}
+		}
+	}
+	free(order);
+	return nerrs;
+}
+
+/*
+ * Sort the entries the way fts_children would with ls_config.compare.
+ */
+void
+dentries_sort(dentries_t *dentries)
+{
+	int i;
+	sortkey_t *keys;
+	dentry_t *sorted;
+
+	/* --head-global sorts only what it keeps */
+	if (ls_config.entry_compare == NULL || ls_config.head_global > 0 ||
+	    dentries->size < 2) {
+		return;
+	}
+	if ((keys = malloc(dentries->size * sizeof(sortkey_t))) == NULL ||
+	    (sorted = malloc(dentries->cap * sizeof(dentry_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate sort keys");
+	}
+	STATS_COUNT(COUNT_ALLOC, 2);
+	for (i = 0; i < dentries->size; ++i) {
+		sortkey_init(&keys[i], i, dentries->arr[i].name,
+		             &dentries->arr[i].st);
+	}
+	sortkeys_sort(keys, dentries->size);
+	for (i = 0; i < dentries->size; ++i) {
+		sorted[i] = dentries->arr[keys[i].idx];
+	}
+	free(dentries->arr);
+	dentries->arr = sorted;
+	free(keys);
+}
+
+/*
+ * Keep the first k entries in list order, sorted as dentries_sort would, and
+ * free the rest: a bounded heap instead of sorting the whole directory. The
+ * entries that failed to stat stay in front, they are still reported, and
+ * the dotfiles and the entries filtered out that won't be listed go first.
+ * The blocks and sizes of the others dropped still count towards the total.
+ */
+void
+dentries_head(dentries_t *dentries, int k)
+{
+	int i, n, nkept;
+	sortkey_t *keys;
+	dentry_t *kept;
+	dentry_t *dentry;
+
+	if ((keys = malloc(dentries->size * sizeof(sortkey_t))) == NULL ||
+	    (kept = malloc(dentries->cap * sizeof(dentry_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate sort keys");
+	}
+	STATS_COUNT(COUNT_ALLOC, 2);
+	for (n = 0, nkept = 0, i = 0; i < dentries->size; ++i) {
+		dentry = &dentries->arr[i];
+		if (dentry->err != 0) {
+			kept[nkept++] = *dentry;
+		} else if ((ls_config.dots == NO_DOTS &&
+		            dentry->name[0] == '.') ||
+		           (ls_config.filter && !filter_dentry(dentry))) {
+			free(dentry->name);
+			free(dentry->link);
+		} else {
+			sortkey_init(&keys[n++], i, dentry->name, &dentry->st);
+		}
+	}
+	/* unsorted, the first ones read stay */
+	if (ls_config.entry_compare != NULL) {
+		k = (int)sortkeys_head(keys, n, k);
+	}
+	for (i = 0; i < n; ++i) {
+		dentry = &dentries->arr[keys[i].idx];
+		if (i < k) {
+			kept[nkept++] = *dentry;
+		} else {
+			dentries->dropped_blocks += dentry->st.st_blocks;
+			dentries->dropped_size += dentry->st.st_size;
+			free(dentry->name);
+			free(dentry->link);
+		}
+	}
+	free(dentries->arr);
+	dentries->arr = kept;
+	dentries->size = nkept;
+	free(keys);
+}
+
+/*
+ * Frees the entries but not dentries itself.
+ */
+void
+dentries_free(dentries_t *dentries)
+{
+	int i;
+
+	for (i = 0; i < dentries->size; ++i) {
+		free(dentries->arr[i].name);
+		free(dentries->arr[i].link);
+	}
+	free(dentries->arr);
+	(void)memset(dentries, 0, sizeof(dentries_t));
+}
+
+/*
+ * List a directory that won't be descended into without fts_children: for
+ * names only, so fts doesn't stat every entry for nothing, with --async, so
+ * the stats can be issued concurrently, with --cache, with --head, so only
+ * the entries listed are kept, or with --mem-limit, so the entries can be
+ * sorted on disk. fileinfos is reused for the columns.
+ */
+int
+dir_list(const FTSENT *dir, fileinfos_t *fileinfos)
+{
+	int fd;
+	int ret, nspilled;
+	uint64_t start;
+	dentries_t dentries;
+
+	start = TRACE_START();
+	if ((fd = open(dir->fts_accpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) <
+	    0) {
+		if (dir->fts_level > 0) {
+			warn("%s", dir->fts_name);
+		}
+		return EXIT_FAILURE;
+	}
+
+	(void)memset(&dentries, 0, sizeof(dentries_t));
+	dentries.keep = ls_config.head;
+	if (ls_config.mem_limit > 0) {
+		ret = spill_read(fd, &dentries, fileinfos,
+		                 ls_config.stat_needs);
+	} else {
+		ret = dentries_read(fd, &dentries, ls_config.stat_needs);
+	}
+	if (ret != 0) {
+		errno = ret;
+		warn("%s", dir->fts_name);
+	}
+	TRACE_SPAN("readdir", start, dir->fts_path, dentries.size);
+	if ((nspilled = spill_print(fileinfos, dir->fts_path)) > 0) {
+		STATS_DIR(dir->fts_path, nspilled);
+		return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if (ls_config.head > 0) {
+		dentries_head(&dentries, ls_config.head);
+	} else {
+		dentries_sort(&dentries);
+	}
+	STATS_DIR(dir->fts_path, dentries.size);
+	if (ls_config.names_only) {
+		print_dentries(&dentries);
+	} else {
+		fileinfos_from_dentries(fileinfos, &dentries, dir->fts_path);
+		print_fileinfos(fileinfos);
+	}
+	dentries_free(&dentries);
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
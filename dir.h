@@ -0,0 +1,56 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fts.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef _DIR_H_
+#define _DIR_H_
+
+/* metadata a listing needs from each entry, see stat_needs in config_t */
+#define META_TYPE (1 << 0) /* file type - d_type is enough */
+#define META_EXEC (1 << 1) /* execute bits of regular files for -F */
+#define META_SIZE (1 << 2) /* st_size for -S */
+#define META_TIME (1 << 3) /* timestamps for -t */
+#define META_ALL (1 << 4)  /* every field, for the -l, -s and -i columns */
+#define META_DIRS (1 << 5) /* dev and ino of directories to detect cycles */
+#define META_LINK (1 << 6) /* symlink targets for -l */
+
+typedef struct dentry_t {
+	char *name;
+	ino_t ino;     /* d_fileno */
+	mode_t type;   /* S_IFMT bits, 0 if neither d_type nor stat said */
+	int err;       /* fstatat errno, 0 if the entry is usable */
+	bool has_stat; /* st was filled in, otherwise it is zeroed */
+	struct stat st;
+	char *link; /* symlink target if META_LINK read it, otherwise NULL */
+	int link_err; /* readlinkat errno if reading the target failed */
+} dentry_t;
+
+typedef struct dentries_t {
+	dentry_t *arr;
+	int size;
+	int cap;
+	int nerrs;
+	int keep; /* dentries_scan may drop all but the first this many, or 0 */
+	/* blocks and size of the entries dentries_head dropped that would
+	 * have been listed, for the total line */
+	blkcnt_t dropped_blocks;
+	off_t dropped_size;
+} dentries_t;
+
+bool needs_stat(uint8_t, unsigned char);
+int dentries_read(int, dentries_t *, uint8_t);
+int dentries_scan(int, dentries_t *, uint8_t);
+struct dirent;
+dentry_t *dentries_append(dentries_t *, const struct dirent *);
+int dentry_fetch(int, dentry_t *, uint8_t);
+int dentries_fetch(int, dentries_t *, uint8_t);
+void dentries_sort(dentries_t *);
+void dentries_head(dentries_t *, int);
+void dentries_free(dentries_t *);
+struct fileinfos_t;
+int dir_list(const FTSENT *, struct fileinfos_t *);
+
+#endif /* _DIR_H_ */
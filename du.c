@@ -0,0 +1,310 @@
+#include "du.h"
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "format.h"
+#include "ls.h"
+#include "output.h"
+#include "stats.h"
+
+extern config_t ls_config;
+
+/* slots the inode set starts with, it doubles when half full */
+#define DU_INODES_INIT 256
+
+typedef struct du_totals_t {
+	uint64_t blocks; /* 512-byte */
+	uint64_t size;
+	uint64_t files; /* entries other than directories */
+} du_totals_t;
+
+/*
+ * A directory being listed under --du. contents is what was listed below it
+ * and goes to its parent when it is left; its own blocks and size were
+ * counted when the parent listed it.
+ */
+typedef struct du_dir_t {
+	char *path;
+	int level;
+	du_totals_t own;
+	du_totals_t contents;
+} du_dir_t;
+
+/* a directory that was left, with everything under it and itself */
+typedef struct du_row_t {
+	char *path;
+	du_totals_t total;
+} du_row_t;
+
+/* a file with more than one link that was counted already */
+typedef struct du_inode_t {
+	dev_t dev;
+	ino_t ino;
+	bool used;
+} du_inode_t;
+
+/*
+ * Subtree totals, added up in one pass over the listing. Directories are
+ * entered in preorder and left in postorder, both by the thread that prints,
+ * so there is no lock.
+ */
+typedef struct du_t {
+	du_dir_t *stack; /* entered and not left yet, innermost last */
+	int depth;
+	int stack_cap;
+	du_row_t *rows; /* in postorder */
+	int nrows;
+	int rows_cap;
+	du_inode_t *inodes; /* open addressing on (dev, ino) */
+	size_t ninodes;
+	size_t inodes_cap;
+} du_t;
+
+du_t du;
+
+void *du_grow(void *, int *, size_t);
+void du_sum(du_totals_t *, const du_totals_t *);
+uint64_t du_hash(dev_t, ino_t);
+bool du_first_link(dev_t, ino_t);
+uint64_t du_blocks(uint64_t);
+void du_enter(int, const char *, blkcnt_t, off_t);
+void du_add(const char *, const struct stat *);
+void du_leave(int);
+void du_print(void);
+
+/*
+ * Double an array of *cap elements of elem_size
+ */
+void *
+du_grow(void *arr, int *cap, size_t elem_size)
+{
+	*cap = *cap == 0 ? INIT_CAP : *cap * 2;
+	if ((arr = realloc(arr, *cap * elem_size)) == NULL) {
+		err(EXIT_FAILURE, "failed to realloc --du totals");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+	return arr;
+}
+
+/*
+ * Add totals to sum
+ */
+void
+du_sum(du_totals_t *sum, const du_totals_t *totals)
+{
+	sum->blocks += totals->blocks;
+	sum->size += totals->size;
+	sum->files += totals->files;
+}
+
+/*
+ * Slot hash of an inode, the multiplier spreads consecutive inode numbers
+ */
+uint64_t
+du_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h;
+
+	h = (uint64_t)ino ^ ((uint64_t)dev << 32);
+	h *= UINT64_C(0x9e3779b97f4a7c15);
+	return h ^ (h >> 29);
+}
+
+/*
+ * Record (dev, ino), returning whether it wasn't recorded already
+ */
+bool
+du_first_link(dev_t dev, ino_t ino)
+{
+	size_t i, mask;
+	du_inode_t *old;
+	size_t old_cap;
+
+	if (du.ninodes * 2 >= du.inodes_cap) {
+		old = du.inodes;
+		old_cap = du.inodes_cap;
+		du.inodes_cap = old_cap == 0 ? DU_INODES_INIT : old_cap * 2;
+		if ((du.inodes = calloc(du.inodes_cap, sizeof(du_inode_t))) ==
+		    NULL) {
+			err(EXIT_FAILURE, "failed to allocate inode set");
+		}
+		STATS_COUNT(COUNT_ALLOC, 1);
+		du.ninodes = 0;
+		for (i = 0; i < old_cap; ++i) {
+			if (old[i].used) {
+				(void)du_first_link(old[i].dev, old[i].ino);
+			}
+		}
+		free(old);
+	}
+
+	mask = du.inodes_cap - 1;
+	for (i = du_hash(dev, ino) & mask; du.inodes[i].used;
+	     i = (i + 1) & mask) {
+		if (du.inodes[i].dev == dev && du.inodes[i].ino == ino) {
+			return false;
+		}
+	}
+	du.inodes[i].dev = dev;
+	du.inodes[i].ino = ino;
+	du.inodes[i].used = true;
+	du.ninodes++;
+	return true;
+}
+
+/*
+ * Start the totals of a directory about to be listed. blocks and size are
+ * its own.
+ */
+void
+du_enter(int level, const char *path, blkcnt_t blocks, off_t size)
+{
+	du_dir_t *dir;
+
+	if (du.depth == du.stack_cap) {
+		du.stack = du_grow(du.stack, &du.stack_cap, sizeof(du_dir_t));
+	}
+	dir = &du.stack[du.depth++];
+	(void)memset(dir, 0, sizeof(du_dir_t));
+	STRDUP("couldn't strdup directory path", dir->path, path);
+	dir->level = level;
+	dir->own.blocks = blocks;
+	dir->own.size = size;
+}
+
+/*
+ * Count an entry listed in the innermost directory entered. Files with more
+ * than one link are only counted the first time, and the . and .. of -a are
+ * counted as the directories they are.
+ */
+void
+du_add(const char *name, const struct stat *st)
+{
+	du_totals_t *totals;
+
+	if (du.depth == 0 || strcmp(name, ".") == 0 ||
+	    strcmp(name, "..") == 0) {
+		return;
+	}
+	if (!S_ISDIR(st->st_mode) && st->st_nlink > 1 &&
+	    !du_first_link(st->st_dev, st->st_ino)) {
+		return;
+	}
+	totals = &du.stack[du.depth - 1].contents;
+	totals->blocks += st->st_blocks;
+	totals->size += st->st_size;
+	if (!S_ISDIR(st->st_mode)) {
+		totals->files++;
+	}
+}
+
+/*
+ * Finish the directory at level if it was entered: keep its row and add
+ * what was under it to its parent
+ */
+void
+du_leave(int level)
+{
+	du_dir_t *dir;
+	du_row_t *row;
+
+	if (du.depth == 0 || du.stack[du.depth - 1].level != level) {
+		return;
+	}
+	dir = &du.stack[--du.depth];
+	if (du.depth > 0) {
+		du_sum(&du.stack[du.depth - 1].contents, &dir->contents);
+	}
+	if (du.nrows == du.rows_cap) {
+		du.rows = du_grow(du.rows, &du.rows_cap, sizeof(du_row_t));
+	}
+	row = &du.rows[du.nrows++];
+	row->path = dir->path;
+	row->total = dir->own;
+	du_sum(&row->total, &dir->contents);
+}
+
+/*
+ * 512-byte blocks in the -s units, rounded up
+ */
+uint64_t
+du_blocks(uint64_t blocks)
+{
+	return (blocks * 512 + ls_config.blocksize - 1) / ls_config.blocksize;
+}
+
+/*
+ * Print a row per directory in postorder, as du(1) would, after a blank
+ * line: blocks in the -s units (or -h), apparent size and number of files
+ * under it, the directory itself included in the first two, and its path.
+ * Frees the rows.
+ */
+void
+du_print(void)
+{
+	int i;
+	int len, blocks_len, size_len, files_len;
+	bool human_readable;
+	human_t h;
+	du_row_t *row;
+
+	if (du.nrows == 0) {
+		return;
+	}
+	human_readable = ls_config.blkcount_fmt == HUMAN_READABLE;
+	blocks_len = size_len = files_len = 0;
+	for (i = 0; i < du.nrows; ++i) {
+		row = &du.rows[i];
+		if (human_readable) {
+			human_size(&h, row->total.blocks * 512, true);
+			if ((len = human_len(&h)) > blocks_len) {
+				blocks_len = len;
+			}
+			human_size(&h, row->total.size, true);
+			len = human_len(&h);
+		} else {
+			len = count_digits(du_blocks(row->total.blocks));
+			if (len > blocks_len) {
+				blocks_len = len;
+			}
+			len = count_digits(row->total.size);
+		}
+		if (len > size_len) {
+			size_len = len;
+		}
+		if ((len = count_digits(row->total.files)) > files_len) {
+			files_len = len;
+		}
+	}
+
+	out_newline();
+	for (i = 0; i < du.nrows; ++i) {
+		row = &du.rows[i];
+		if (human_readable) {
+			out_human(row->total.blocks * 512, true, blocks_len);
+			out_char(' ');
+			out_human(row->total.size, true, size_len);
+		} else {
+			out_ulong(du_blocks(row->total.blocks), blocks_len);
+			out_char(' ');
+			out_ulong(row->total.size, size_len);
+		}
+		out_char(' ');
+		out_ulong(row->total.files, files_len);
+		out_char(' ');
+		print_name(row->path);
+		out_newline();
+		free(row->path);
+	}
+	out_dir_end();
+
+	free(du.rows);
+	free(du.stack);
+	free(du.inodes);
+	(void)memset(&du, 0, sizeof(du_t));
+}
@@ -0,0 +1,12 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef _DU_H_
+#define _DU_H_
+
+void du_enter(int, const char *, blkcnt_t, off_t);
+void du_add(const char *, const struct stat *);
+void du_leave(int);
+void du_print(void);
+
+#endif /* _DU_H_ */
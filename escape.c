@@ -0,0 +1,210 @@
+#include "escape.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "output.h"
+
+/*
+ * Bytes escape_scan looks at per step. Only whole vectors inside the string
+ * are loaded, the bytes after the last one are checked one at a time.
+ */
+#if defined(__AVX2__)
+#define SCAN_WIDTH 32
+#elif defined(__SSE2__)
+#define SCAN_WIDTH 16
+#endif
+
+size_t escape_scan(const char *, size_t, unsigned char);
+size_t escape_char(const char *, bool *);
+void escape_byte(unsigned char);
+void escape_print(const char *, bool);
+void escape_print_q(const char *);
+void escape_print_b(const char *);
+
+/*
+ * Length of the leading run of the len bytes at str that prints as itself:
+ * printable ASCII other than stop. It ends at a control character, DEL,
+ * stop or a byte with the high bit set, or after len bytes.
+ */
+size_t
+escape_scan(const char *str, size_t len, unsigned char stop)
+{
+	size_t i;
+	const unsigned char *p;
+#ifdef SCAN_WIDTH
+	uint32_t mask;
+#if defined(__AVX2__)
+	__m256i v, bad;
+#else
+	__m128i v, bad;
+#endif
+#endif
+
+	i = 0;
+	p = (const unsigned char *)str;
+#ifdef SCAN_WIDTH
+	for (; i + SCAN_WIDTH <= len; i += SCAN_WIDTH) {
+		/* bytes compare signed, so the high bit ones are below ' ' */
+#if defined(__AVX2__)
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		bad = _mm256_or_si256(
+		    _mm256_cmpgt_epi8(_mm256_set1_epi8(' '), v),
+		    _mm256_or_si256(
+		        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)),
+		        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(stop))));
+		mask = (uint32_t)_mm256_movemask_epi8(bad);
+#else
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		bad = _mm_or_si128(
+		    _mm_cmplt_epi8(v, _mm_set1_epi8(' ')),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)),
+		                 _mm_cmpeq_epi8(v, _mm_set1_epi8(stop))));
+		mask = (uint32_t)_mm_movemask_epi8(bad);
+#endif
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	for (; i < len && p[i] >= ' ' && p[i] < 0x7f && p[i] != stop; ++i) {
+		continue;
+	}
+	return i;
+}
+
+/*
+ * Length of the character at str, which isn't printable ASCII, and whether
+ * the locale considers it printable. Bytes that don't start a valid
+ * character are taken one at a time.
+ */
+size_t
+escape_char(const char *str, bool *printable)
+{
+	size_t len;
+	wchar_t wc;
+	mbstate_t state;
+
+	if (MB_CUR_MAX == 1) {
+		*printable = isprint((unsigned char)*str) != 0;
+		return 1;
+	}
+	(void)memset(&state, 0, sizeof(mbstate_t));
+	/* the nul stops it before the end of str */
+	len = mbrtowc(&wc, str, MB_CUR_MAX, &state);
+	if (len == 0 || len == (size_t)-1 || len == (size_t)-2) {
+		*printable = false;
+		return 1;
+	}
+	*printable = iswprint(wc) != 0;
+	return len;
+}
+
+/*
+ * Print c for -b: its C escape if it has one, otherwise \ and three octal
+ * digits.
+ */
+void
+escape_byte(unsigned char c)
+{
+	char buf[4];
+
+	buf[0] = '\\';
+	switch (c) {
+	case '\a':
+		buf[1] = 'a';
+		break;
+	case '\b':
+		buf[1] = 'b';
+		break;
+	case '\f':
+		buf[1] = 'f';
+		break;
+	case '\n':
+		buf[1] = 'n';
+		break;
+	case '\r':
+		buf[1] = 'r';
+		break;
+	case '\t':
+		buf[1] = 't';
+		break;
+	case '\v':
+		buf[1] = 'v';
+		break;
+	case '\\':
+		buf[1] = '\\';
+		break;
+	default:
+		buf[1] = '0' + (c >> 6);
+		buf[2] = '0' + ((c >> 3) & 07);
+		buf[3] = '0' + (c & 07);
+		out_mem(buf, 4);
+		return;
+	}
+	out_mem(buf, 2);
+}
+
+/*
+ * Print a name for -q, replacing each character that isn't printable in the
+ * locale with a ?, or with escape (-b) each of its bytes with escape_byte.
+ * Printable runs are found by escape_scan and copied as they are, only the
+ * bytes it stops at are looked at one by one.
+ */
+void
+escape_print(const char *str, bool escape)
+{
+	size_t i, len;
+	bool printable;
+	const char *end;
+
+	end = str + strlen(str);
+	for (;;) {
+		/* -b escapes \ too, so its output can be read back */
+		len = escape_scan(str, end - str, escape ? '\\' : '\0');
+		out_mem(str, len);
+		str += len;
+		if (str == end) {
+			return;
+		}
+		if (*str == '\\') {
+			escape_byte('\\');
+			str++;
+			continue;
+		}
+		len = escape_char(str, &printable);
+		if (printable) {
+			out_mem(str, len);
+		} else if (escape) {
+			for (i = 0; i < len; ++i) {
+				escape_byte((unsigned char)str[i]);
+			}
+		} else {
+			out_char('?');
+		}
+		str += len;
+	}
+}
+
+/*
+ * escape_print for -q and for -b, to be picked once instead of per name
+ */
+void
+escape_print_q(const char *str)
+{
+	escape_print(str, false);
+}
+
+void
+escape_print_b(const char *str)
+{
+	escape_print(str, true);
+}
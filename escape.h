@@ -0,0 +1,12 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef _ESCAPE_H_
+#define _ESCAPE_H_
+
+size_t escape_scan(const char *, size_t, unsigned char);
+void escape_print(const char *, bool);
+void escape_print_q(const char *);
+void escape_print_b(const char *);
+
+#endif /* _ESCAPE_H_ */
@@ -0,0 +1,255 @@
+#include "fetch.h"
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "trace.h"
+
+extern config_t ls_config;
+
+/* most entries claimed at once, so a big directory still gets spread out */
+#define FETCH_CHUNK_MAX 16
+
+/*
+ * The entries of one directory waiting for their metadata. Chunks of them are
+ * claimed by the pool threads and by the thread that submitted the batch.
+ */
+typedef struct fetch_batch_t {
+	int dirfd;
+	dentries_t *dentries;
+	uint8_t needs;
+	int next;  /* first entry not claimed yet */
+	int busy;  /* chunks claimed but not finished */
+	int nerrs; /* failed stats */
+	struct fetch_batch_t *next_batch;
+} fetch_batch_t;
+
+/*
+ * --async backend: threads that issue the fstatat and readlinkat calls of
+ * every submitted directory concurrently, so slow storage sees queue depth
+ * requests at a time instead of one. Started on first use.
+ */
+typedef struct fetch_pool_t {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond; /* a batch was submitted or the pool stops */
+	pthread_cond_t done_cond; /* a chunk finished */
+	fetch_batch_t *batches;   /* batches with unclaimed entries, oldest first */
+	bool started;
+	bool stopping;
+	int nthreads;
+	pthread_t *threads;
+} fetch_pool_t;
+
+fetch_pool_t fetch_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	                    PTHREAD_COND_INITIALIZER, NULL, false, false, 0,
+	                    NULL };
+
+void fetch_start(void);
+bool fetch_claim(fetch_batch_t *, int *, int *);
+void fetch_run(fetch_batch_t *, int, int);
+void *fetch_worker(void *);
+int fetch_dentries(int, dentries_t *, uint8_t);
+void fetch_stop(void);
+
+/*
+ * Start the pool threads. The submitting thread works on its own batch too,
+ * so one less than the queue depth is needed. If the system won't create
+ * that many, the pool makes do with the ones it got. Called with the lock
+ * held.
+ */
+void
+fetch_start(void)
+{
+	int i;
+
+	fetch_pool.started = true;
+	fetch_pool.nthreads = ls_config.fetch_depth - 1;
+	if (fetch_pool.nthreads == 0) {
+		return;
+	}
+	if ((fetch_pool.threads =
+	         calloc(fetch_pool.nthreads, sizeof(pthread_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate fetch threads");
+	}
+	for (i = 0; i < fetch_pool.nthreads; ++i) {
+		if ((errno = pthread_create(&fetch_pool.threads[i], NULL,
+		                            fetch_worker, NULL)) != 0) {
+			warn("pthread_create, %d fetch threads", i);
+			fetch_pool.nthreads = i;
+			break;
+		}
+	}
+}
+
+/*
+ * Claim the next chunk of batch as [*start, *end), sized so every thread
+ * gets a share of what is left. Called with the lock held, returns false if
+ * everything was claimed already.
+ */
+bool
+fetch_claim(fetch_batch_t *batch, int *start, int *end)
+{
+	int chunk;
+	fetch_batch_t **bp;
+
+	if (batch->next == batch->dentries->size) {
+		return false;
+	}
+	chunk = (batch->dentries->size - batch->next) /
+	        (2 * (fetch_pool.nthreads + 1));
+	if (chunk < 1) {
+		chunk = 1;
+	} else if (chunk > FETCH_CHUNK_MAX) {
+		chunk = FETCH_CHUNK_MAX;
+	}
+	*start = batch->next;
+	*end = batch->next + chunk;
+	batch->next = *end;
+	batch->busy++;
+
+	/* nothing left for the pool threads to take */
+	if (batch->next == batch->dentries->size) {
+		for (bp = &fetch_pool.batches; *bp != NULL;
+		     bp = &(*bp)->next_batch) {
+			if (*bp == batch) {
+				*bp = batch->next_batch;
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+/*
+ * Fetch the entries [start, end) of batch that need it and report the chunk
+ * as finished.
+ */
+void
+fetch_run(fetch_batch_t *batch, int start, int end)
+{
+	int i;
+	int nerrs;
+	dentry_t *dentry;
+
+	nerrs = 0;
+	for (i = start; i < end; ++i) {
+		dentry = &batch->dentries->arr[i];
+		if (needs_stat(batch->needs, IFTODT(dentry->type)) &&
+		    dentry_fetch(batch->dirfd, dentry, batch->needs) != 0) {
+			nerrs++;
+		}
+	}
+
+	pthread_mutex_lock(&fetch_pool.lock);
+	batch->nerrs += nerrs;
+	if (--batch->busy == 0 && batch->next == batch->dentries->size) {
+		pthread_cond_broadcast(&fetch_pool.done_cond);
+	}
+	pthread_mutex_unlock(&fetch_pool.lock);
+}
+
+/*
+ * Pool thread main loop
+ */
+void *
+fetch_worker(void *arg)
+{
+	int start, end;
+	fetch_batch_t *batch;
+
+	(void)arg;
+	TRACE_THREAD("fetch worker");
+	pthread_mutex_lock(&fetch_pool.lock);
+	for (;;) {
+		while (fetch_pool.batches == NULL && !fetch_pool.stopping) {
+			pthread_cond_wait(&fetch_pool.work_cond,
+			                  &fetch_pool.lock);
+		}
+		if (fetch_pool.batches == NULL) {
+			break;
+		}
+		batch = fetch_pool.batches;
+		if (fetch_claim(batch, &start, &end)) {
+			pthread_mutex_unlock(&fetch_pool.lock);
+			fetch_run(batch, start, end);
+			pthread_mutex_lock(&fetch_pool.lock);
+		}
+	}
+	pthread_mutex_unlock(&fetch_pool.lock);
+	return NULL;
+}
+
+/*
+ * Stat (and readlink, for META_LINK) every entry of dentries that needs calls
+ * for, read from the directory open on dirfd, with up to
+ * ls_config.fetch_depth calls in flight. Returns the number of failed stats.
+ * Can be called from several threads at once.
+ */
+int
+fetch_dentries(int dirfd, dentries_t *dentries, uint8_t needs)
+{
+	int start, end;
+	uint64_t span_start;
+	fetch_batch_t batch;
+	fetch_batch_t **bp;
+
+	if (dentries->size == 0) {
+		return 0;
+	}
+	span_start = TRACE_START();
+	(void)memset(&batch, 0, sizeof(fetch_batch_t));
+	batch.dirfd = dirfd;
+	batch.dentries = dentries;
+	batch.needs = needs;
+
+	pthread_mutex_lock(&fetch_pool.lock);
+	if (!fetch_pool.started) {
+		fetch_start();
+	}
+	for (bp = &fetch_pool.batches; *bp != NULL; bp = &(*bp)->next_batch) {
+		continue;
+	}
+	*bp = &batch;
+	pthread_cond_broadcast(&fetch_pool.work_cond);
+
+	while (fetch_claim(&batch, &start, &end)) {
+		pthread_mutex_unlock(&fetch_pool.lock);
+		fetch_run(&batch, start, end);
+		pthread_mutex_lock(&fetch_pool.lock);
+	}
+	while (batch.busy > 0) {
+		pthread_cond_wait(&fetch_pool.done_cond, &fetch_pool.lock);
+	}
+	pthread_mutex_unlock(&fetch_pool.lock);
+	TRACE_SPAN("fetch", span_start, NULL, dentries->size);
+
+	return batch.nerrs;
+}
+
+/*
+ * Stop and join the pool threads, if they were ever started.
+ */
+void
+fetch_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&fetch_pool.lock);
+	fetch_pool.stopping = true;
+	pthread_cond_broadcast(&fetch_pool.work_cond);
+	pthread_mutex_unlock(&fetch_pool.lock);
+
+	for (i = 0; i < fetch_pool.nthreads; ++i) {
+		if ((errno = pthread_join(fetch_pool.threads[i], NULL)) != 0) {
+			err(EXIT_FAILURE, "pthread_join");
+		}
+	}
+	free(fetch_pool.threads);
+	fetch_pool.threads = NULL;
+	fetch_pool.nthreads = 0;
+}
@@ -0,0 +1,17 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dir.h"
+
+#ifndef _FETCH_H_
+#define _FETCH_H_
+
+/* stat calls kept in flight by --async when --queue-depth isn't given */
+#define FETCH_DEFAULT_DEPTH 32
+/* most --queue-depth accepts, the pool has a thread per call in flight */
+#define FETCH_MAX_DEPTH 256
+
+int fetch_dentries(int, dentries_t *, uint8_t);
+void fetch_stop(void);
+
+#endif /* _FETCH_H_ */
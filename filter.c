@@ -0,0 +1,291 @@
+#include "filter.h"
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ls.h"
+
+extern config_t ls_config;
+
+/*
+ * What --include, --exclude, --type, --min-size, --max-size, --min-age and
+ * --max-age ask of the entries listed
+ */
+typedef struct filter_t {
+	const char **include; /* a name has to match one, if there are any */
+	int ninclude;
+	const char **exclude; /* neither listed nor descended into */
+	int nexclude;
+	uint16_t types; /* bit IFTODT() of every --type, 0 for any type */
+	off_t min_size;
+	off_t max_size; /* -1 for no bound */
+	time_t min_age; /* in seconds before ls_config.now, by mtime */
+	time_t max_age; /* -1 for no bound */
+} filter_t;
+
+filter_t filter = { NULL, 0, NULL, 0, 0, 0, -1, 0, -1 };
+
+/* worth of each unit suffix, in bytes and in seconds */
+const char size_units[] = "kKMGT";
+const int64_t size_scales[] = { 1LL << 10, 1LL << 10, 1LL << 20, 1LL << 30,
+	                        1LL << 40 };
+const char age_units[] = "smhdw";
+const int64_t age_scales[] = { 1, 60, 3600, 86400, 604800 };
+
+int64_t filter_amount(const char *, const char *, const char *,
+                      const int64_t *, int64_t);
+bool filter_included(const char *);
+bool filter_type(mode_t);
+void filter_glob(const char *, bool);
+void filter_types(const char *);
+void filter_size(const char *, bool);
+void filter_age(const char *, bool);
+uint8_t filter_needs(void);
+bool filter_pruned(const char *);
+bool filter_name(const char *, mode_t);
+bool filter_match(const char *, mode_t, const struct stat *);
+bool filter_dentry(const dentry_t *);
+
+/*
+ * Parse a count and an optional unit, one of the characters of units worth
+ * that entry of scales, or dflt without one.
+ */
+int64_t
+filter_amount(const char *optname, const char *arg, const char *units,
+              const int64_t *scales, int64_t dflt)
+{
+	long long n;
+	int64_t scale;
+	char *end;
+	const char *unit;
+
+	errno = 0;
+	n = strtoll(arg, &end, 10);
+	scale = 0;
+	if (*end == '\0') {
+		scale = dflt;
+	} else if (end[1] == '\0' && (unit = strchr(units, *end)) != NULL) {
+		scale = scales[unit - units];
+	}
+	if (errno != 0 || end == arg || n < 0 || scale == 0 ||
+	    n > INT64_MAX / scale) {
+		errx(EXIT_FAILURE, "invalid %s: %s", optname, arg);
+	}
+	return n * scale;
+}
+
+/*
+ * Whether name matches an --include glob, or there are none
+ */
+bool
+filter_included(const char *name)
+{
+	int i;
+
+	if (filter.ninclude == 0) {
+		return true;
+	}
+	for (i = 0; i < filter.ninclude; ++i) {
+		if (fnmatch(filter.include[i], name, 0) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Whether the file type of mode is one --type asked for
+ */
+bool
+filter_type(mode_t mode)
+{
+	return filter.types == 0 || (filter.types & 1 << IFTODT(mode)) != 0;
+}
+
+/*
+ * --include glob, or --exclude glob with exclude
+ */
+void
+filter_glob(const char *glob, bool exclude)
+{
+	const char ***globs;
+	int *n;
+
+	globs = exclude ? &filter.exclude : &filter.include;
+	n = exclude ? &filter.nexclude : &filter.ninclude;
+	if ((*globs = realloc(*globs, (*n + 1) * sizeof(char *))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate globs");
+	}
+	(*globs)[(*n)++] = glob;
+}
+
+/*
+ * --type letters, as find(1) spells them
+ */
+void
+filter_types(const char *letters)
+{
+	mode_t mode;
+
+	for (; *letters != '\0'; ++letters) {
+		switch (*letters) {
+		case 'f':
+			mode = S_IFREG;
+			break;
+		case 'd':
+			mode = S_IFDIR;
+			break;
+		case 'l':
+			mode = S_IFLNK;
+			break;
+		case 'p':
+			mode = S_IFIFO;
+			break;
+		case 's':
+			mode = S_IFSOCK;
+			break;
+		case 'c':
+			mode = S_IFCHR;
+			break;
+		case 'b':
+			mode = S_IFBLK;
+			break;
+		default:
+			errx(EXIT_FAILURE, "invalid type: %c", *letters);
+		}
+		filter.types |= 1 << IFTODT(mode);
+	}
+}
+
+/*
+ * --min-size n, or --max-size n with max. n is in bytes, or with a k, M, G
+ * or T suffix in powers of 1024.
+ */
+void
+filter_size(const char *arg, bool max)
+{
+	off_t size;
+
+	size = filter_amount("size", arg, size_units, size_scales, 1);
+	if (max) {
+		filter.max_size = size;
+	} else {
+		filter.min_size = size;
+	}
+}
+
+/*
+ * --min-age n, or --max-age n with max. n is in days, or with an s, m, h, d
+ * or w suffix in those units.
+ */
+void
+filter_age(const char *arg, bool max)
+{
+	time_t age;
+
+	age = filter_amount("age", arg, age_units, age_scales, 86400);
+	if (max) {
+		filter.max_age = age;
+	} else {
+		filter.min_age = age;
+	}
+}
+
+/*
+ * META_* bits the filters need to decide on an entry
+ */
+uint8_t
+filter_needs(void)
+{
+	uint8_t needs;
+
+	needs = 0;
+	if (filter.types != 0) {
+		SET(needs, META_TYPE);
+	}
+	if (filter.min_size > 0 || filter.max_size >= 0) {
+		SET(needs, META_SIZE);
+	}
+	if (filter.min_age > 0 || filter.max_age >= 0) {
+		SET(needs, META_TIME);
+	}
+	return needs;
+}
+
+/*
+ * Whether name matches an --exclude glob, so a directory of that name isn't
+ * descended into either
+ */
+bool
+filter_pruned(const char *name)
+{
+	int i;
+
+	for (i = 0; i < filter.nexclude; ++i) {
+		if (fnmatch(filter.exclude[i], name, 0) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * What can be decided from the directory entry alone, before any stat: false
+ * if the name or, when type isn't 0, the d_type file type rules the entry
+ * out. Under -R a directory is kept to be descended into unless --exclude
+ * prunes it, whether it is listed or not.
+ */
+bool
+filter_name(const char *name, mode_t type)
+{
+	if (filter_pruned(name)) {
+		return false;
+	}
+	if (ls_config.recurse == FULL_DEPTH && (type == 0 || S_ISDIR(type))) {
+		return true;
+	}
+	return filter_included(name) && (type == 0 || filter_type(type));
+}
+
+/*
+ * Whether an entry is listed. st is NULL if it wasn't stat-ed, which only
+ * happens when filter_needs() didn't ask for it.
+ */
+bool
+filter_match(const char *name, mode_t mode, const struct stat *st)
+{
+	time_t age;
+
+	if (filter_pruned(name) || !filter_included(name) ||
+	    !filter_type(mode)) {
+		return false;
+	}
+	if (st == NULL) {
+		return true;
+	}
+	if (st->st_size < filter.min_size ||
+	    (filter.max_size >= 0 && st->st_size > filter.max_size)) {
+		return false;
+	}
+	age = ls_config.now - st->st_mtim.tv_sec;
+	return age >= filter.min_age &&
+	       (filter.max_age < 0 || age <= filter.max_age);
+}
+
+/*
+ * filter_match() for an entry read with dentries_read() and friends
+ */
+bool
+filter_dentry(const dentry_t *dentry)
+{
+	if (dentry->has_stat) {
+		return filter_match(dentry->name, dentry->st.st_mode,
+		                    &dentry->st);
+	}
+	return filter_match(dentry->name, dentry->type, NULL);
+}
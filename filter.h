@@ -0,0 +1,22 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dir.h"
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+void filter_glob(const char *, bool);
+void filter_types(const char *);
+void filter_size(const char *, bool);
+void filter_age(const char *, bool);
+uint8_t filter_needs(void);
+bool filter_pruned(const char *);
+bool filter_name(const char *, mode_t);
+bool filter_match(const char *, mode_t, const struct stat *);
+bool filter_dentry(const dentry_t *);
+
+#endif /* _FILTER_H_ */
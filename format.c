@@ -0,0 +1,141 @@
+#include "format.h"
+
+/* "00" to "99", so two digits are produced per division */
+const char digit_pairs[] =
+    "000102030405060708091011121314151617181920212223242526272829"
+    "303132333435363738394041424344454647484950515253545556575859"
+    "606162636465666768697071727374757677787980818283848586878889"
+    "90919293949596979899";
+
+/* powers_of_10[i] is the smallest number with i + 2 digits */
+const uint64_t powers_of_10[] = {
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+#define NPOWERS (sizeof(powers_of_10) / sizeof(powers_of_10[0]))
+
+/* unit of each scale, bytes first */
+const char human_prefixes[] = "BKMGTPE";
+
+#define HUMAN_MAX_SCALE ((int)sizeof(human_prefixes) - 2)
+/* humanize_number keeps values multiplied by 100 to round them */
+#define HUMAN_FITS (100 * 1000 - 50)
+
+/*
+ * get the number of digits in a number
+ */
+int
+count_digits(uint64_t n)
+{
+	size_t i;
+
+	for (i = 0; i < NPOWERS && n >= powers_of_10[i]; ++i) {
+		continue;
+	}
+	return i + 1;
+}
+
+/*
+ * Writes n in decimal to buf, which must hold count_digits(n) bytes, and
+ * returns the length written. No nul is added.
+ */
+size_t
+format_ulong(char *buf, uint64_t n)
+{
+	size_t len;
+	char *p;
+	const char *pair;
+
+	len = count_digits(n);
+	p = buf + len;
+	while (n >= 100) {
+		pair = &digit_pairs[(n % 100) * 2];
+		n /= 100;
+		*--p = pair[1];
+		*--p = pair[0];
+	}
+	if (n >= 10) {
+		pair = &digit_pairs[n * 2];
+		*--p = pair[1];
+		*--p = pair[0];
+	} else {
+		*--p = '0' + n;
+	}
+	return len;
+}
+
+/*
+ * Scales size into h. decimal is HN_DECIMAL: values below 10 in a unit other
+ * than bytes keep one fractional digit.
+ */
+void
+human_size(human_t *h, uint64_t size, bool decimal)
+{
+	int i;
+	uint64_t bytes;
+
+	i = 0;
+	/* sizes over 160PB would overflow when multiplied by 100 */
+	if (size > UINT64_MAX / 100) {
+		size /= 1024;
+		i++;
+	}
+	for (bytes = size * 100; bytes >= HUMAN_FITS && i < HUMAN_MAX_SCALE;
+	     i++) {
+		bytes /= 1024;
+	}
+	h->prefix = human_prefixes[i];
+	if (bytes < 995 && i > 0 && decimal) {
+		bytes = (bytes + 5) / 10;
+		h->whole = bytes / 10;
+		h->tenths = bytes % 10;
+	} else {
+		h->whole = (bytes + 50) / 100;
+		h->tenths = -1;
+	}
+}
+
+/*
+ * length of h once rendered by format_human
+ */
+int
+human_len(const human_t *h)
+{
+	return count_digits(h->whole) + (h->tenths < 0 ? 0 : 2) + 1;
+}
+
+/*
+ * Writes h to buf, which must hold human_len(h) bytes, and returns the length
+ * written. No nul is added.
+ */
+size_t
+format_human(char *buf, const human_t *h)
+{
+	char *p;
+
+	p = buf + format_ulong(buf, h->whole);
+	if (h->tenths >= 0) {
+		*p++ = '.';
+		*p++ = '0' + h->tenths;
+	}
+	*p++ = h->prefix;
+	return p - buf;
+}
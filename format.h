@@ -0,0 +1,30 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+/* longest humanized size ("999B", "9.9K", "99K"), plus nul */
+#define HUMAN_SIZE_LEN 5
+/* longest uint64_t in decimal, plus nul */
+#define ULONG_STR_LEN 21
+
+/*
+ * A size scaled the way humanize_number(3) does with AUTOSCALE, NOSPACE and
+ * B for a HUMAN_SIZE_LEN buffer, kept as numbers so the width can be known
+ * without rendering it.
+ */
+typedef struct human_t {
+	uint64_t whole;
+	int tenths; /* -1 if there is no fractional digit */
+	char prefix;
+} human_t;
+
+int count_digits(uint64_t);
+size_t format_ulong(char *, uint64_t);
+void human_size(human_t *, uint64_t, bool);
+int human_len(const human_t *);
+size_t format_human(char *, const human_t *);
+
+#endif /* _FORMAT_H_ */
@@ -0,0 +1,181 @@
+#include "head.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ls.h"
+#include "record.h"
+#include "sort.h"
+#include "stats.h"
+
+extern config_t ls_config;
+
+/*
+ * An entry kept for --head-global, named by its path from the operand
+ */
+typedef struct head_entry_t {
+	char *parent;     /* fts_path of its directory, "" for operands */
+	char *path;       /* what the listing shows */
+	const char *name; /* last component, in path */
+	struct stat st;
+	char *link; /* symlink target, NULL if it wasn't read */
+} head_entry_t;
+
+/*
+ * The first ls_config.head_global entries of the traversal in list order
+ * among those seen so far. Only the thread that prints adds to it, so there
+ * is no lock.
+ */
+typedef struct head_t {
+	head_entry_t *entries;
+	sortkey_t *heap; /* keys of the entries, the one listed last on top */
+	int size;
+	char *buf; /* path of the entry being offered */
+	size_t buf_cap;
+} head_t;
+
+head_t head;
+
+const char *head_join(const char *, const char *);
+void head_entry_free(head_entry_t *);
+void head_add(const char *, const char *, const struct stat *, const char *);
+void head_print(fileinfos_t *);
+
+/*
+ * parent/name in a buffer reused for every entry. Like fts, a parent that
+ * already ends in / doesn't get another one.
+ */
+const char *
+head_join(const char *parent, const char *name)
+{
+	size_t parent_len, name_len, len;
+	bool slash;
+
+	parent_len = strlen(parent);
+	name_len = strlen(name);
+	slash = parent_len > 0 && parent[parent_len - 1] != '/';
+	len = parent_len + slash + name_len + 1;
+	if (len > head.buf_cap) {
+		head.buf_cap = len * 2;
+		if ((head.buf = realloc(head.buf, head.buf_cap)) == NULL) {
+			err(EXIT_FAILURE, "failed to allocate path");
+		}
+		STATS_COUNT(COUNT_ALLOC, 1);
+	}
+	(void)memcpy(head.buf, parent, parent_len);
+	if (slash) {
+		head.buf[parent_len] = '/';
+	}
+	(void)memcpy(head.buf + parent_len + slash, name, name_len + 1);
+	return head.buf;
+}
+
+/*
+ * Frees what entry points to
+ */
+void
+head_entry_free(head_entry_t *entry)
+{
+	free(entry->parent);
+	free(entry->path);
+	free(entry->link);
+}
+
+/*
+ * Offer an entry of the directory parent (fts_path, "" for the operands) to
+ * --head-global. It is copied if it is among the first so far, taking the
+ * place of the one listed last once the heap is full. Without sorting the
+ * first entries read stay.
+ */
+void
+head_add(const char *parent, const char *name, const struct stat *statp,
+         const char *link)
+{
+	int i;
+	const char *path;
+	sortkey_t key;
+	head_entry_t *entry;
+
+	if (head.entries == NULL) {
+		if ((head.entries = calloc(ls_config.head_global,
+		                           sizeof(head_entry_t))) == NULL ||
+		    (head.heap = malloc(ls_config.head_global *
+		                        sizeof(sortkey_t))) == NULL) {
+			err(EXIT_FAILURE, "failed to allocate --head-global");
+		}
+		STATS_COUNT(COUNT_ALLOC, 2);
+	}
+
+	path = head_join(parent, name);
+	if (head.size < ls_config.head_global) {
+		i = head.size;
+	} else if (ls_config.entry_compare == NULL) {
+		return;
+	} else {
+		sortkey_init(&key, 0, path, statp);
+		if (sortkey_list_cmp(&key, &head.heap[0]) >= 0) {
+			return;
+		}
+		i = head.heap[0].idx;
+		head_entry_free(&head.entries[i]);
+	}
+
+	entry = &head.entries[i];
+	STRDUP("couldn't strdup entry path", entry->parent, parent);
+	STRDUP("couldn't strdup entry path", entry->path, path);
+	entry->name = entry->path + strlen(entry->path) - strlen(name);
+	entry->st = *statp;
+	entry->link = NULL;
+	if (link != NULL) {
+		STRDUP("couldn't strdup symlink target", entry->link, link);
+	}
+
+	sortkey_init(&key, i, entry->path, &entry->st);
+	if (head.size < ls_config.head_global) {
+		head.heap[head.size] = key;
+		sortkeys_heap_up(head.heap, head.size);
+		head.size++;
+	} else {
+		head.heap[0] = key;
+		sortkeys_heap_down(head.heap, head.size, 0);
+	}
+}
+
+/*
+ * Print the entries --head-global kept as one listing in list order, using
+ * fileinfos for the columns, and free them.
+ */
+void
+head_print(fileinfos_t *fileinfos)
+{
+	int i;
+	head_entry_t *entry;
+
+	if (ls_config.entry_compare != NULL) {
+		sortkeys_sort(head.heap, head.size);
+	}
+	fileinfos_reset(fileinfos);
+	for (i = 0; i < head.size; ++i) {
+		entry = &head.entries[ls_config.entry_compare != NULL
+		                          ? head.heap[i].idx
+		                          : (uint32_t)i];
+		if (ls_config.records != NO_RECORDS) {
+			record_print(entry->parent, entry->name, &entry->st,
+			             entry->link);
+		} else {
+			fileinfos_add(fileinfos, entry->path, &entry->st,
+			              entry->link);
+		}
+	}
+	print_fileinfos(fileinfos);
+
+	for (i = 0; i < head.size; ++i) {
+		head_entry_free(&head.entries[i]);
+	}
+	free(head.entries);
+	free(head.heap);
+	free(head.buf);
+	(void)memset(&head, 0, sizeof(head_t));
+}
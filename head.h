@@ -0,0 +1,11 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef _HEAD_H_
+#define _HEAD_H_
+
+struct fileinfos_t;
+void head_add(const char *, const char *, const struct stat *, const char *);
+void head_print(struct fileinfos_t *);
+
+#endif /* _HEAD_H_ */
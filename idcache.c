@@ -0,0 +1,334 @@
+#include "idcache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ls.h"
+
+#define IDCACHE_INIT_CAP 64
+#define NSSWITCH_CONF "/etc/nsswitch.conf"
+
+/*
+ * Interned name (or decimal id) for every uid or gid seen so far, including
+ * the ones that have no name. Only used from the printing thread, so there is
+ * no locking.
+ */
+typedef struct idcache_entry_t {
+	bool used;
+	unsigned long id;
+	char *name;  /* NULL if the id has no name */
+	char *idstr; /* allocated the first time it's asked for */
+} idcache_entry_t;
+
+typedef struct idcache_t {
+	const char *db;   /* nsswitch.conf database name */
+	const char *file; /* the file the "files" source reads */
+	idcache_entry_t *arr;
+	size_t size;
+	size_t cap;
+	bool checked_files; /* tried to index file already */
+	bool use_files;     /* every id in file is cached, misses are final */
+} idcache_t;
+
+idcache_t user_cache = { "passwd", "/etc/passwd", NULL, 0, 0, false, false };
+idcache_t group_cache = { "group", "/etc/group", NULL, 0, 0, false, false };
+
+idcache_entry_t *idcache_slot(idcache_t *, unsigned long);
+void idcache_grow(idcache_t *);
+idcache_entry_t *idcache_insert(idcache_t *, unsigned long, const char *,
+                                size_t);
+bool nss_files_only(const char *);
+bool idcache_index_file(idcache_t *);
+idcache_entry_t *idcache_get(idcache_t *, unsigned long, bool);
+const char *idcache_name_or_id(idcache_entry_t *, bool);
+const char *user_name_or_id(uid_t, bool);
+const char *group_name_or_id(gid_t, bool);
+
+/*
+ * Find the slot id lives in, or the empty slot it would go in.
+ */
+idcache_entry_t *
+idcache_slot(idcache_t *cache, unsigned long id)
+{
+	size_t i;
+
+	i = (id * 2654435761UL) & (cache->cap - 1);
+	while (cache->arr[i].used && cache->arr[i].id != id) {
+		i = (i + 1) & (cache->cap - 1);
+	}
+	return &cache->arr[i];
+}
+
+/*
+ * Double the table, keeping it at most half full.
+ */
+void
+idcache_grow(idcache_t *cache)
+{
+	size_t i, old_cap;
+	idcache_entry_t *old_arr;
+
+	old_arr = cache->arr;
+	old_cap = cache->cap;
+	cache->cap = old_cap == 0 ? IDCACHE_INIT_CAP : old_cap * 2;
+	if ((cache->arr = calloc(cache->cap, sizeof(idcache_entry_t))) ==
+	    NULL) {
+		err(EXIT_FAILURE, "failed to allocate id cache");
+	}
+	for (i = 0; i < old_cap; ++i) {
+		if (old_arr[i].used) {
+			*idcache_slot(cache, old_arr[i].id) = old_arr[i];
+		}
+	}
+	free(old_arr);
+}
+
+/*
+ * Add id with the first len bytes of name (NULL for no name). An id that is
+ * already cached keeps its name, same as the first match winning in getpwuid.
+ */
+idcache_entry_t *
+idcache_insert(idcache_t *cache, unsigned long id, const char *name,
+               size_t len)
+{
+	idcache_entry_t *entry;
+
+	if ((cache->size + 1) * 2 > cache->cap) {
+		idcache_grow(cache);
+	}
+	entry = idcache_slot(cache, id);
+	if (entry->used) {
+		return entry;
+	}
+	entry->used = true;
+	entry->id = id;
+	entry->name = NULL;
+	entry->idstr = NULL;
+	if (name != NULL && (entry->name = strndup(name, len)) == NULL) {
+		err(EXIT_FAILURE, "couldn't strdup cached name");
+	}
+	cache->size++;
+	return entry;
+}
+
+/*
+ * Check whether nsswitch.conf sends db lookups to nothing but the local files,
+ * in which case they can be read directly.
+ */
+bool
+nss_files_only(const char *db)
+{
+	bool files_only;
+	size_t dblen;
+	char *line, *sources, *source, *brkt;
+	size_t linecap;
+	FILE *fp;
+
+	if ((fp = fopen(NSSWITCH_CONF, "r")) == NULL) {
+		return false;
+	}
+	files_only = false;
+	dblen = strlen(db);
+	line = NULL;
+	linecap = 0;
+	while (getline(&line, &linecap, fp) > 0) {
+		if (strncmp(line, db, dblen) != 0 || line[dblen] != ':') {
+			continue;
+		}
+		sources = line + dblen + 1;
+		sources[strcspn(sources, "#")] = '\0';
+		files_only = false;
+		for (source = strtok_r(sources, " \t\n", &brkt); source != NULL;
+		     source = strtok_r(NULL, " \t\n", &brkt)) {
+			if (strcmp(source, "files") != 0) {
+				files_only = false;
+				break;
+			}
+			files_only = true;
+		}
+	}
+	free(line);
+	(void)fclose(fp);
+	return files_only;
+}
+
+/*
+ * mmap the passwd or group file and cache every name:x:id entry in it. Gives
+ * up (returns false) on anything that isn't a plain local entry, like the
+ * +/- compat lines or an id that is empty or doesn't fit in an id_t, and
+ * leaves the lookups to getpwuid/getgrgid.
+ */
+bool
+idcache_index_file(idcache_t *cache)
+{
+	int fd;
+	int field, digit;
+	bool ok;
+	unsigned long id;
+	size_t len, namelen, ndigits;
+	const char *map, *p, *end, *line, *eol;
+	struct stat st;
+
+	if (!nss_files_only(cache->db)) {
+		return false;
+	}
+	if ((fd = open(cache->file, O_RDONLY | O_CLOEXEC)) < 0) {
+		return false;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		(void)close(fd);
+		return false;
+	}
+	len = (size_t)st.st_size;
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+
+	ok = true;
+	end = map + len;
+	for (line = map; ok && line < end; line = eol + 1) {
+		if ((eol = memchr(line, '\n', end - line)) == NULL) {
+			eol = end;
+		}
+		if (line == eol || *line == '#') {
+			continue;
+		}
+		if (*line == '+' || *line == '-') {
+			ok = false;
+			break;
+		}
+		/* name:password:id:... */
+		namelen = 0;
+		id = 0;
+		ndigits = 0;
+		field = 0;
+		for (p = line; p < eol && field < 3; ++p) {
+			if (*p == ':') {
+				if (field == 0) {
+					namelen = p - line;
+				}
+				field++;
+			} else if (field == 2) {
+				digit = *p - '0';
+				if (digit < 0 || digit > 9 ||
+				    id > ((id_t)-1 - digit) / 10) {
+					ok = false;
+					break;
+				}
+				id = id * 10 + digit;
+				ndigits++;
+			}
+		}
+		if (!ok || field < 2 || namelen == 0 || ndigits == 0) {
+			ok = false;
+			break;
+		}
+		(void)idcache_insert(cache, id, line, namelen);
+	}
+
+	(void)munmap((void *)map, len);
+	return ok;
+}
+
+/*
+ * Look up id, asking getpwuid/getgrgid only on the first miss. Without
+ * resolve (-n) the id is cached without a name and nothing is looked up.
+ */
+idcache_entry_t *
+idcache_get(idcache_t *cache, unsigned long id, bool resolve)
+{
+	idcache_entry_t *entry;
+	struct passwd *pwd;
+	struct group *grp;
+	const char *name;
+	stats_phase_t prev;
+
+	if (!resolve) {
+		if (cache->cap == 0) {
+			idcache_grow(cache);
+		}
+		entry = idcache_slot(cache, id);
+		return entry->used ? entry : idcache_insert(cache, id, NULL, 0);
+	}
+
+	if (!cache->checked_files) {
+		prev = STATS_ENTER(PHASE_NSS);
+		cache->checked_files = true;
+		if (cache->cap == 0) {
+			idcache_grow(cache);
+		}
+		cache->use_files = idcache_index_file(cache);
+		STATS_LEAVE(prev);
+	}
+
+	entry = idcache_slot(cache, id);
+	if (entry->used || cache->use_files) {
+		/* with the file indexed a miss means there is no name */
+		return entry->used ? entry : idcache_insert(cache, id, NULL, 0);
+	}
+
+	name = NULL;
+	prev = STATS_ENTER(PHASE_NSS);
+	if (cache == &user_cache) {
+		STATS_COUNT(COUNT_GETPWUID, 1);
+		if ((pwd = getpwuid((uid_t)id)) != NULL) {
+			name = pwd->pw_name;
+		}
+	} else {
+		STATS_COUNT(COUNT_GETGRGID, 1);
+		if ((grp = getgrgid((gid_t)id)) != NULL) {
+			name = grp->gr_name;
+		}
+	}
+	entry = idcache_insert(cache, id, name, name == NULL ? 0 : strlen(name));
+	STATS_LEAVE(prev);
+	return entry;
+}
+
+/*
+ * The cached name, or the id itself when asked for or when there is no name.
+ */
+const char *
+idcache_name_or_id(idcache_entry_t *entry, bool id_only)
+{
+	if (entry->name != NULL && !id_only) {
+		return entry->name;
+	}
+	if (entry->idstr == NULL) {
+		ASPRINTF("couldn't alloc string for id", &entry->idstr, "%lu",
+		         entry->id);
+	}
+	return entry->idstr;
+}
+
+/*
+ * Interned owner column for uid, shared by every entry with that owner.
+ */
+const char *
+user_name_or_id(uid_t uid, bool id_only)
+{
+	return idcache_name_or_id(idcache_get(&user_cache, uid, !id_only),
+	                          id_only);
+}
+
+/*
+ * Interned group column for gid, shared by every entry with that group.
+ */
+const char *
+group_name_or_id(gid_t gid, bool id_only)
+{
+	return idcache_name_or_id(idcache_get(&group_cache, gid, !id_only),
+	                          id_only);
+}
@@ -0,0 +1,11 @@
+#include <sys/types.h>
+
+#include <stdbool.h>
+
+#ifndef _IDCACHE_H_
+#define _IDCACHE_H_
+
+const char *user_name_or_id(uid_t, bool);
+const char *group_name_or_id(gid_t, bool);
+
+#endif /* _IDCACHE_H_ */
@@ -1,17 +1,87 @@
 #include "ls.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
 
+#include "cache.h"
 #include "config.h"
+#include "dir.h"
+#include "du.h"
+#include "fetch.h"
+#include "filter.h"
+#include "head.h"
+#include "output.h"
+#include "pwalk.h"
 #include "sort.h"
+#include "stats.h"
+#include "stream.h"
+#include "trace.h"
+#include "watch.h"
 
 extern config_t ls_config;
 
+FTSENT *ls_fts_read(FTS *);
+FTSENT *ls_fts_children(FTS *);
+bool has_symlink(const FTSENT *);
 int ls(int, char *[]);
 int main(int, char *[]);
 
+/*
+ * fts_read, timed as traversal for --stats and --trace
+ */
+FTSENT *
+ls_fts_read(FTS *ftsp)
+{
+	uint64_t start;
+	stats_phase_t prev;
+	FTSENT *ent;
+
+	start = TRACE_START();
+	prev = STATS_ENTER(PHASE_TRAVERSE);
+	ent = fts_read(ftsp);
+	STATS_LEAVE(prev);
+	TRACE_SPAN("fts_read", start, ent == NULL ? NULL : ent->fts_path, -1);
+	return ent;
+}
+
+/*
+ * fts_children, timed as traversal for --stats and --trace. fts stats every
+ * child.
+ */
+FTSENT *
+ls_fts_children(FTS *ftsp)
+{
+	uint64_t start;
+	stats_phase_t prev;
+	FTSENT *children;
+
+	start = TRACE_START();
+	prev = STATS_ENTER(PHASE_TRAVERSE);
+	children = fts_children(ftsp, 0);
+	STATS_LEAVE(prev);
+	TRACE_SPAN("fts_children", start,
+	           ftsp->fts_cur == NULL ? NULL : ftsp->fts_cur->fts_path, -1);
+	return children;
+}
+
+/*
+ * Whether any of the entries in the fts_link list is a symlink
+ */
+bool
+has_symlink(const FTSENT *ent)
+{
+	for (; ent != NULL; ent = ent->fts_link) {
+		if (ent->fts_errno == 0 && S_ISLNK(ent->fts_statp->st_mode)) {
+			return true;
+		}
+	}
+	return false;
+}
+
 /*
  * Main ls function that uses FTS to traverse the filesystem and
  * return the children nodes at preorder traversal of directories.
@@ -21,17 +91,17 @@ ls(int argc, char *argv[])
 {
 	bool did_previously_print;
 	bool more_than_one_dir;
+	bool header;
 	uint8_t exitcode;
+	stats_phase_t prev;
 	int fts_open_options;
-	int ignore_trailing_slash_len;
+	int dirfd;
 	char *dot_argv[2];
 	char **path_argv;
 	FTS *ftsp;
 	FTSENT *fs_node;
 	FTSENT *children;
 	fileinfos_t *fileinfos;
-	fileinfos_t *fileinfos_nondir;
-	fileinfos_t *fileinfos_dir;
 
 	if (argc == 0) {
 		dot_argv[0] = ".";
@@ -51,35 +121,45 @@ ls(int argc, char *argv[])
 	/* manual doesn't explicitly state NULL is returned, so check errno as
 	 * well */
 	errno = 0;
+	prev = STATS_ENTER(PHASE_TRAVERSE);
 	if ((ftsp = fts_open(path_argv, fts_open_options, initial_sort_func)) ==
 	        NULL ||
 	    errno != 0) {
 		exitcode = EXIT_FAILURE;
 	}
+	STATS_LEAVE(prev);
 
 	did_previously_print = false;
 	more_than_one_dir = false;
 
-	children = fts_children(ftsp, 0);
-	fileinfos_nondir = fileinfos_from_ftsents(children, true, false, true);
-	if (fileinfos_nondir->size > 0) {
+	/* reused for every directory so its arena is only allocated once */
+	fileinfos = fileinfos_new();
+
+	children = ls_fts_children(ftsp);
+	fileinfos_from_ftsents(fileinfos, children, AT_FDCWD, true, false,
+	                       true);
+	if (fileinfos->size > 0) {
 		did_previously_print = true;
 	}
-	print_fileinfos(fileinfos_nondir);
-	fileinfos_free(fileinfos_nondir);
+	print_fileinfos(fileinfos);
 
-	fileinfos_dir = fileinfos_from_ftsents(children, false, true, false);
-	if (fileinfos_dir->size > 1) {
+	/* records and --head-global have no headers, so the directories are
+	 * only needed for -d */
+	if (ls_config.headers || ls_config.recurse == NO_DEPTH) {
+		fileinfos_from_ftsents(fileinfos, children, AT_FDCWD, false,
+		                       true, false);
+	}
+	if (fileinfos->size > 1) {
 		more_than_one_dir = true;
 	}
 	if (ls_config.recurse == NO_DEPTH) {
-		print_fileinfos(fileinfos_dir);
+		print_fileinfos(fileinfos);
 	}
-	fileinfos_free(fileinfos_dir);
 
-	ftsp->fts_compar = ls_config.compare;
+	/* directories are sorted by ftsents_sort once fts has read them */
+	ftsp->fts_compar = NULL;
 
-	while ((fs_node = fts_read(ftsp)) != NULL) {
+	while ((fs_node = ls_fts_read(ftsp)) != NULL) {
 		if (fs_node->fts_level > ls_config.max_depth ||
 		    fs_node->fts_level < 0) {
 			fts_set(ftsp, fs_node, FTS_SKIP);
@@ -104,34 +184,106 @@ ls(int argc, char *argv[])
 				fts_set(ftsp, fs_node, FTS_SKIP);
 				continue;
 			}
-			if (did_previously_print) {
-				(void)putchar('\n');
+			/* --exclude prunes the subtree as well */
+			if (ls_config.filter && fs_node->fts_level > 0 &&
+			    filter_pruned(fs_node->fts_name)) {
+				fts_set(ftsp, fs_node, FTS_SKIP);
+				continue;
 			}
-			children = fts_children(ftsp, 0);
-			if ((ls_config.recurse == FULL_DEPTH &&
-			     fs_node->fts_level > 0) ||
-			    did_previously_print || more_than_one_dir) {
-				/* don't print trailing '/' like ls, unless path
-				 * is just '/' */
-				ignore_trailing_slash_len =
-				    (int)strlen(fs_node->fts_path) - 1;
-				if (fs_node->fts_path
-				            [ignore_trailing_slash_len] !=
-				        '/' ||
-				    ignore_trailing_slash_len == 0) {
-					ignore_trailing_slash_len++;
+			if (ls_config.du) {
+				du_enter(fs_node->fts_level, fs_node->fts_path,
+				         fs_node->fts_statp->st_blocks,
+				         fs_node->fts_statp->st_size);
+			}
+			/* records name their directory instead, and
+			 * --head-global lists paths */
+			header = false;
+			if (ls_config.headers) {
+				if (did_previously_print) {
+					out_newline();
+				}
+				if ((ls_config.recurse == FULL_DEPTH &&
+				     fs_node->fts_level > 0) ||
+				    did_previously_print || more_than_one_dir) {
+					print_dir_header(fs_node->fts_path);
+					header = true;
 				}
-				(void)printf("%.*s:\n", ignore_trailing_slash_len,
-				       fs_node->fts_path);
 			}
-			fileinfos = fileinfos_from_ftsents(children, false,
-			                                   false, true);
-			print_fileinfos(fileinfos);
-			fileinfos_free(fileinfos);
+			if (ls_config.watch) {
+				/* the watcher keeps the subtree it lists */
+				fts_set(ftsp, fs_node, FTS_SKIP);
+				if (watch_add(fs_node, header) !=
+				    EXIT_SUCCESS) {
+					exitcode = EXIT_FAILURE;
+				}
+			} else if (ls_config.parallel &&
+			    ls_config.recurse == FULL_DEPTH) {
+				/* the workers list the whole subtree */
+				fts_set(ftsp, fs_node, FTS_SKIP);
+				if (pwalk(fs_node) != EXIT_SUCCESS) {
+					exitcode = EXIT_FAILURE;
+				}
+			} else if (ls_config.stream) {
+				/* fts_read only needs to build the children
+				 * if it is going to descend into them */
+				if (fs_node->fts_level >= ls_config.max_depth) {
+					fts_set(ftsp, fs_node, FTS_SKIP);
+				}
+				if (stream_dir(fs_node) != EXIT_SUCCESS) {
+					exitcode = EXIT_FAILURE;
+				}
+			} else if ((ls_config.names_only ||
+			            ls_config.fetch_later ||
+			            ls_config.cache_file != NULL ||
+			            ls_config.head > 0 ||
+			            ls_config.mem_limit > 0 ||
+			            ls_config.filter) &&
+			           fs_node->fts_level >= ls_config.max_depth) {
+				/* not descending, so fts doesn't need to stat
+				 * the children for us */
+				fts_set(ftsp, fs_node, FTS_SKIP);
+				if (dir_list(fs_node, fileinfos) !=
+				    EXIT_SUCCESS) {
+					exitcode = EXIT_FAILURE;
+				}
+			} else {
+				children = ls_fts_children(ftsp);
+				if (ls_config.entry_compare != NULL &&
+				    ls_config.head_global == 0) {
+					/* fts_read descends in list order */
+					children = ftsents_sort(children);
+					ftsp->fts_child = children;
+				}
+				/* symlink targets are read relative to the
+				 * directory rather than by their paths, and
+				 * not at all if it can't be opened */
+				dirfd = -1;
+				if (GET(ls_config.stat_needs, META_LINK) &&
+				    has_symlink(children) &&
+				    (dirfd = open(fs_node->fts_accpath,
+				                  O_RDONLY | O_DIRECTORY |
+				                      O_CLOEXEC)) < 0) {
+					warn("%s", fs_node->fts_name);
+					exitcode = EXIT_FAILURE;
+				}
+				fileinfos_from_ftsents(fileinfos, children,
+				                       dirfd, false, false,
+				                       true);
+				if (dirfd >= 0) {
+					(void)close(dirfd);
+				}
+				STATS_DIR(fs_node->fts_path, fileinfos->size);
+				print_fileinfos(fileinfos);
+			}
 			if (!did_previously_print) {
 				did_previously_print = true;
 			}
 			break;
+		case FTS_DP: /* skipped ones too, after their subtree */
+			if (ls_config.du) {
+				du_leave(fs_node->fts_level);
+			}
+			break;
 		default:
 			break;
 		}
@@ -140,10 +292,24 @@ ls(int argc, char *argv[])
 		err(EXIT_FAILURE, "fts_read");
 	}
 
+	if (ls_config.head_global > 0) {
+		head_print(fileinfos);
+	}
+	if (ls_config.du) {
+		du_print();
+	}
+	fileinfos_free(fileinfos);
+
 	if (fts_close(ftsp) < 0) {
 		err(EXIT_FAILURE, "fts_close");
 	}
 
+	/* the re-reads of --watch use the fetch pool as well */
+	if (ls_config.watch && watch_run() != EXIT_SUCCESS) {
+		exitcode = EXIT_FAILURE;
+	}
+	fetch_stop();
+
 	return exitcode;
 }
 
@@ -154,9 +320,36 @@ ls(int argc, char *argv[])
 int
 main(int argc, char *argv[])
 {
+	int exitcode;
+
 	setprogname(argv[0]);
+	/* only the character classes, for -q and -b. Dates stay in C */
+	(void)setlocale(LC_CTYPE, "");
 
 	argparse(&argc, &argv);
+	if (ls_config.stats) {
+		stats_init();
+	}
+	if (ls_config.trace_file != NULL) {
+		trace_init();
+	}
+	if (ls_config.cache_file != NULL) {
+		cache_open(ls_config.cache_file);
+	}
+	out_init(ls_config.istty);
+	select_rows_printer();
 
-	return ls(argc, argv);
+	exitcode = ls(argc, argv);
+	if (ls_config.cache_file != NULL && cache_close() > 0) {
+		/* --cache-verify found stale directories */
+		exitcode = EXIT_FAILURE;
+	}
+	out_flush();
+	if (ls_config.stats) {
+		stats_report(ls_config.stats_file);
+	}
+	if (ls_config.trace_file != NULL) {
+		trace_write(ls_config.trace_file);
+	}
+	return exitcode;
 }
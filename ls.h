@@ -1,3 +1,4 @@
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <err.h>
@@ -7,32 +8,36 @@
 #include <string.h>
 #include <time.h>
 
+#include "dir.h"
+#include "stats.h"
+
 #ifndef _LS_H_
 #define _LS_H_
 
-typedef struct fileinfo_t {
-	char *name;
-	char *path;
-	char *parent_accpath;
-	struct stat *statp;
-	char *owner_name_or_id;
-	char *group_name_or_id;
-	char *block_count;
-	char *file_size;
-	devmajor_t major;
-	devminor_t minor;
-	char mode[12];
-	struct tm time;
-	bool use_rdev_nums;
-	bool older_than_6months;
-} fileinfo_t;
-
 #define INIT_CAP 10
 
+/*
+ * The entries of one directory (or the operands), stored column-wise so the
+ * width and print passes only touch the fields they use. Names live in a
+ * single arena that is reset, not freed, between directories.
+ */
 typedef struct fileinfos_t {
-	fileinfo_t *arr;
 	int size;
 	int cap;
+	size_t *name_off; /* offsets into arena */
+	size_t *link_off; /* symlink target, or NO_LINK */
+	ino_t *inode;
+	off_t *file_size;
+	blkcnt_t *blocks;
+	nlink_t *nlink;
+	mode_t *mode;
+	dev_t *rdev;
+	struct timespec *time; /* the -u/-c selected time */
+	const char **owner_name_or_id; /* interned by idcache */
+	const char **group_name_or_id;
+	char *arena;
+	size_t arena_len;
+	size_t arena_cap;
 	blkcnt_t total_blocks;
 	size_t total_size;
 	int max_inode_len, max_blockcount_len;
@@ -40,10 +45,32 @@ typedef struct fileinfos_t {
 	int max_owner_name_or_id_len, max_group_name_or_id_len;
 	int max_file_size_len, max_rdev_nums_len, max_size_or_rdev_nums_len;
 	int max_major_len, max_minor_len;
-	int max_time_or_year_len;
 } fileinfos_t;
 
-fileinfos_t *fileinfos_from_ftsents(FTSENT *, bool, bool, bool);
+/* link_off of entries whose target wasn't read, i.e. without -l */
+#define NO_LINK ((size_t)-1)
+
+/* string stored at an arena offset column */
+#define FILEINFOS_STR(fileinfos, col, i)                                       \
+	((fileinfos)->arena + (fileinfos)->col[i])
+
+fileinfos_t *fileinfos_new(void);
+void fileinfos_clear(fileinfos_t *);
+void fileinfos_reset(fileinfos_t *);
+void fileinfos_add(fileinfos_t *, const char *, const struct stat *,
+                   const char *);
+void fileinfos_from_ftsents(fileinfos_t *, FTSENT *, int, bool, bool, bool);
+bool fileinfos_add_dentry(fileinfos_t *, const dentry_t *, const char *);
+void fileinfos_from_dentries(fileinfos_t *, dentries_t *, const char *);
+bool print_dentry(const dentry_t *);
+void print_dentries(dentries_t *);
+void print_dir_header(const char *);
+void print_filetype_char(mode_t);
+void print_fileinfos_total(const fileinfos_t *);
+void select_rows_printer(void);
+/* prints a name raw, for -q or for -b, as select_rows_printer picked */
+extern void (*print_name)(const char *);
+void print_fileinfos_rows(const fileinfos_t *);
 void print_fileinfos(fileinfos_t *);
 void fileinfos_free(fileinfos_t *);
 
@@ -53,6 +80,7 @@ void fileinfos_free(fileinfos_t *);
 		if (newstr == NULL) {                                          \
 			err(EXIT_FAILURE, errmsg);                             \
 		}                                                              \
+		STATS_COUNT(COUNT_ALLOC, 1);                                   \
 	} while (/* CONSTCOND */ 0)
 
 #define ASPRINTF(errmsg, newstrptr, fmt, ...)                                  \
@@ -60,6 +88,7 @@ void fileinfos_free(fileinfos_t *);
 		if (asprintf(newstrptr, fmt, __VA_ARGS__) == -1) {             \
 			err(EXIT_FAILURE, errmsg);                             \
 		}                                                              \
+		STATS_COUNT(COUNT_ALLOC, 1);                                   \
 	} while (/* CONSTCOND */ 0)
 
 #endif /* _LS_H_ */
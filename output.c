@@ -0,0 +1,287 @@
+#include "output.h"
+#include "format.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* a tty flushes every line anyway, so there is no point in more */
+#define OUT_TTY_BUFSIZE (8 * 1024)
+/* one write fills an empty pipe without the reader seeing partial chunks */
+#define OUT_PIPE_BUFSIZE (64 * 1024)
+/* files and anything else get large writes */
+#define OUT_FILE_BUFSIZE (256 * 1024)
+
+/*
+ * All of stdout goes through this buffer instead of stdio, and is written out
+ * with write(2)/writev(2) when it fills up or at a directory boundary.
+ */
+typedef struct output_t {
+	char *buf;
+	size_t len;
+	size_t cap;
+	bool line_buffered; /* flush every line, for ttys */
+} output_t;
+
+output_t out;
+
+void out_write(struct iovec *, int);
+void out_atexit(void);
+char *out_reserve(size_t);
+
+/*
+ * Pick the buffer size from what stdout is connected to and allocate it.
+ */
+void
+out_init(bool istty)
+{
+	struct stat st;
+
+	out.line_buffered = istty;
+	if (istty) {
+		out.cap = OUT_TTY_BUFSIZE;
+	} else if (fstat(STDOUT_FILENO, &st) == 0 &&
+	           (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))) {
+		out.cap = OUT_PIPE_BUFSIZE;
+	} else {
+		out.cap = OUT_FILE_BUFSIZE;
+	}
+	if ((out.buf = malloc(out.cap)) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate output buffer");
+	}
+	out.len = 0;
+	if (atexit(out_atexit) != 0) {
+		err(EXIT_FAILURE, "atexit");
+	}
+}
+
+/*
+ * writev(2) every byte of iov, retrying on short writes.
+ */
+void
+out_write(struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+	long total;
+	uint64_t start;
+	stats_phase_t prev;
+
+	start = TRACE_START();
+	prev = STATS_ENTER(PHASE_WRITE);
+	total = 0;
+	while (iovcnt > 0) {
+		if ((n = writev(STDOUT_FILENO, iov, iovcnt)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			out.len = 0; /* don't try again from atexit */
+			err(EXIT_FAILURE, "write");
+		}
+		STATS_COUNT(COUNT_BYTES_WRITTEN, n);
+		total += n;
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	STATS_LEAVE(prev);
+	TRACE_SPAN("flush", start, NULL, total);
+}
+
+/*
+ * Write out whatever is buffered.
+ */
+void
+out_flush(void)
+{
+	struct iovec iov;
+
+	if (out.len == 0) {
+		return;
+	}
+	iov.iov_base = out.buf;
+	iov.iov_len = out.len;
+	out.len = 0;
+	out_write(&iov, 1);
+}
+
+/*
+ * Buffered output must not be lost when exiting through err(3).
+ */
+void
+out_atexit(void)
+{
+	out_flush();
+}
+
+/*
+ * Called after each directory. Flushing here keeps writes aligned to whole
+ * directories when that doesn't make them small.
+ */
+void
+out_dir_end(void)
+{
+	if (out.line_buffered || out.len >= out.cap / 2) {
+		out_flush();
+	}
+}
+
+/*
+ * Append len bytes. Anything too big to ever fit is written together with
+ * the buffer in a single writev instead of being copied.
+ */
+void
+out_mem(const char *str, size_t len)
+{
+	struct iovec iov[2];
+
+	if (out.len + len <= out.cap) {
+		(void)memcpy(out.buf + out.len, str, len);
+		out.len += len;
+		return;
+	}
+	if (len < out.cap) {
+		out_flush();
+		(void)memcpy(out.buf, str, len);
+		out.len = len;
+		return;
+	}
+	iov[0].iov_base = out.buf;
+	iov[0].iov_len = out.len;
+	iov[1].iov_base = (char *)str;
+	iov[1].iov_len = len;
+	out.len = 0;
+	out_write(iov, 2);
+}
+
+/*
+ * Append a single character.
+ */
+void
+out_char(char c)
+{
+	if (out.len == out.cap) {
+		out_flush();
+	}
+	out.buf[out.len++] = c;
+}
+
+/*
+ * Append a nul-terminated string.
+ */
+void
+out_str(const char *str)
+{
+	out_mem(str, strlen(str));
+}
+
+/*
+ * End the current line, flushing it right away on a tty so output and
+ * warnings on stderr stay in order.
+ */
+void
+out_newline(void)
+{
+	out_char('\n');
+	if (out.line_buffered) {
+		out_flush();
+	}
+}
+
+/*
+ * Make room for len bytes, which must be at most the buffer size, and return
+ * where they go. The caller fills them in and adds len to out.len.
+ */
+char *
+out_reserve(size_t len)
+{
+	if (out.len + len > out.cap) {
+		out_flush();
+	}
+	return out.buf + out.len;
+}
+
+/*
+ * Append n spaces (nothing if n <= 0).
+ */
+void
+out_spaces(int n)
+{
+	size_t len;
+	char *p;
+
+	for (; n > 0; n -= len) {
+		len = (size_t)n < out.cap ? (size_t)n : out.cap;
+		p = out_reserve(len);
+		(void)memset(p, ' ', len);
+		out.len += len;
+	}
+}
+
+/*
+ * Append str right aligned in width columns, like printf's %*s.
+ */
+void
+out_str_padded(const char *str, int width)
+{
+	size_t len;
+
+	len = strlen(str);
+	out_spaces(width - (int)len);
+	out_mem(str, len);
+}
+
+/*
+ * Append str left aligned in width columns, like printf's %-*s.
+ */
+void
+out_str_left(const char *str, int width)
+{
+	size_t len;
+
+	len = strlen(str);
+	out_mem(str, len);
+	out_spaces(width - (int)len);
+}
+
+/*
+ * Append n right aligned in width columns, like printf's %*lu, rendering it
+ * straight into the buffer.
+ */
+void
+out_ulong(uint64_t n, int width)
+{
+	char *p;
+
+	out_spaces(width - count_digits(n));
+	p = out_reserve(ULONG_STR_LEN);
+	out.len += format_ulong(p, n);
+}
+
+/*
+ * Append size humanized and right aligned in width columns. See human_size
+ * for decimal.
+ */
+void
+out_human(uint64_t size, bool decimal, int width)
+{
+	char *p;
+	human_t h;
+
+	human_size(&h, size, decimal);
+	out_spaces(width - human_len(&h));
+	p = out_reserve(HUMAN_SIZE_LEN);
+	out.len += format_human(p, &h);
+}
@@ -0,0 +1,22 @@
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+void out_init(bool);
+void out_flush(void);
+void out_dir_end(void);
+void out_mem(const char *, size_t);
+void out_char(char);
+void out_str(const char *);
+void out_newline(void);
+void out_spaces(int);
+void out_str_padded(const char *, int);
+void out_str_left(const char *, int);
+void out_ulong(uint64_t, int);
+void out_human(uint64_t, bool, int);
+
+#endif /* _OUTPUT_H_ */
@@ -0,0 +1,800 @@
+#include "pwalk.h"
+
+#include <sys/resource.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "du.h"
+#include "filter.h"
+#include "ls.h"
+#include "output.h"
+#include "sort.h"
+#include "trace.h"
+
+extern config_t ls_config;
+
+#define DEQUE_INIT_CAP 64
+/* directories read but not printed yet, per worker, before workers wait */
+#define PWALK_READ_AHEAD 4
+/* directory descriptors kept open for subdirs at most, or half the limit */
+#define PWALK_MAX_OPEN 1024
+/* past half of those, only every this many levels keep theirs, so reopening
+ * from an ancestor takes at most as many openat calls */
+#define PWALK_OPEN_STRIDE 16
+/* buckets the (dev, ino) table starts with, it doubles when full */
+#define PWALK_DIRS_INIT 256
+
+/*
+ * Per-worker double ended queue of directories waiting to be read. The owner
+ * pushes and pops at the bottom, idle workers steal from the top so they take
+ * the oldest (and usually largest) pending subtree.
+ */
+typedef struct pwalk_deque_t {
+	pthread_mutex_t lock;
+	pwalk_dir_t **arr;
+	int head;
+	int size;
+	int cap;
+} pwalk_deque_t;
+
+typedef struct pwalk_pool_t {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond; /* a dir was queued or printed, or the walk
+	                             finished */
+	pthread_cond_t done_cond; /* some dir finished reading */
+	int queued;               /* dirs in the deques not yet claimed */
+	int outstanding;          /* dirs queued or being read */
+	int unprinted;            /* dirs read whose entries aren't printed */
+	int max_unprinted;        /* workers wait for the printer beyond it */
+	int nopen;                /* dir->fd kept open for subdirs */
+	int max_open;             /* subdirs reopen from an ancestor beyond */
+	bool finished;
+	int nworkers;
+	pwalk_deque_t *deques;
+	pwalk_dir_t **dirs; /* every dir not freed yet, chained by (dev, ino) */
+	int ndirs;
+	int dirs_cap;
+} pwalk_pool_t;
+
+typedef struct pwalk_worker_t {
+	pwalk_pool_t *pool;
+	int id;
+} pwalk_worker_t;
+
+pwalk_dir_t *pwalk_dir_new(pwalk_dir_t *, const char *, const char *,
+                           const struct stat *);
+void pwalk_dir_free(pwalk_dir_t *);
+void deque_push(pwalk_deque_t *, pwalk_dir_t *);
+pwalk_dir_t *deque_pop(pwalk_deque_t *);
+pwalk_dir_t *deque_steal(pwalk_deque_t *);
+bool deque_remove(pwalk_deque_t *, const pwalk_dir_t *);
+void pwalk_submit(pwalk_pool_t *, int, pwalk_dir_t *);
+pwalk_dir_t *pwalk_take(pwalk_pool_t *, int);
+bool pwalk_claim(pwalk_pool_t *, pwalk_dir_t *);
+uint64_t pwalk_hash(dev_t, ino_t);
+void pwalk_insert(pwalk_pool_t *, pwalk_dir_t *);
+void pwalk_forget(pwalk_pool_t *, pwalk_dir_t *);
+bool pwalk_is_cycle(pwalk_pool_t *, const pwalk_dir_t *, const struct stat *);
+int pwalk_reopen(pwalk_pool_t *, const pwalk_dir_t *);
+int pwalk_open(pwalk_pool_t *, pwalk_dir_t *);
+void pwalk_read_dir(pwalk_pool_t *, int, pwalk_dir_t *);
+void *pwalk_worker(void *);
+int pwalk_print_dir(pwalk_pool_t *, pwalk_dir_t *, fileinfos_t *);
+int pwalk_print(pwalk_pool_t *, pwalk_dir_t *, fileinfos_t *);
+int pwalk(const FTSENT *);
+
+/*
+ * Allocate a directory node. The path is built the same way fts builds
+ * fts_path so the headers printed for it match the serial traversal.
+ */
+pwalk_dir_t *
+pwalk_dir_new(pwalk_dir_t *parent, const char *path, const char *name,
+              const struct stat *st)
+{
+	int len;
+	pwalk_dir_t *dir;
+
+	if ((dir = calloc(1, sizeof(pwalk_dir_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate directory node");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+	if (parent == NULL) {
+		STRDUP("couldn't strdup root path", dir->path, path);
+		dir->level = 0;
+	} else {
+		/* don't double the '/' when the parent path already ends in
+		 * one */
+		len = (int)strlen(parent->path);
+		if (len > 0 && parent->path[len - 1] == '/') {
+			len--;
+		}
+		ASPRINTF("couldn't alloc string for directory path", &dir->path,
+		         "%.*s/%s", len, parent->path, name);
+		dir->level = parent->level + 1;
+	}
+	STRDUP("couldn't strdup directory name", dir->name, name);
+	dir->parent = parent;
+	dir->fd = -1;
+	dir->dev = st->st_dev;
+	dir->ino = st->st_ino;
+	dir->blocks = st->st_blocks;
+	dir->size = st->st_size;
+	return dir;
+}
+
+/*
+ * Free a directory node and its entries. The subdirs are freed by the printer
+ * as it visits them.
+ */
+void
+pwalk_dir_free(pwalk_dir_t *dir)
+{
+	dentries_free(&dir->dentries);
+	free(dir->subdirs);
+	free(dir->path);
+	free(dir->name);
+	free(dir);
+}
+
+/*
+ * Push to the bottom of the deque, growing the ring buffer if needed.
+ */
+void
+deque_push(pwalk_deque_t *dq, pwalk_dir_t *dir)
+{
+	int i;
+	pwalk_dir_t **arr;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->size == dq->cap) {
+		if ((arr = calloc(dq->cap * 2, sizeof(pwalk_dir_t *))) == NULL) {
+			err(EXIT_FAILURE, "failed to grow work queue");
+		}
+		STATS_COUNT(COUNT_ALLOC, 1);
+		for (i = 0; i < dq->size; ++i) {
+			arr[i] = dq->arr[(dq->head + i) % dq->cap];
+		}
+		free(dq->arr);
+		dq->arr = arr;
+		dq->head = 0;
+		dq->cap *= 2;
+	}
+	dq->arr[(dq->head + dq->size) % dq->cap] = dir;
+	dq->size++;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+/*
+ * Pop from the bottom of the deque, NULL if empty.
+ */
+pwalk_dir_t *
+deque_pop(pwalk_deque_t *dq)
+{
+	pwalk_dir_t *dir;
+
+	dir = NULL;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->size > 0) {
+		dq->size--;
+		dir = dq->arr[(dq->head + dq->size) % dq->cap];
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return dir;
+}
+
+/*
+ * Steal from the top of the deque, NULL if empty.
+ */
+pwalk_dir_t *
+deque_steal(pwalk_deque_t *dq)
+{
+	pwalk_dir_t *dir;
+
+	dir = NULL;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->size > 0) {
+		dir = dq->arr[dq->head];
+		dq->head = (dq->head + 1) % dq->cap;
+		dq->size--;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return dir;
+}
+
+/*
+ * Take dir out of the deque wherever it sits, false if it isn't there.
+ */
+bool
+deque_remove(pwalk_deque_t *dq, const pwalk_dir_t *dir)
+{
+	int i;
+	bool found;
+
+	found = false;
+	pthread_mutex_lock(&dq->lock);
+	for (i = 0; i < dq->size; ++i) {
+		if (!found) {
+			found = dq->arr[(dq->head + i) % dq->cap] == dir;
+		} else {
+			dq->arr[(dq->head + i - 1) % dq->cap] =
+			    dq->arr[(dq->head + i) % dq->cap];
+		}
+	}
+	if (found) {
+		dq->size--;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+/*
+ * Queue a directory on worker id's deque and wake an idle worker.
+ */
+void
+pwalk_submit(pwalk_pool_t *pool, int id, pwalk_dir_t *dir)
+{
+	deque_push(&pool->deques[id], dir);
+
+	pthread_mutex_lock(&pool->lock);
+	pwalk_insert(pool, dir);
+	pool->queued++;
+	pool->outstanding++;
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Claim one queued directory, preferring the worker's own deque. Waits while
+ * the printer is max_unprinted directories behind, so the entries held
+ * don't grow with the tree. Returns NULL once the whole walk has finished.
+ */
+pwalk_dir_t *
+pwalk_take(pwalk_pool_t *pool, int id)
+{
+	int i;
+	pwalk_dir_t *dir;
+
+	pthread_mutex_lock(&pool->lock);
+	while ((pool->queued == 0 ||
+	        pool->unprinted >= pool->max_unprinted) &&
+	       !pool->finished) {
+		pthread_cond_wait(&pool->work_cond, &pool->lock);
+	}
+	if (pool->queued == 0) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	pool->queued--;
+	pthread_mutex_unlock(&pool->lock);
+
+	/* the claim guarantees a directory is sitting in some deque */
+	for (;;) {
+		if ((dir = deque_pop(&pool->deques[id])) != NULL) {
+			return dir;
+		}
+		for (i = 1; i < pool->nworkers; ++i) {
+			dir = deque_steal(
+			    &pool->deques[(id + i) % pool->nworkers]);
+			if (dir != NULL) {
+				return dir;
+			}
+		}
+	}
+}
+
+/*
+ * Take dir out of the deques for the printer to read itself, when the
+ * workers are waiting for it to catch up and dir is still queued. A claim
+ * isn't tied to a directory, so with pool->queued above 0 every worker that
+ * claimed one still finds one. Called with pool->lock held.
+ */
+bool
+pwalk_claim(pwalk_pool_t *pool, pwalk_dir_t *dir)
+{
+	int i;
+
+	if (pool->unprinted < pool->max_unprinted || pool->queued == 0) {
+		return false;
+	}
+	for (i = 0; i < pool->nworkers; ++i) {
+		if (deque_remove(&pool->deques[i], dir)) {
+			pool->queued--;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Bucket hash of a directory, the multiplier spreads consecutive inode
+ * numbers
+ */
+uint64_t
+pwalk_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h;
+
+	h = (uint64_t)ino ^ ((uint64_t)dev << 32);
+	h *= UINT64_C(0x9e3779b97f4a7c15);
+	return h ^ (h >> 29);
+}
+
+/*
+ * Add dir to the table pwalk_is_cycle looks ancestors up in, growing it once
+ * there are as many dirs as buckets. Called with pool->lock held.
+ */
+void
+pwalk_insert(pwalk_pool_t *pool, pwalk_dir_t *dir)
+{
+	int i, cap;
+	uint64_t h;
+	pwalk_dir_t **dirs;
+	pwalk_dir_t *next;
+
+	if (pool->ndirs == pool->dirs_cap) {
+		cap = pool->dirs_cap == 0 ? PWALK_DIRS_INIT
+		                          : pool->dirs_cap * 2;
+		if ((dirs = calloc(cap, sizeof(pwalk_dir_t *))) == NULL) {
+			err(EXIT_FAILURE, "failed to grow directory table");
+		}
+		STATS_COUNT(COUNT_ALLOC, 1);
+		for (i = 0; i < pool->dirs_cap; ++i) {
+			for (; pool->dirs[i] != NULL; pool->dirs[i] = next) {
+				next = pool->dirs[i]->same_hash;
+				h = pwalk_hash(pool->dirs[i]->dev,
+				               pool->dirs[i]->ino) &
+				    (cap - 1);
+				pool->dirs[i]->same_hash = dirs[h];
+				dirs[h] = pool->dirs[i];
+			}
+		}
+		free(pool->dirs);
+		pool->dirs = dirs;
+		pool->dirs_cap = cap;
+	}
+	h = pwalk_hash(dir->dev, dir->ino) & (pool->dirs_cap - 1);
+	dir->same_hash = pool->dirs[h];
+	pool->dirs[h] = dir;
+	pool->ndirs++;
+}
+
+/*
+ * Take dir out of the table before it is freed
+ */
+void
+pwalk_forget(pwalk_pool_t *pool, pwalk_dir_t *dir)
+{
+	pwalk_dir_t **link;
+
+	pthread_mutex_lock(&pool->lock);
+	link = &pool->dirs[pwalk_hash(dir->dev, dir->ino) &
+	                   (pool->dirs_cap - 1)];
+	while (*link != dir) {
+		link = &(*link)->same_hash;
+	}
+	*link = dir->same_hash;
+	pool->ndirs--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * fts refuses to descend into a directory that is its own ancestor, do the
+ * same. Only the dirs with the same (dev, ino), usually none, are checked
+ * for being an ancestor, so deep trees don't walk the whole chain for every
+ * subdir.
+ */
+bool
+pwalk_is_cycle(pwalk_pool_t *pool, const pwalk_dir_t *dir,
+               const struct stat *st)
+{
+	bool cycle;
+	const pwalk_dir_t *same;
+	const pwalk_dir_t *anc;
+
+	cycle = false;
+	pthread_mutex_lock(&pool->lock);
+	for (same = pool->dirs[pwalk_hash(st->st_dev, st->st_ino) &
+	                       (pool->dirs_cap - 1)];
+	     same != NULL && !cycle; same = same->same_hash) {
+		if (same->dev != st->st_dev || same->ino != st->st_ino ||
+		    same->level > dir->level) {
+			continue;
+		}
+		for (anc = dir; anc->level > same->level; anc = anc->parent) {
+			continue;
+		}
+		cycle = anc == same;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return cycle;
+}
+
+/*
+ * Open dir when its parent's descriptor was closed to stay under
+ * pool->max_open: from the nearest ancestor that still has one, or the root
+ * by its path, with as many names per openat as fit in PATH_MAX, so the
+ * length of the whole path still doesn't matter. Returns the descriptor, or
+ * -1 with errno set.
+ */
+int
+pwalk_reopen(pwalk_pool_t *pool, const pwalk_dir_t *dir)
+{
+	int i, j, n;
+	int fd, subfd;
+	size_t len, namelen;
+	const pwalk_dir_t *anc;
+	const char **names;
+	char path[PATH_MAX];
+
+	/* an ancestor's descriptor is only closed with the lock held */
+	pthread_mutex_lock(&pool->lock);
+	n = 0;
+	for (anc = dir; anc->parent != NULL && anc->parent->fd < 0;
+	     anc = anc->parent) {
+		n++;
+	}
+	if (anc->parent != NULL) {
+		fd = dup(anc->parent->fd);
+	} else {
+		fd = open(anc->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* the names start at anc, or below it if it is the root */
+	if (anc->parent != NULL) {
+		n++;
+	}
+	if ((names = malloc(n * sizeof(char *))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate directory names");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+	for (i = n - 1, anc = dir; i >= 0; --i, anc = anc->parent) {
+		names[i] = anc->name;
+	}
+	for (i = 0; i < n && fd >= 0; i = j) {
+		len = 0;
+		for (j = i; j < n; ++j) {
+			namelen = strlen(names[j]);
+			if (j > i && len + namelen + 1 >= PATH_MAX) {
+				break;
+			}
+			if (j > i) {
+				path[len++] = '/';
+			}
+			(void)memcpy(path + len, names[j], namelen + 1);
+			len += namelen;
+		}
+		subfd = openat(fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		(void)close(fd);
+		fd = subfd;
+	}
+	free(names);
+	return fd;
+}
+
+/*
+ * Open dir relative to its parent, so the length of the path doesn't matter,
+ * and close the parent once the last of its subdirs has done so. The root
+ * is opened by its path. Returns the descriptor, or -1 with dir->err set.
+ */
+int
+pwalk_open(pwalk_pool_t *pool, pwalk_dir_t *dir)
+{
+	int fd;
+	pwalk_dir_t *parent;
+
+	if ((parent = dir->parent) == NULL) {
+		fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	} else if (parent->fd >= 0) {
+		fd = openat(parent->fd, dir->name,
+		            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	} else {
+		fd = pwalk_reopen(pool, dir);
+	}
+	if (fd < 0) {
+		dir->err = errno;
+	}
+	if (parent != NULL) {
+		pthread_mutex_lock(&pool->lock);
+		if (--parent->npending == 0 && parent->fd >= 0) {
+			(void)close(parent->fd);
+			parent->fd = -1;
+			pool->nopen--;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return fd;
+}
+
+/*
+ * Read every entry of dir, sort them like fts_children would and queue the
+ * subdirectories fts_read would descend into.
+ */
+void
+pwalk_read_dir(pwalk_pool_t *pool, int id, pwalk_dir_t *dir)
+{
+	int i, cap;
+	int fd, readfd;
+	uint64_t start;
+	dentry_t *dentry;
+
+	start = TRACE_START();
+	/* the read closes the descriptor it is given, fd stays open */
+	if ((fd = pwalk_open(pool, dir)) >= 0) {
+		if ((readfd = dup(fd)) < 0) {
+			dir->err = errno;
+		} else {
+			dir->err = dentries_read(readfd, &dir->dentries,
+			                         ls_config.stat_needs |
+			                             META_DIRS);
+		}
+	}
+	TRACE_SPAN("readdir", start, dir->path, dir->dentries.size);
+	dentries_sort(&dir->dentries);
+
+	cap = 0;
+	for (i = 0; i < dir->dentries.size; ++i) {
+		dentry = &dir->dentries.arr[i];
+		if (!dentry->has_stat || !S_ISDIR(dentry->st.st_mode) ||
+		    strcmp(dentry->name, ".") == 0 ||
+		    strcmp(dentry->name, "..") == 0 ||
+		    (ls_config.dots == NO_DOTS && dentry->name[0] == '.') ||
+		    (ls_config.filter && filter_pruned(dentry->name)) ||
+		    dir->level >= ls_config.max_depth ||
+		    pwalk_is_cycle(pool, dir, &dentry->st)) {
+			continue;
+		}
+		if (dir->nsubdirs == cap) {
+			cap = cap == 0 ? INIT_CAP : cap * 2;
+			dir->subdirs = realloc(dir->subdirs,
+			                       cap * sizeof(pwalk_dir_t *));
+			if (dir->subdirs == NULL) {
+				err(EXIT_FAILURE,
+				    "failed to realloc subdirectory array");
+			}
+			STATS_COUNT(COUNT_ALLOC, 1);
+		}
+		dir->subdirs[dir->nsubdirs++] =
+		    pwalk_dir_new(dir, NULL, dentry->name, &dentry->st);
+	}
+
+	/* set before any subdir can run. Without a descriptor here the
+	 * subdirs open themselves from an ancestor instead. */
+	pthread_mutex_lock(&pool->lock);
+	dir->npending = dir->nsubdirs;
+	if (fd >= 0 && dir->nsubdirs > 0 &&
+	    (pool->nopen < pool->max_open / 2 ||
+	     (pool->nopen < pool->max_open &&
+	      dir->level % PWALK_OPEN_STRIDE == 0))) {
+		dir->fd = fd;
+		pool->nopen++;
+	} else if (fd >= 0) {
+		(void)close(fd);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	/* pushed in reverse so this worker pops them in visiting order, which
+	 * is the order the printer waits on them */
+	for (i = dir->nsubdirs - 1; i >= 0; --i) {
+		pwalk_submit(pool, id, dir->subdirs[i]);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	dir->done = true;
+	pool->unprinted++;
+	if (--pool->outstanding == 0) {
+		pool->finished = true;
+		pthread_cond_broadcast(&pool->work_cond);
+	}
+	pthread_cond_broadcast(&pool->done_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Worker thread main loop
+ */
+void *
+pwalk_worker(void *arg)
+{
+	pwalk_worker_t *worker;
+	pwalk_dir_t *dir;
+
+	worker = arg;
+	TRACE_THREAD("pwalk worker");
+	while ((dir = pwalk_take(worker->pool, worker->id)) != NULL) {
+		pwalk_read_dir(worker->pool, worker->id, dir);
+	}
+	return NULL;
+}
+
+/*
+ * Print the entries of dir once its worker is done with it. If the workers
+ * are waiting for the printer and nobody has taken dir yet, the printer
+ * reads it itself. fileinfos is reused for every directory.
+ */
+int
+pwalk_print_dir(pwalk_pool_t *pool, pwalk_dir_t *dir, fileinfos_t *fileinfos)
+{
+	int exitcode;
+
+	/* every read that finishes wakes the printer to check again */
+	pthread_mutex_lock(&pool->lock);
+	while (!dir->done) {
+		if (pwalk_claim(pool, dir)) {
+			pthread_mutex_unlock(&pool->lock);
+			pwalk_read_dir(pool, 0, dir);
+			pthread_mutex_lock(&pool->lock);
+		} else {
+			pthread_cond_wait(&pool->done_cond, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	exitcode = EXIT_SUCCESS;
+
+	if (dir->level > 0 && ls_config.headers) {
+		out_newline();
+		print_dir_header(dir->path);
+	}
+
+	/* ls entered the root, whose FTS_DP leaves it */
+	if (ls_config.du && dir->level > 0 && dir->err == 0) {
+		du_enter(dir->level, dir->path, dir->blocks, dir->size);
+	}
+	STATS_DIR(dir->path, dir->dentries.size);
+	if (ls_config.names_only) {
+		print_dentries(&dir->dentries);
+	} else {
+		fileinfos_from_dentries(fileinfos, &dir->dentries, dir->path);
+		print_fileinfos(fileinfos);
+	}
+	if (dir->dentries.nerrs > 0) {
+		exitcode = EXIT_FAILURE;
+	}
+	/* only the subdirs are needed from here on */
+	dentries_free(&dir->dentries);
+	pthread_mutex_lock(&pool->lock);
+	pool->unprinted--;
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (dir->err != 0) {
+		if (dir->level > 0) {
+			errno = dir->err;
+			warn("%s", dir->name);
+		}
+		exitcode = EXIT_FAILURE;
+	}
+	return exitcode;
+}
+
+/*
+ * Print root and everything under it in fts preorder, freeing each dir once
+ * its subtree is printed. The parent links and dir->nprinted stand in for a
+ * stack, so the depth of the tree doesn't matter.
+ */
+int
+pwalk_print(pwalk_pool_t *pool, pwalk_dir_t *root, fileinfos_t *fileinfos)
+{
+	int exitcode;
+	pwalk_dir_t *dir;
+	pwalk_dir_t *parent;
+
+	exitcode = pwalk_print_dir(pool, root, fileinfos);
+	dir = root;
+	while (dir != NULL) {
+		if (dir->nprinted < dir->nsubdirs) {
+			dir = dir->subdirs[dir->nprinted++];
+			if (pwalk_print_dir(pool, dir, fileinfos) !=
+			    EXIT_SUCCESS) {
+				exitcode = EXIT_FAILURE;
+			}
+			continue;
+		}
+		if (ls_config.du && dir->level > 0) {
+			du_leave(dir->level);
+		}
+		parent = dir->parent;
+		pwalk_forget(pool, dir);
+		pwalk_dir_free(dir);
+		dir = parent;
+	}
+	return exitcode;
+}
+
+/*
+ * List the directory tree rooted at root (an FTS_D returned by fts_read) with
+ * ls_config.nthreads workers reading and stat-ing directories while the
+ * calling thread prints them in the order the serial traversal would.
+ */
+int
+pwalk(const FTSENT *root)
+{
+	int i;
+	int exitcode;
+	pwalk_pool_t pool;
+	pwalk_worker_t *workers;
+	pthread_t *threads;
+	pwalk_dir_t *root_dir;
+	fileinfos_t *fileinfos;
+	struct rlimit rl;
+
+	(void)memset(&pool, 0, sizeof(pwalk_pool_t));
+	pool.nworkers = ls_config.nthreads;
+	pool.max_unprinted = PWALK_READ_AHEAD * pool.nworkers;
+	/* the other half is left for the reads, fetches and output */
+	pool.max_open = PWALK_MAX_OPEN;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 2 < PWALK_MAX_OPEN) {
+		pool.max_open = (int)(rl.rlim_cur / 2);
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work_cond, NULL);
+	pthread_cond_init(&pool.done_cond, NULL);
+
+	if ((pool.deques = calloc(pool.nworkers, sizeof(pwalk_deque_t))) ==
+	        NULL ||
+	    (workers = calloc(pool.nworkers, sizeof(pwalk_worker_t))) ==
+	        NULL ||
+	    (threads = calloc(pool.nworkers, sizeof(pthread_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate worker pool");
+	}
+	for (i = 0; i < pool.nworkers; ++i) {
+		pthread_mutex_init(&pool.deques[i].lock, NULL);
+		pool.deques[i].cap = DEQUE_INIT_CAP;
+		if ((pool.deques[i].arr = calloc(DEQUE_INIT_CAP,
+		                                 sizeof(pwalk_dir_t *))) ==
+		    NULL) {
+			err(EXIT_FAILURE, "failed to allocate work queue");
+		}
+	}
+
+	root_dir = pwalk_dir_new(NULL, root->fts_path, root->fts_name,
+	                         root->fts_statp);
+	pwalk_submit(&pool, 0, root_dir);
+
+	/* the workers already keep every thread busy */
+	sort_serial = true;
+	for (i = 0; i < pool.nworkers; ++i) {
+		workers[i].pool = &pool;
+		workers[i].id = i;
+		if ((errno = pthread_create(&threads[i], NULL, pwalk_worker,
+		                            &workers[i])) != 0) {
+			err(EXIT_FAILURE, "pthread_create");
+		}
+	}
+
+	fileinfos = fileinfos_new();
+	exitcode = pwalk_print(&pool, root_dir, fileinfos);
+	fileinfos_free(fileinfos);
+
+	for (i = 0; i < pool.nworkers; ++i) {
+		if ((errno = pthread_join(threads[i], NULL)) != 0) {
+			err(EXIT_FAILURE, "pthread_join");
+		}
+		pthread_mutex_destroy(&pool.deques[i].lock);
+		free(pool.deques[i].arr);
+	}
+	sort_serial = false;
+	pthread_cond_destroy(&pool.done_cond);
+	pthread_cond_destroy(&pool.work_cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.deques);
+	free(pool.dirs);
+	free(workers);
+	free(threads);
+
+	return exitcode;
+}
@@ -0,0 +1,39 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fts.h>
+#include <stdbool.h>
+
+#include "dir.h"
+
+#ifndef _PWALK_H_
+#define _PWALK_H_
+
+/*
+ * One directory of the walk. Workers fill in the entries and subdirs, the
+ * printer waits for done and then owns the node.
+ */
+typedef struct pwalk_dir_t {
+	char *path; /* equivalent of fts_path */
+	char *name; /* equivalent of fts_name */
+	int level;
+	dev_t dev;
+	ino_t ino;
+	blkcnt_t blocks; /* its own, for --du */
+	off_t size;
+	struct pwalk_dir_t *parent;
+	int fd;       /* kept open for the subdirs to openat, -1 after or when
+	                 too many are open */
+	int npending; /* subdirs that haven't opened themselves yet */
+	int err; /* open/readdir errno, 0 if the directory was read */
+	bool done;
+	dentries_t dentries;
+	struct pwalk_dir_t **subdirs; /* in the order fts would visit them */
+	int nsubdirs;
+	int nprinted; /* subdirs the printer is done with */
+	struct pwalk_dir_t *same_hash; /* next in its pool bucket */
+} pwalk_dir_t;
+
+int pwalk(const FTSENT *);
+
+#endif /* _PWALK_H_ */
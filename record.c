@@ -0,0 +1,326 @@
+#include "record.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+#include "output.h"
+
+extern config_t ls_config;
+
+#define NSEC_DIGITS 9
+#define NSEC_PER_SEC 1000000000
+
+size_t utf8_len(const unsigned char *);
+bool record_string(const char *);
+void record_base64(const char *);
+void record_text(const char *, const char *);
+void record_time(const struct timespec *);
+void record_field(const char *, uint64_t);
+void record_ndjson(const char *, const char *, const struct stat *,
+                   const char *);
+uint8_t *put_le(uint8_t *, uint64_t, int);
+void record_binary(const char *, const char *, const struct stat *,
+                   const char *);
+void record_print(const char *, const char *, const struct stat *,
+                  const char *);
+
+/*
+ * Length of the UTF-8 sequence str starts with, 0 if it isn't a valid one:
+ * truncated, overlong, a surrogate or past U+10FFFF.
+ */
+size_t
+utf8_len(const unsigned char *str)
+{
+	size_t i, len;
+	unsigned char lo, hi;
+
+	if (str[0] < 0x80) {
+		return 1;
+	}
+	/* the range of the second byte rules out the overlong forms, the
+	 * surrogates and what is past U+10FFFF */
+	lo = 0x80;
+	hi = 0xbf;
+	if (str[0] >= 0xc2 && str[0] <= 0xdf) {
+		len = 2;
+	} else if (str[0] >= 0xe0 && str[0] <= 0xef) {
+		len = 3;
+		if (str[0] == 0xe0) {
+			lo = 0xa0;
+		} else if (str[0] == 0xed) {
+			hi = 0x9f;
+		}
+	} else if (str[0] >= 0xf0 && str[0] <= 0xf4) {
+		len = 4;
+		if (str[0] == 0xf0) {
+			lo = 0x90;
+		} else if (str[0] == 0xf4) {
+			hi = 0x8f;
+		}
+	} else {
+		return 0;
+	}
+	if (str[1] < lo || str[1] > hi) {
+		return 0;
+	}
+	for (i = 2; i < len; ++i) {
+		if (str[i] < 0x80 || str[i] > 0xbf) {
+			return 0;
+		}
+	}
+	return len;
+}
+
+/*
+ * Append str as a JSON string literal. Runs that need no escaping are copied
+ * in one go. Bytes that aren't valid UTF-8 come out as U+FFFD, so the output
+ * stays valid JSON; returns whether there were any.
+ */
+bool
+record_string(const char *str)
+{
+	const char *run;
+	unsigned char c;
+	size_t len;
+	bool lossy;
+	char esc[7];
+
+	lossy = false;
+	out_char('"');
+	for (run = str; (c = *str) != '\0'; str += len) {
+		len = 1;
+		if (c >= 0x80) {
+			if ((len = utf8_len((const unsigned char *)str)) > 0) {
+				continue;
+			}
+			out_mem(run, str - run);
+			out_str("\\ufffd");
+			lossy = true;
+			len = 1;
+			run = str + 1;
+			continue;
+		}
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		out_mem(run, str - run);
+		run = str + 1;
+		esc[0] = '\\';
+		if (c == '"' || c == '\\') {
+			esc[1] = c;
+			out_mem(esc, 2);
+		} else {
+			/* \u00XX */
+			(void)memcpy(esc + 1, "u00", 3);
+			esc[4] = "0123456789abcdef"[c >> 4];
+			esc[5] = "0123456789abcdef"[c & 0xf];
+			out_mem(esc, 6);
+		}
+	}
+	out_mem(run, str - run);
+	out_char('"');
+	return lossy;
+}
+
+/*
+ * Append the bytes of str as a base64 (RFC 4648, padded) JSON string
+ */
+void
+record_base64(const char *str)
+{
+	const unsigned char *p;
+	size_t len;
+	uint32_t n;
+	char quad[4];
+	const char *digits =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	out_char('"');
+	p = (const unsigned char *)str;
+	for (len = strlen(str); len > 0; len -= len < 3 ? len : 3, p += 3) {
+		n = (uint32_t)p[0] << 16;
+		if (len > 1) {
+			n |= (uint32_t)p[1] << 8;
+		}
+		if (len > 2) {
+			n |= p[2];
+		}
+		quad[0] = digits[n >> 18];
+		quad[1] = digits[(n >> 12) & 0x3f];
+		quad[2] = len > 1 ? digits[(n >> 6) & 0x3f] : '=';
+		quad[3] = len > 2 ? digits[n & 0x3f] : '=';
+		out_mem(quad, 4);
+	}
+	out_char('"');
+}
+
+/*
+ * Append the field key holding str and, if str isn't valid UTF-8, the field
+ * key_bytes holding its exact bytes in base64 after it
+ */
+void
+record_text(const char *key, const char *str)
+{
+	out_char('"');
+	out_str(key);
+	out_str("\":");
+	if (record_string(str)) {
+		out_str(",\"");
+		out_str(key);
+		out_str("_bytes\":");
+		record_base64(str);
+	}
+}
+
+/*
+ * Append ts as a whole number of nanoseconds. It is rendered from the
+ * seconds and nanoseconds separately, so times 64 bits of nanoseconds can't
+ * hold still come out exact.
+ */
+void
+record_time(const struct timespec *ts)
+{
+	int i;
+	uint64_t sec;
+	long nsec;
+	char digits[NSEC_DIGITS];
+
+	if (ts->tv_sec < 0) {
+		out_char('-');
+		/* -(sec + nsec) = -(sec + 1) + (1s - nsec) */
+		sec = (uint64_t)0 - (uint64_t)ts->tv_sec;
+		nsec = ts->tv_nsec;
+		if (nsec > 0) {
+			sec--;
+			nsec = NSEC_PER_SEC - nsec;
+		}
+	} else {
+		sec = ts->tv_sec;
+		nsec = ts->tv_nsec;
+	}
+	if (sec == 0) {
+		out_ulong(nsec, 0);
+		return;
+	}
+	out_ulong(sec, 0);
+	for (i = NSEC_DIGITS - 1; i >= 0; --i) {
+		digits[i] = '0' + nsec % 10;
+		nsec /= 10;
+	}
+	out_mem(digits, NSEC_DIGITS);
+}
+
+/*
+ * Append a number after key, which includes the separator and the quotes
+ */
+void
+record_field(const char *key, uint64_t n)
+{
+	out_str(key);
+	out_ulong(n, 0);
+}
+
+/*
+ * One JSON object per line
+ */
+void
+record_ndjson(const char *dir, const char *name, const struct stat *st,
+              const char *link)
+{
+	out_char('{');
+	record_text("dir", dir);
+	out_char(',');
+	record_text("name", name);
+	record_field(",\"ino\":", st->st_ino);
+	record_field(",\"mode\":", st->st_mode);
+	record_field(",\"nlink\":", st->st_nlink);
+	record_field(",\"uid\":", st->st_uid);
+	record_field(",\"gid\":", st->st_gid);
+	record_field(",\"size\":", st->st_size);
+	record_field(",\"blocks\":", st->st_blocks);
+	record_field(",\"rdev\":", st->st_rdev);
+	out_str(",\"atime\":");
+	record_time(&st->st_atim);
+	out_str(",\"mtime\":");
+	record_time(&st->st_mtim);
+	out_str(",\"ctime\":");
+	record_time(&st->st_ctim);
+	if (link != NULL) {
+		out_char(',');
+		record_text("link", link);
+	}
+	out_char('}');
+	out_newline();
+}
+
+/*
+ * Store the low size bytes of n at p, least significant first, and return
+ * the end.
+ */
+uint8_t *
+put_le(uint8_t *p, uint64_t n, int size)
+{
+	int i;
+
+	for (i = 0; i < size; ++i) {
+		p[i] = (uint8_t)(n >> (i * CHAR_BIT));
+	}
+	return p + size;
+}
+
+/*
+ * One length-prefixed record, see record.h
+ */
+void
+record_binary(const char *dir, const char *name, const struct stat *st,
+              const char *link)
+{
+	size_t dir_len, name_len, link_len;
+	uint8_t fixed[RECORD_FIXED_LEN];
+	uint8_t *p;
+
+	dir_len = strlen(dir) + 1;
+	name_len = strlen(name) + 1;
+	link_len = link == NULL ? 1 : strlen(link) + 1;
+
+	p = put_le(fixed, RECORD_FIXED_LEN - 4 + dir_len + name_len + link_len,
+	           4);
+	p = put_le(p, st->st_ino, 8);
+	p = put_le(p, st->st_nlink, 8);
+	p = put_le(p, st->st_size, 8);
+	p = put_le(p, st->st_blocks, 8);
+	p = put_le(p, st->st_rdev, 8);
+	p = put_le(p, st->st_atim.tv_sec, 8);
+	p = put_le(p, st->st_mtim.tv_sec, 8);
+	p = put_le(p, st->st_ctim.tv_sec, 8);
+	p = put_le(p, st->st_atim.tv_nsec, 4);
+	p = put_le(p, st->st_mtim.tv_nsec, 4);
+	p = put_le(p, st->st_ctim.tv_nsec, 4);
+	p = put_le(p, st->st_mode, 4);
+	p = put_le(p, st->st_uid, 4);
+	(void)put_le(p, st->st_gid, 4);
+
+	out_mem((const char *)fixed, RECORD_FIXED_LEN);
+	out_mem(dir, dir_len);
+	out_mem(name, name_len);
+	out_mem(link == NULL ? "" : link, link_len);
+}
+
+/*
+ * Print the entry name of directory dir (the empty string for operands) as
+ * a record in the --ndjson or --binary format. link is the symlink target,
+ * NULL if the entry isn't one.
+ */
+void
+record_print(const char *dir, const char *name, const struct stat *st,
+             const char *link)
+{
+	if (ls_config.records == NDJSON_RECORDS) {
+		record_ndjson(dir, name, st, link);
+	} else {
+		record_binary(dir, name, st, link);
+	}
+}
@@ -0,0 +1,29 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+/*
+ * --binary record layout. Integers are little-endian.
+ *
+ *	u32	length of the rest of the record
+ *	u64	ino, nlink, size, blocks, rdev
+ *	i64	atime, mtime, ctime seconds
+ *	u32	atime, mtime, ctime nanoseconds
+ *	u32	mode, uid, gid
+ *	then the directory, the name and the symlink target (empty if it isn't
+ *	one), each nul-terminated. The directory is empty for operands.
+ */
+/*
+ * --ndjson writes the same fields as one JSON object per line. dir, name and
+ * link are JSON strings; where one of them isn't valid UTF-8, its invalid
+ * bytes read U+FFFD and a dir_bytes, name_bytes or link_bytes field right
+ * after it holds the exact bytes in base64.
+ */
+#define RECORD_FIXED_LEN (4 + 5 * 8 + 3 * 8 + 3 * 4 + 3 * 4)
+
+void record_print(const char *, const char *, const struct stat *,
+                  const char *);
+
+#endif /* _RECORD_H_ */
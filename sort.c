@@ -2,19 +2,83 @@
 
 #include <sys/stat.h>
 
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "config.h"
+#include "stats.h"
+#include "trace.h"
+
+#define SIGN_BIT (UINT64_C(1) << 63)
+#define PREFIX_LEN ((int)sizeof(uint64_t))
+/* bytes of secondary then of primary, least significant first */
+#define RADIX_PASSES 12
+#define RADIX_BUCKETS 256
+/* below this many keys insertion sort beats merging */
+#define INSERTION_SORT_MAX 16
+/* from this many keys on, the sort is split across ls_config.nthreads */
+#define PSORT_MIN 65536
+/* buckets are numbered in a byte */
+#define PSORT_MAX_THREADS 64
+/* sample keys per bucket the splitters are picked from */
+#define PSORT_OVERSAMPLE 64
+
+/*
+ * Sample sort: splitters picked from a sample divide the keys into one
+ * bucket per thread, every key of a bucket ordering before those of the
+ * next. Each thread counts and then scatters its share of the keys into
+ * the buckets and sorts one of them.
+ */
+typedef struct psort_t {
+	sortkey_t *keys; /* sorted in place */
+	sortkey_t *tmp;  /* n keys the buckets are scattered into */
+	size_t n;
+	int nthreads;
+	sortkey_t *splitters; /* nthreads - 1 */
+	uint8_t *bucket;      /* of every key */
+	size_t *counts; /* [thread][bucket] keys, then where they go in tmp */
+	size_t *starts; /* nthreads + 1 offsets of the buckets in tmp */
+	pthread_barrier_t barrier;
+	pthread_mutex_t lock; /* started and aborted */
+	pthread_cond_t cond;
+	bool started; /* every thread was created, or creating one failed */
+	bool aborted; /* it failed, the threads return without sorting */
+} psort_t;
+
+typedef struct psort_worker_t {
+	psort_t *ps;
+	int id;
+} psort_worker_t;
 
 extern config_t ls_config;
 
+bool sort_serial = false;
+
+unsigned int radix_byte(const sortkey_t *, int);
+sortkey_t *sortkeys_radix(sortkey_t *, sortkey_t *, size_t);
+int sortkey_name_cmp(const sortkey_t *, const sortkey_t *);
+int sortkey_cmp(const sortkey_t *, const sortkey_t *);
+void sortkeys_msort(sortkey_t *, sortkey_t *, size_t);
+void sortkeys_order(sortkey_t *, sortkey_t *, size_t);
+uint8_t psort_bucket(const psort_t *, const sortkey_t *);
+void *psort_worker(void *);
+void sortkeys_psort(sortkey_t *, sortkey_t *, size_t, int);
+
 /*
- * sort fts entries lexicographically
+ * sort entries lexicographically
  */
 int
-lexico_sort_func(const FTSENT **fts_ent1, const FTSENT **fts_ent2)
+lexico_entry_cmp(const char *name1, const struct stat *st1, const char *name2,
+                 const struct stat *st2)
 {
-	int cmp = strcmp((*fts_ent1)->fts_name, (*fts_ent2)->fts_name);
+	int cmp;
+
+	(void)st1;
+	(void)st2;
+	cmp = strcmp(name1, name2);
 	if (GET(ls_config.opts, REVERSE_SORT)) {
 		return -cmp;
 	} else {
@@ -23,33 +87,37 @@ lexico_sort_func(const FTSENT **fts_ent1, const FTSENT **fts_ent2)
 }
 
 /*
- * sort fts entries by time and then lexicographically
+ * sort entries by time and then lexicographically
  */
 int
-time_sort_func(const FTSENT **fts_ent1, const FTSENT **fts_ent2)
+time_entry_cmp(const char *name1, const struct stat *st1, const char *name2,
+               const struct stat *st2)
 {
-	time_t ret;
+	int ret;
 	struct timespec ts1, ts2;
+
 	switch (ls_config.time) {
-	case MTIME:
-		ts1 = (*fts_ent1)->fts_statp->st_mtim;
-		ts2 = (*fts_ent2)->fts_statp->st_mtim;
-		break;
 	case ATIME:
-		ts1 = (*fts_ent1)->fts_statp->st_atim;
-		ts2 = (*fts_ent2)->fts_statp->st_atim;
+		ts1 = st1->st_atim;
+		ts2 = st2->st_atim;
 		break;
 	case CTIME:
-		ts1 = (*fts_ent1)->fts_statp->st_ctim;
-		ts2 = (*fts_ent2)->fts_statp->st_ctim;
+		ts1 = st1->st_ctim;
+		ts2 = st2->st_ctim;
+		break;
+	case MTIME: /* FALLTHROUGH */
+	default:
+		ts1 = st1->st_mtim;
+		ts2 = st2->st_mtim;
 		break;
 	}
-	ret = ts2.tv_sec - ts1.tv_sec;
-	if (ret == 0) {
-		ret = ts2.tv_nsec - ts1.tv_nsec;
-		if (ret == 0) {
-			return lexico_sort_func(fts_ent1, fts_ent2);
-		}
+	/* compare rather than subtract, the differences don't fit an int */
+	if (ts1.tv_sec != ts2.tv_sec) {
+		ret = ts1.tv_sec < ts2.tv_sec ? 1 : -1;
+	} else if (ts1.tv_nsec != ts2.tv_nsec) {
+		ret = ts1.tv_nsec < ts2.tv_nsec ? 1 : -1;
+	} else {
+		return lexico_entry_cmp(name1, st1, name2, st2);
 	}
 	if (GET(ls_config.opts, REVERSE_SORT)) {
 		return -ret;
@@ -59,19 +127,18 @@ time_sort_func(const FTSENT **fts_ent1, const FTSENT **fts_ent2)
 }
 
 /*
- * Sort fts entries by size and then lexicographically
+ * Sort entries by size and then lexicographically
  */
 int
-size_sort_func(const FTSENT **fts_ent1, const FTSENT **fts_ent2)
+size_entry_cmp(const char *name1, const struct stat *st1, const char *name2,
+               const struct stat *st2)
 {
 	int ret;
-	blksize_t s1, s2;
-	s1 = (*fts_ent1)->fts_statp->st_size;
-	s2 = (*fts_ent2)->fts_statp->st_size;
-	ret = s2 - s1;
-	if (ret == 0) {
-		return lexico_sort_func(fts_ent1, fts_ent2);
+
+	if (st1->st_size == st2->st_size) {
+		return lexico_entry_cmp(name1, st1, name2, st2);
 	}
+	ret = st1->st_size < st2->st_size ? 1 : -1;
 	if (GET(ls_config.opts, REVERSE_SORT)) {
 		return -ret;
 	} else {
@@ -79,6 +146,36 @@ size_sort_func(const FTSENT **fts_ent1, const FTSENT **fts_ent2)
 	}
 }
 
+/*
+ * sort fts entries lexicographically
+ */
+int
+lexico_sort_func(const FTSENT **fts_ent1, const FTSENT **fts_ent2)
+{
+	return lexico_entry_cmp((*fts_ent1)->fts_name, (*fts_ent1)->fts_statp,
+	                        (*fts_ent2)->fts_name, (*fts_ent2)->fts_statp);
+}
+
+/*
+ * sort fts entries by time and then lexicographically
+ */
+int
+time_sort_func(const FTSENT **fts_ent1, const FTSENT **fts_ent2)
+{
+	return time_entry_cmp((*fts_ent1)->fts_name, (*fts_ent1)->fts_statp,
+	                      (*fts_ent2)->fts_name, (*fts_ent2)->fts_statp);
+}
+
+/*
+ * Sort fts entries by size and then lexicographically
+ */
+int
+size_sort_func(const FTSENT **fts_ent1, const FTSENT **fts_ent2)
+{
+	return size_entry_cmp((*fts_ent1)->fts_name, (*fts_ent1)->fts_statp,
+	                      (*fts_ent2)->fts_name, (*fts_ent2)->fts_statp);
+}
+
 /*
  * Initially sort by directory
  */
@@ -101,3 +198,579 @@ initial_sort_func(const FTSENT **fts_ent1, const FTSENT **fts_ent2)
 	}
 	return e1 - e2;
 }
+
+/*
+ * Extract the sort keys of one entry. idx is its position before sorting,
+ * name must stay valid until the keys are sorted.
+ */
+void
+sortkey_init(sortkey_t *key, uint32_t idx, const char *name,
+             const struct stat *st)
+{
+	int i;
+	uint64_t prefix;
+	const struct timespec *ts;
+
+	key->idx = idx;
+	key->name = name;
+	prefix = 0;
+	for (i = 0; i < PREFIX_LEN && name[i] != '\0'; ++i) {
+		prefix |= (uint64_t)(unsigned char)name[i]
+		          << (8 * (PREFIX_LEN - 1 - i));
+	}
+	key->prefix = prefix;
+	key->primary = 0;
+	key->secondary = 0;
+
+	/* flipping the sign bit makes signed order unsigned order, and
+	 * inverting makes the largest (newest) value come first */
+	switch (ls_config.sort) {
+	case LEXICO_SORT:
+		break;
+	case TIME_SORT:
+		switch (ls_config.time) {
+		case ATIME:
+			ts = &st->st_atim;
+			break;
+		case CTIME:
+			ts = &st->st_ctim;
+			break;
+		case MTIME: /* FALLTHROUGH */
+		default:
+			ts = &st->st_mtim;
+			break;
+		}
+		key->primary = ~((uint64_t)ts->tv_sec ^ SIGN_BIT);
+		key->secondary = ~(uint32_t)ts->tv_nsec;
+		break;
+	case SIZE_SORT:
+		key->primary = ~((uint64_t)st->st_size ^ SIGN_BIT);
+		break;
+	}
+}
+
+/*
+ * byte pass of the numeric keys, counting from the least significant
+ */
+unsigned int
+radix_byte(const sortkey_t *key, int pass)
+{
+	if (pass < 4) {
+		return (key->secondary >> (8 * pass)) & 0xff;
+	}
+	return (key->primary >> (8 * (pass - 4))) & 0xff;
+}
+
+/*
+ * LSD radix sort of keys by primary and secondary, using tmp as the other
+ * buffer. All histograms are taken in one read of the keys, and passes over
+ * bytes that are the same in every key (the high bytes of sizes and times
+ * usually are) are skipped. Returns whichever buffer ended up sorted.
+ */
+sortkey_t *
+sortkeys_radix(sortkey_t *keys, sortkey_t *tmp, size_t n)
+{
+	int pass;
+	size_t i, sum, count;
+	size_t(*counts)[RADIX_BUCKETS];
+	sortkey_t *src, *dst, *swap;
+
+	if ((counts = calloc(RADIX_PASSES, sizeof(*counts))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate radix counts");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+	for (i = 0; i < n; ++i) {
+		for (pass = 0; pass < RADIX_PASSES; ++pass) {
+			counts[pass][radix_byte(&keys[i], pass)]++;
+		}
+	}
+
+	src = keys;
+	dst = tmp;
+	for (pass = 0; pass < RADIX_PASSES; ++pass) {
+		if (counts[pass][radix_byte(&src[0], pass)] == n) {
+			continue;
+		}
+		for (i = 0, sum = 0; i < RADIX_BUCKETS; ++i) {
+			count = counts[pass][i];
+			counts[pass][i] = sum;
+			sum += count;
+		}
+		for (i = 0; i < n; ++i) {
+			dst[counts[pass][radix_byte(&src[i], pass)]++] = src[i];
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	free(counts);
+	return src;
+}
+
+/*
+ * strcmp of the names, deciding on the cached prefixes when they differ
+ */
+int
+sortkey_name_cmp(const sortkey_t *key1, const sortkey_t *key2)
+{
+	if (key1->prefix != key2->prefix) {
+		return key1->prefix < key2->prefix ? -1 : 1;
+	}
+	/* equal prefixes with a nul in them are equal names */
+	if ((key1->prefix & 0xff) == 0) {
+		return 0;
+	}
+	return strcmp(key1->name + PREFIX_LEN, key2->name + PREFIX_LEN);
+}
+
+/*
+ * The whole order sortkeys_order sorts by, before -r: the numeric keys,
+ * then the names
+ */
+int
+sortkey_cmp(const sortkey_t *key1, const sortkey_t *key2)
+{
+	if (key1->primary != key2->primary) {
+		return key1->primary < key2->primary ? -1 : 1;
+	}
+	if (key1->secondary != key2->secondary) {
+		return key1->secondary < key2->secondary ? -1 : 1;
+	}
+	return sortkey_name_cmp(key1, key2);
+}
+
+/*
+ * sortkey_cmp in the order of the listing, so with -r too
+ */
+int
+sortkey_list_cmp(const sortkey_t *key1, const sortkey_t *key2)
+{
+	if (GET(ls_config.opts, REVERSE_SORT)) {
+		return sortkey_cmp(key2, key1);
+	}
+	return sortkey_cmp(key1, key2);
+}
+
+/*
+ * Move heap[i] up to its place in the max-heap heap[0..i], the key listed
+ * last at the top.
+ */
+void
+sortkeys_heap_up(sortkey_t *heap, size_t i)
+{
+	size_t parent;
+	sortkey_t key;
+
+	key = heap[i];
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (sortkey_list_cmp(&heap[parent], &key) >= 0) {
+			break;
+		}
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = key;
+}
+
+/*
+ * Move heap[i] down to its place in the max-heap of n keys
+ */
+void
+sortkeys_heap_down(sortkey_t *heap, size_t n, size_t i)
+{
+	size_t child;
+	sortkey_t key;
+
+	key = heap[i];
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n &&
+		    sortkey_list_cmp(&heap[child + 1], &heap[child]) > 0) {
+			child++;
+		}
+		if (sortkey_list_cmp(&key, &heap[child]) >= 0) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = key;
+}
+
+/*
+ * Merge sort keys by name. tmp must hold n / 2 keys.
+ */
+void
+sortkeys_msort(sortkey_t *keys, sortkey_t *tmp, size_t n)
+{
+	size_t i, j, k, half;
+	sortkey_t key;
+
+	if (n <= INSERTION_SORT_MAX) {
+		for (i = 1; i < n; ++i) {
+			key = keys[i];
+			for (j = i; j > 0 && sortkey_name_cmp(&keys[j - 1], &key) > 0;
+			     --j) {
+				keys[j] = keys[j - 1];
+			}
+			keys[j] = key;
+		}
+		return;
+	}
+
+	half = n / 2;
+	sortkeys_msort(keys, tmp, half);
+	sortkeys_msort(keys + half, tmp, n - half);
+	if (sortkey_name_cmp(&keys[half - 1], &keys[half]) <= 0) {
+		return;
+	}
+
+	/* the right half is merged in place, behind the write position */
+	(void)memcpy(tmp, keys, half * sizeof(sortkey_t));
+	for (i = 0, j = half, k = 0; i < half && j < n; ++k) {
+		if (sortkey_name_cmp(&keys[j], &tmp[i]) < 0) {
+			keys[k] = keys[j++];
+		} else {
+			keys[k] = tmp[i++];
+		}
+	}
+	(void)memcpy(keys + k, tmp + i, (half - i) * sizeof(sortkey_t));
+}
+
+/*
+ * Sort keys by sortkey_cmp on one thread: numeric keys with a radix sort,
+ * then every run of equal numeric keys (the whole array for a plain sort)
+ * by name. tmp must hold n keys.
+ */
+void
+sortkeys_order(sortkey_t *keys, sortkey_t *tmp, size_t n)
+{
+	size_t i, start;
+	sortkey_t *sorted;
+
+	if (ls_config.sort == LEXICO_SORT) {
+		sortkeys_msort(keys, tmp, n);
+		return;
+	}
+	if ((sorted = sortkeys_radix(keys, tmp, n)) != keys) {
+		(void)memcpy(keys, sorted, n * sizeof(sortkey_t));
+	}
+	for (start = 0, i = 1; i <= n; ++i) {
+		if (i < n && keys[i].primary == keys[start].primary &&
+		    keys[i].secondary == keys[start].secondary) {
+			continue;
+		}
+		if (i - start > 1) {
+			sortkeys_msort(keys + start, tmp, i - start);
+		}
+		start = i;
+	}
+}
+
+/*
+ * The bucket key goes in: the number of splitters ordering before it
+ */
+uint8_t
+psort_bucket(const psort_t *ps, const sortkey_t *key)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = ps->nthreads - 1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (sortkey_cmp(&ps->splitters[mid], key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (uint8_t)lo;
+}
+
+/*
+ * One thread of sortkeys_psort. Thread id takes the id-th slice of the keys
+ * for counting and scattering, and bucket id for sorting.
+ */
+void *
+psort_worker(void *arg)
+{
+	int t, b;
+	size_t i, lo, hi, off, count, *slot;
+	uint64_t start;
+	stats_phase_t prev;
+	psort_worker_t *worker;
+	psort_t *ps;
+	size_t *counts;
+
+	worker = arg;
+	ps = worker->ps;
+	if (worker->id > 0) {
+		pthread_mutex_lock(&ps->lock);
+		while (!ps->started) {
+			pthread_cond_wait(&ps->cond, &ps->lock);
+		}
+		pthread_mutex_unlock(&ps->lock);
+		if (ps->aborted) {
+			return NULL;
+		}
+		TRACE_THREAD("sort worker");
+	}
+	start = TRACE_START();
+	prev = STATS_ENTER(PHASE_SORT);
+	lo = ps->n * worker->id / ps->nthreads;
+	hi = ps->n * (worker->id + 1) / ps->nthreads;
+	counts = ps->counts + (size_t)worker->id * ps->nthreads;
+
+	for (i = lo; i < hi; ++i) {
+		ps->bucket[i] = psort_bucket(ps, &ps->keys[i]);
+		counts[ps->bucket[i]]++;
+	}
+
+	/* the first thread turns the counts into offsets, buckets in order
+	 * and each bucket in thread order */
+	(void)pthread_barrier_wait(&ps->barrier);
+	if (worker->id == 0) {
+		off = 0;
+		for (b = 0; b < ps->nthreads; ++b) {
+			ps->starts[b] = off;
+			for (t = 0; t < ps->nthreads; ++t) {
+				slot = ps->counts + b;
+				slot += (size_t)t * ps->nthreads;
+				count = *slot;
+				*slot = off;
+				off += count;
+			}
+		}
+		ps->starts[ps->nthreads] = off;
+	}
+	(void)pthread_barrier_wait(&ps->barrier);
+
+	for (i = lo; i < hi; ++i) {
+		ps->tmp[counts[ps->bucket[i]]++] = ps->keys[i];
+	}
+	(void)pthread_barrier_wait(&ps->barrier);
+
+	/* the bucket's range of keys is free to sort it with */
+	lo = ps->starts[worker->id];
+	hi = ps->starts[worker->id + 1];
+	sortkeys_order(ps->tmp + lo, ps->keys + lo, hi - lo);
+	(void)memcpy(ps->keys + lo, ps->tmp + lo,
+	             (hi - lo) * sizeof(sortkey_t));
+
+	STATS_LEAVE(prev);
+	TRACE_SPAN("sort", start, NULL, (long)(hi - lo));
+	return NULL;
+}
+
+/*
+ * sortkeys_order on nthreads threads, the calling one included. The keys
+ * are totally ordered (names differ), so this gives the same order. If the
+ * threads can't be created it falls back to sortkeys_order.
+ */
+void
+sortkeys_psort(sortkey_t *keys, sortkey_t *tmp, size_t n, int nthreads)
+{
+	int i, ncreated;
+	size_t nsample;
+	psort_t ps;
+	psort_worker_t *workers;
+	pthread_t *threads;
+	sortkey_t *sample;
+
+	(void)memset(&ps, 0, sizeof(psort_t));
+	ps.keys = keys;
+	ps.tmp = tmp;
+	ps.n = n;
+	ps.nthreads = nthreads;
+
+	/* evenly spaced, tmp is free until the scatter */
+	nsample = (size_t)nthreads * PSORT_OVERSAMPLE;
+	sample = tmp + n - nsample;
+	for (i = 0; (size_t)i < nsample; ++i) {
+		sample[i] = keys[(size_t)i * n / nsample];
+	}
+	sortkeys_order(sample, tmp, nsample);
+
+	if ((ps.splitters = malloc((nthreads - 1) * sizeof(sortkey_t))) ==
+	        NULL ||
+	    (ps.bucket = malloc(n)) == NULL ||
+	    (ps.counts = calloc((size_t)nthreads * nthreads,
+	                        sizeof(size_t))) == NULL ||
+	    (ps.starts = malloc((nthreads + 1) * sizeof(size_t))) == NULL ||
+	    (workers = calloc(nthreads, sizeof(psort_worker_t))) == NULL ||
+	    (threads = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate parallel sort");
+	}
+	STATS_COUNT(COUNT_ALLOC, 6);
+	for (i = 0; i < nthreads - 1; ++i) {
+		ps.splitters[i] = sample[(i + 1) * PSORT_OVERSAMPLE - 1];
+	}
+	if ((errno = pthread_barrier_init(&ps.barrier, NULL, nthreads)) != 0) {
+		err(EXIT_FAILURE, "pthread_barrier_init");
+	}
+	pthread_mutex_init(&ps.lock, NULL);
+	pthread_cond_init(&ps.cond, NULL);
+
+	for (i = 0; i < nthreads; ++i) {
+		workers[i].ps = &ps;
+		workers[i].id = i;
+	}
+	/* the threads wait until all of them exist, so that a failure
+	 * leaves none of them stuck at the barrier */
+	for (ncreated = 1; ncreated < nthreads; ++ncreated) {
+		if ((errno = pthread_create(&threads[ncreated], NULL,
+		                            psort_worker,
+		                            &workers[ncreated])) != 0) {
+			warn("pthread_create, sorting on one thread");
+			ps.aborted = true;
+			break;
+		}
+	}
+	pthread_mutex_lock(&ps.lock);
+	ps.started = true;
+	pthread_cond_broadcast(&ps.cond);
+	pthread_mutex_unlock(&ps.lock);
+	if (ps.aborted) {
+		sortkeys_order(keys, tmp, n);
+	} else {
+		(void)psort_worker(&workers[0]);
+	}
+	for (i = 1; i < ncreated; ++i) {
+		if ((errno = pthread_join(threads[i], NULL)) != 0) {
+			err(EXIT_FAILURE, "pthread_join");
+		}
+	}
+
+	pthread_cond_destroy(&ps.cond);
+	pthread_mutex_destroy(&ps.lock);
+	(void)pthread_barrier_destroy(&ps.barrier);
+	free(ps.splitters);
+	free(ps.bucket);
+	free(ps.counts);
+	free(ps.starts);
+	free(workers);
+	free(threads);
+}
+
+/*
+ * Sort keys filled in by sortkey_init in the order the entry comparators
+ * define, see sortkeys_order, and -r reverses it all. Large directories are
+ * sorted on several threads.
+ */
+void
+sortkeys_sort(sortkey_t *keys, size_t n)
+{
+	size_t i;
+	int nthreads;
+	sortkey_t key;
+	sortkey_t *tmp;
+	uint64_t span_start;
+	stats_phase_t prev;
+
+	if (n < 2) {
+		return;
+	}
+	span_start = TRACE_START();
+	prev = STATS_ENTER(PHASE_SORT);
+	if ((tmp = malloc(n * sizeof(sortkey_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate sort keys");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+
+	nthreads = ls_config.nthreads;
+	if (nthreads > PSORT_MAX_THREADS) {
+		nthreads = PSORT_MAX_THREADS;
+	}
+	if (n >= PSORT_MIN && nthreads > 1 && !sort_serial) {
+		sortkeys_psort(keys, tmp, n, nthreads);
+	} else {
+		sortkeys_order(keys, tmp, n);
+	}
+
+	if (GET(ls_config.opts, REVERSE_SORT)) {
+		for (i = 0; i < n / 2; ++i) {
+			key = keys[i];
+			keys[i] = keys[n - 1 - i];
+			keys[n - 1 - i] = key;
+		}
+	}
+	free(tmp);
+	STATS_LEAVE(prev);
+	TRACE_SPAN("sort", span_start, NULL, (long)n);
+}
+
+/*
+ * Move the first k keys in list order to the front and sort them, as
+ * sortkeys_sort would have. A max-heap of k keys is kept while the others go
+ * by, so this takes O(n log k). The keys that didn't make it follow in no
+ * particular order. Returns how many were kept.
+ */
+size_t
+sortkeys_head(sortkey_t *keys, size_t n, size_t k)
+{
+	size_t i;
+	sortkey_t key;
+	uint64_t span_start;
+	stats_phase_t prev;
+
+	if (n <= k) {
+		sortkeys_sort(keys, n);
+		return n;
+	}
+	span_start = TRACE_START();
+	prev = STATS_ENTER(PHASE_SORT);
+	for (i = 1; i < k; ++i) {
+		sortkeys_heap_up(keys, i);
+	}
+	for (i = k; i < n; ++i) {
+		if (sortkey_list_cmp(&keys[i], &keys[0]) < 0) {
+			key = keys[0];
+			keys[0] = keys[i];
+			keys[i] = key;
+			sortkeys_heap_down(keys, k, 0);
+		}
+	}
+	STATS_LEAVE(prev);
+	TRACE_SPAN("select", span_start, NULL, (long)n);
+	sortkeys_sort(keys, k);
+	return k;
+}
+
+/*
+ * Sort a list of fts entries with sortkeys_sort and relink it. Returns the
+ * new head.
+ */
+FTSENT *
+ftsents_sort(FTSENT *list)
+{
+	size_t i, n;
+	FTSENT *p;
+	FTSENT **ents;
+	sortkey_t *keys;
+
+	for (n = 0, p = list; p != NULL; p = p->fts_link) {
+		n++;
+	}
+	if (n < 2) {
+		return list;
+	}
+	if ((ents = malloc(n * sizeof(FTSENT *))) == NULL ||
+	    (keys = malloc(n * sizeof(sortkey_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate sort keys");
+	}
+	STATS_COUNT(COUNT_ALLOC, 2);
+	for (i = 0, p = list; p != NULL; p = p->fts_link, ++i) {
+		ents[i] = p;
+		sortkey_init(&keys[i], i, p->fts_name, p->fts_statp);
+	}
+	sortkeys_sort(keys, n);
+	for (i = 0; i + 1 < n; ++i) {
+		ents[keys[i].idx]->fts_link = ents[keys[i + 1].idx];
+	}
+	ents[keys[n - 1].idx]->fts_link = NULL;
+	list = ents[keys[0].idx];
+	free(ents);
+	free(keys);
+	return list;
+}
@@ -1,15 +1,51 @@
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <fts.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifndef _SORT_H_
 #define _SORT_H_
 
 typedef int (*FTSENT_COMPARE)(const FTSENT **, const FTSENT **);
+typedef int (*ENTRY_COMPARE)(const char *, const struct stat *, const char *,
+                             const struct stat *);
+
+/*
+ * Everything the sort looks at for one entry, extracted once so sorting
+ * doesn't chase pointers to the names and stat buffers.
+ */
+typedef struct sortkey_t {
+	uint64_t primary;   /* size or tv_sec, mapped so ascending is list order */
+	uint32_t secondary; /* tv_nsec, mapped the same way */
+	uint32_t idx;       /* position of the entry before sorting */
+	uint64_t prefix;    /* first 8 bytes of the name, big-endian */
+	const char *name;
+} sortkey_t;
+
+/* set while the --parallel workers sort directories, each on its own */
+extern bool sort_serial;
+
+int lexico_entry_cmp(const char *, const struct stat *, const char *,
+                     const struct stat *);
+int time_entry_cmp(const char *, const struct stat *, const char *,
+                   const struct stat *);
+int size_entry_cmp(const char *, const struct stat *, const char *,
+                   const struct stat *);
 
 int lexico_sort_func(const FTSENT **, const FTSENT **);
 int time_sort_func(const FTSENT **, const FTSENT **);
 int size_sort_func(const FTSENT **, const FTSENT **);
 int initial_sort_func(const FTSENT **, const FTSENT **);
 
+void sortkey_init(sortkey_t *, uint32_t, const char *, const struct stat *);
+int sortkey_list_cmp(const sortkey_t *, const sortkey_t *);
+void sortkeys_heap_up(sortkey_t *, size_t);
+void sortkeys_heap_down(sortkey_t *, size_t, size_t);
+void sortkeys_sort(sortkey_t *, size_t);
+size_t sortkeys_head(sortkey_t *, size_t, size_t);
+FTSENT *ftsents_sort(FTSENT *);
+
 #endif /* _SORT_H_ */
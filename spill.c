@@ -0,0 +1,462 @@
+#include "spill.h"
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "filter.h"
+#include "ls.h"
+#include "output.h"
+#include "sort.h"
+#include "stats.h"
+#include "trace.h"
+
+extern config_t ls_config;
+
+/* what an entry costs besides its name and target: the dentry and the copy
+ * dentries_sort makes, the sort key and its scratch copy, and its columns */
+#define SPILL_ENTRY_COST (2 * sizeof(dentry_t) + 2 * sizeof(sortkey_t) + 128)
+/* smallest read buffer of a run, the longest record fits in it */
+#define SPILL_MIN_BUF 8192
+/* merged entries whose rows are printed together */
+#define SPILL_BATCH 1024
+#define SPILL_NO_LINK UINT32_MAX
+
+/*
+ * A record of a run, followed by the name and the symlink target, each with
+ * its NUL
+ */
+typedef struct spill_hdr_t {
+	struct stat st;
+	ino_t ino;
+	mode_t type;
+	int err;
+	int link_err;
+	uint32_t name_len;
+	uint32_t link_len; /* SPILL_NO_LINK if there is no target */
+	bool has_stat;
+} spill_hdr_t;
+
+/*
+ * A sorted run of the spill file, read a buffer at a time by the merge
+ */
+typedef struct spill_run_t {
+	off_t off; /* next byte to read */
+	off_t end;
+	char *buf;
+	size_t len;      /* bytes in buf */
+	size_t pos;      /* the current record in buf */
+	size_t rec_len;  /* and its length */
+	dentry_t dentry; /* the current record, its name and link in buf */
+	sortkey_t key;
+} spill_run_t;
+
+/*
+ * The runs of the directory being listed with --mem-limit, one after the
+ * other in an unlinked temporary file
+ */
+typedef struct spill_t {
+	FILE *fp;
+	off_t off; /* where the next run starts */
+	spill_run_t *runs;
+	int nruns;
+	int runs_cap;
+	int nlisted;    /* entries the columns were measured from */
+	size_t buf_cap; /* of each run while merging */
+} spill_t;
+
+spill_t spill;
+
+void spill_open(void);
+void spill_measure(dentries_t *, fileinfos_t *);
+void spill_write(int, dentries_t *, fileinfos_t *, uint8_t);
+bool spill_load(spill_run_t *, int);
+bool spill_before(const spill_run_t *, const spill_run_t *);
+void spill_down(spill_run_t **, int, int);
+int spill_read(int, dentries_t *, fileinfos_t *, uint8_t);
+int spill_print(fileinfos_t *, const char *);
+
+/*
+ * Create the spill file in $TMPDIR, or /tmp
+ */
+void
+spill_open(void)
+{
+	int fd;
+	char *path;
+	const char *tmpdir;
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL || *tmpdir == '\0') {
+		tmpdir = "/tmp";
+	}
+	ASPRINTF("couldn't alloc spill file name", &path, "%s/ls.XXXXXX",
+	         tmpdir);
+	if ((fd = mkstemp(path)) < 0 ||
+	    (spill.fp = fdopen(fd, "w+")) == NULL) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+	/* it goes away with the descriptor */
+	(void)unlink(path);
+	free(path);
+	spill.off = 0;
+}
+
+/*
+ * Add the entries of a chunk that are listed to fileinfos, for the column
+ * widths and the total, then drop them again
+ */
+void
+spill_measure(dentries_t *dentries, fileinfos_t *fileinfos)
+{
+	int i;
+	dentry_t *dentry;
+	stats_phase_t prev;
+
+	if (ls_config.names_only || ls_config.records != NO_RECORDS) {
+		return;
+	}
+	prev = STATS_ENTER(PHASE_COLLECT);
+	for (i = 0; i < dentries->size; ++i) {
+		dentry = &dentries->arr[i];
+		if (dentry->err != 0 ||
+		    (ls_config.dots == NO_DOTS && dentry->name[0] == '.') ||
+		    (ls_config.filter && !filter_dentry(dentry))) {
+			continue;
+		}
+		/* the target isn't in a column, and a failed readlink is
+		 * reported when the entry is printed */
+		fileinfos_add(fileinfos, dentry->name, &dentry->st,
+		              dentry->link);
+		spill.nlisted++;
+	}
+	fileinfos_clear(fileinfos);
+	STATS_LEAVE(prev);
+}
+
+/*
+ * Measure the chunk read into dentries, sort it and append it to the spill
+ * file as a run. dentries is emptied for the next chunk.
+ */
+void
+spill_write(int dirfd, dentries_t *dentries, fileinfos_t *fileinfos,
+            uint8_t needs)
+{
+	int i;
+	spill_hdr_t hdr;
+	dentry_t *dentry;
+	spill_run_t *run;
+	uint64_t start;
+
+	start = TRACE_START();
+	if (ls_config.fetch_later) {
+		dentries->nerrs += dentries_fetch(dirfd, dentries, needs);
+	}
+	if (spill.fp == NULL) {
+		spill_open();
+	}
+	if (spill.nruns == spill.runs_cap) {
+		spill.runs_cap = spill.runs_cap == 0 ? INIT_CAP
+		                                     : spill.runs_cap * 2;
+		spill.runs =
+		    realloc(spill.runs, spill.runs_cap * sizeof(spill_run_t));
+		if (spill.runs == NULL) {
+			err(EXIT_FAILURE, "failed to allocate spill runs");
+		}
+		STATS_COUNT(COUNT_ALLOC, 1);
+	}
+	spill_measure(dentries, fileinfos);
+	dentries_sort(dentries);
+
+	run = &spill.runs[spill.nruns++];
+	run->off = spill.off;
+	for (i = 0; i < dentries->size; ++i) {
+		dentry = &dentries->arr[i];
+		/* a failed stat is still reported, even of a dotfile */
+		if (dentry->err == 0 &&
+		    ((ls_config.dots == NO_DOTS && dentry->name[0] == '.') ||
+		     (ls_config.filter && !filter_dentry(dentry)))) {
+			continue;
+		}
+		(void)memset(&hdr, 0, sizeof(spill_hdr_t));
+		hdr.st = dentry->st;
+		hdr.ino = dentry->ino;
+		hdr.type = dentry->type;
+		hdr.err = dentry->err;
+		hdr.link_err = dentry->link_err;
+		hdr.has_stat = dentry->has_stat;
+		hdr.name_len = strlen(dentry->name);
+		hdr.link_len = dentry->link == NULL ? SPILL_NO_LINK
+		                                    : strlen(dentry->link);
+		if (fwrite(&hdr, sizeof(spill_hdr_t), 1, spill.fp) != 1 ||
+		    fwrite(dentry->name, hdr.name_len + 1, 1, spill.fp) != 1 ||
+		    (dentry->link != NULL &&
+		     fwrite(dentry->link, hdr.link_len + 1, 1, spill.fp) !=
+		         1)) {
+			err(EXIT_FAILURE, "couldn't write spill file");
+		}
+		spill.off += sizeof(spill_hdr_t) + hdr.name_len + 1;
+		if (dentry->link != NULL) {
+			spill.off += hdr.link_len + 1;
+		}
+	}
+	run->end = spill.off;
+	TRACE_SPAN("spill", start, NULL, dentries->size);
+	dentries_free(dentries);
+}
+
+/*
+ * Decode the record at run->pos, reading more of the run when the buffer
+ * ends in the middle of it. Returns false at the end of the run.
+ */
+bool
+spill_load(spill_run_t *run, int fd)
+{
+	ssize_t n;
+	size_t want;
+	spill_hdr_t hdr;
+
+	for (;;) {
+		if (run->len - run->pos >= sizeof(spill_hdr_t)) {
+			(void)memcpy(&hdr, run->buf + run->pos,
+			             sizeof(spill_hdr_t));
+			run->rec_len = sizeof(spill_hdr_t) + hdr.name_len + 1;
+			if (hdr.link_len != SPILL_NO_LINK) {
+				run->rec_len += hdr.link_len + 1;
+			}
+			if (run->len - run->pos >= run->rec_len) {
+				break;
+			}
+		}
+		if (run->off == run->end) {
+			if (run->pos == run->len) {
+				return false;
+			}
+			errx(EXIT_FAILURE, "truncated spill file");
+		}
+		/* the partial record moves to the front */
+		run->len -= run->pos;
+		(void)memmove(run->buf, run->buf + run->pos, run->len);
+		run->pos = 0;
+		want = spill.buf_cap - run->len;
+		if ((off_t)want > run->end - run->off) {
+			want = run->end - run->off;
+		}
+		if ((n = pread(fd, run->buf + run->len, want, run->off)) <= 0) {
+			err(EXIT_FAILURE, "couldn't read spill file");
+		}
+		run->len += n;
+		run->off += n;
+	}
+
+	run->dentry.name = run->buf + run->pos + sizeof(spill_hdr_t);
+	run->dentry.link = hdr.link_len == SPILL_NO_LINK
+	                       ? NULL
+	                       : run->dentry.name + hdr.name_len + 1;
+	run->dentry.st = hdr.st;
+	run->dentry.ino = hdr.ino;
+	run->dentry.type = hdr.type;
+	run->dentry.err = hdr.err;
+	run->dentry.link_err = hdr.link_err;
+	run->dentry.has_stat = hdr.has_stat;
+	if (ls_config.entry_compare != NULL) {
+		sortkey_init(&run->key, 0, run->dentry.name, &run->dentry.st);
+	}
+	return true;
+}
+
+/*
+ * Whether the current record of run1 is listed before that of run2
+ */
+bool
+spill_before(const spill_run_t *run1, const spill_run_t *run2)
+{
+	/* unsorted, the runs follow each other in the order they were read */
+	if (ls_config.entry_compare == NULL) {
+		return run1 < run2;
+	}
+	return sortkey_list_cmp(&run1->key, &run2->key) < 0;
+}
+
+/*
+ * Move heap[i] down to its place in the min-heap heap[0..n)
+ */
+void
+spill_down(spill_run_t **heap, int n, int i)
+{
+	int child;
+	spill_run_t *run;
+
+	run = heap[i];
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n &&
+		    spill_before(heap[child + 1], heap[child])) {
+			child++;
+		}
+		if (!spill_before(heap[child], run)) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = run;
+}
+
+/*
+ * dentries_scan for --mem-limit. Once the entries read would take more than
+ * the limit, they are sorted and written out as a run, and the rest follow
+ * as runs too, while fileinfos gets the column widths. A directory that fits
+ * is left in dentries. Returns 0 or the errno of the failed read.
+ */
+int
+spill_read(int fd, dentries_t *dentries, fileinfos_t *fileinfos,
+           uint8_t needs)
+{
+	int ret;
+	size_t size, limit;
+	DIR *dirp;
+	struct dirent *dp;
+	dentry_t *dentry;
+	stats_phase_t prev;
+
+	if ((dirp = fdopendir(fd)) == NULL) {
+		ret = errno;
+		(void)close(fd);
+		return ret;
+	}
+	prev = STATS_ENTER(PHASE_TRAVERSE);
+	fileinfos_reset(fileinfos);
+	spill.nruns = 0;
+	spill.nlisted = 0;
+	limit = (size_t)ls_config.mem_limit << 20;
+	size = 0;
+
+	for (;;) {
+		errno = 0;
+		if ((dp = readdir(dirp)) == NULL) {
+			ret = errno;
+			break;
+		}
+		if (ls_config.dots != ALL_DOTS &&
+		    (strcmp(dp->d_name, ".") == 0 ||
+		     strcmp(dp->d_name, "..") == 0)) {
+			continue;
+		}
+		if (ls_config.filter &&
+		    !filter_name(dp->d_name, DTTOIF(dp->d_type))) {
+			continue;
+		}
+		if (size >= limit) {
+			spill_write(dirfd(dirp), dentries, fileinfos, needs);
+			size = 0;
+		}
+		dentry = dentries_append(dentries, dp);
+		if (!ls_config.fetch_later && needs_stat(needs, dp->d_type) &&
+		    dentry_fetch(dirfd(dirp), dentry, needs) != 0) {
+			dentries->nerrs++;
+		}
+		/* targets read later aren't counted */
+		size += SPILL_ENTRY_COST + strlen(dentry->name) + 1;
+		if (dentry->link != NULL) {
+			size += strlen(dentry->link) + 1;
+		}
+	}
+
+	if (spill.nruns > 0) {
+		spill_write(dirfd(dirp), dentries, fileinfos, needs);
+	} else if (ls_config.fetch_later) {
+		dentries->nerrs += dentries_fetch(dirfd(dirp), dentries, needs);
+	}
+	(void)closedir(dirp);
+	STATS_LEAVE(prev);
+	return ret;
+}
+
+/*
+ * Merge the runs spill_read wrote and print the entries, a batch of rows at
+ * a time with the widths it measured. Each run is read through its share of
+ * the limit. parent_path is only used for records. Returns the number of
+ * entries merged, 0 if nothing was spilled.
+ */
+int
+spill_print(fileinfos_t *fileinfos, const char *parent_path)
+{
+	int i, fd, nheap, nmerged;
+	spill_run_t *run;
+	spill_run_t **heap;
+	uint64_t start;
+	stats_phase_t prev;
+
+	if (spill.nruns == 0) {
+		return 0;
+	}
+	start = TRACE_START();
+	if (fflush(spill.fp) == EOF) {
+		err(EXIT_FAILURE, "couldn't write spill file");
+	}
+	fd = fileno(spill.fp);
+	spill.buf_cap = ((size_t)ls_config.mem_limit << 20) / spill.nruns;
+	if (spill.buf_cap < SPILL_MIN_BUF) {
+		spill.buf_cap = SPILL_MIN_BUF;
+	}
+	if ((heap = malloc(spill.nruns * sizeof(spill_run_t *))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate spill runs");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+	for (nheap = 0, i = 0; i < spill.nruns; ++i) {
+		run = &spill.runs[i];
+		if ((run->buf = malloc(spill.buf_cap)) == NULL) {
+			err(EXIT_FAILURE, "failed to allocate spill buffer");
+		}
+		STATS_COUNT(COUNT_ALLOC, 1);
+		run->len = 0;
+		run->pos = 0;
+		if (spill_load(run, fd)) {
+			heap[nheap++] = run;
+		}
+	}
+	for (i = nheap / 2; i-- > 0;) {
+		spill_down(heap, nheap, i);
+	}
+
+	prev = STATS_ENTER(PHASE_FORMAT);
+	if (spill.nlisted > 0) {
+		print_fileinfos_total(fileinfos);
+	}
+	for (nmerged = 0; nheap > 0; ++nmerged) {
+		run = heap[0];
+		if (ls_config.names_only) {
+			(void)print_dentry(&run->dentry);
+		} else if (fileinfos_add_dentry(fileinfos, &run->dentry,
+		                                parent_path) &&
+		           fileinfos->size == SPILL_BATCH) {
+			print_fileinfos_rows(fileinfos);
+			fileinfos_clear(fileinfos);
+		}
+		run->pos += run->rec_len;
+		if (!spill_load(run, fd)) {
+			heap[0] = heap[--nheap];
+		}
+		if (nheap > 0) {
+			spill_down(heap, nheap, 0);
+		}
+	}
+	print_fileinfos_rows(fileinfos);
+	fileinfos_clear(fileinfos);
+	out_dir_end();
+	STATS_LEAVE(prev);
+
+	for (i = 0; i < spill.nruns; ++i) {
+		free(spill.runs[i].buf);
+	}
+	free(heap);
+	(void)fclose(spill.fp);
+	spill.fp = NULL;
+	spill.nruns = 0;
+	TRACE_SPAN("merge", start, parent_path, nmerged);
+	return nmerged;
+}
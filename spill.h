@@ -0,0 +1,12 @@
+#include <stdint.h>
+
+#include "dir.h"
+
+#ifndef _SPILL_H_
+#define _SPILL_H_
+
+struct fileinfos_t;
+int spill_read(int, dentries_t *, struct fileinfos_t *, uint8_t);
+int spill_print(struct fileinfos_t *, const char *);
+
+#endif /* _SPILL_H_ */
@@ -0,0 +1,264 @@
+#include "stats.h"
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Per-thread accumulators, so threads never contend to record anything.
+ * They stay on the stats_threads list after their thread exits and are
+ * summed by stats_report.
+ */
+typedef struct stats_thread_t {
+	stats_phase_t phase;
+	struct timespec wall; /* when phase was entered */
+	struct timespec cpu;
+	double wall_ms[NPHASES];
+	double cpu_ms[NPHASES];
+	unsigned long counters[NCOUNTERS];
+	struct stats_thread_t *next;
+} stats_thread_t;
+
+bool stats_enabled = false;
+pthread_key_t stats_key;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+stats_thread_t *stats_threads;
+struct timespec stats_start;
+unsigned long stats_dirs;
+long stats_largest_entries = -1;
+char *stats_largest_path;
+
+const char *phase_names[NPHASES] = { "other", "traverse", "stat",
+	                             "collect", "nss", "sort",
+	                             "format", "write" };
+const char *counter_names[NCOUNTERS] = { "stat", "readlink", "getpwuid",
+	                                 "getgrgid", "allocations",
+	                                 "bytes_written" };
+
+double ms_since(const struct timespec *, const struct timespec *);
+stats_thread_t *stats_thread(void);
+void stats_init(void);
+stats_phase_t stats_enter(stats_phase_t);
+void stats_count(stats_counter_t, unsigned long);
+void stats_dir(const char *, long);
+void json_string(FILE *, const char *);
+void stats_report(const char *);
+
+/*
+ * milliseconds from start to end
+ */
+double
+ms_since(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e3 +
+	       (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * The calling thread's accumulators, allocated on its first event.
+ */
+stats_thread_t *
+stats_thread(void)
+{
+	stats_thread_t *thread;
+
+	if ((thread = pthread_getspecific(stats_key)) != NULL) {
+		return thread;
+	}
+	if ((thread = calloc(1, sizeof(stats_thread_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate stats");
+	}
+	thread->phase = PHASE_OTHER;
+	(void)clock_gettime(CLOCK_MONOTONIC, &thread->wall);
+	(void)clock_gettime(CLOCK_THREAD_CPUTIME_ID, &thread->cpu);
+	if ((errno = pthread_setspecific(stats_key, thread)) != 0) {
+		err(EXIT_FAILURE, "pthread_setspecific");
+	}
+	pthread_mutex_lock(&stats_lock);
+	thread->next = stats_threads;
+	stats_threads = thread;
+	pthread_mutex_unlock(&stats_lock);
+	return thread;
+}
+
+/*
+ * Turn on collection. Has to happen before any other thread starts.
+ */
+void
+stats_init(void)
+{
+	if ((errno = pthread_key_create(&stats_key, NULL)) != 0) {
+		err(EXIT_FAILURE, "pthread_key_create");
+	}
+	(void)clock_gettime(CLOCK_MONOTONIC, &stats_start);
+	stats_enabled = true;
+	(void)stats_thread();
+}
+
+/*
+ * Charge the time since the last switch to the current phase and switch the
+ * calling thread to phase. Returns the phase to go back to.
+ */
+stats_phase_t
+stats_enter(stats_phase_t phase)
+{
+	stats_phase_t prev;
+	stats_thread_t *thread;
+	struct timespec wall, cpu;
+
+	thread = stats_thread();
+	(void)clock_gettime(CLOCK_MONOTONIC, &wall);
+	(void)clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	prev = thread->phase;
+	thread->wall_ms[prev] += ms_since(&thread->wall, &wall);
+	thread->cpu_ms[prev] += ms_since(&thread->cpu, &cpu);
+	thread->wall = wall;
+	thread->cpu = cpu;
+	thread->phase = phase;
+	return prev;
+}
+
+/*
+ * Add n to a counter of the calling thread.
+ */
+void
+stats_count(stats_counter_t counter, unsigned long n)
+{
+	stats_thread()->counters[counter] += n;
+}
+
+/*
+ * Count a listed directory and remember the largest one.
+ */
+void
+stats_dir(const char *path, long nentries)
+{
+	pthread_mutex_lock(&stats_lock);
+	stats_dirs++;
+	if (nentries > stats_largest_entries) {
+		stats_largest_entries = nentries;
+		free(stats_largest_path);
+		if ((stats_largest_path = strdup(path)) == NULL) {
+			err(EXIT_FAILURE, "failed to allocate stats");
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Write str as a JSON string literal.
+ */
+void
+json_string(FILE *fp, const char *str)
+{
+	(void)fputc('"', fp);
+	for (; *str != '\0'; ++str) {
+		if (*str == '"' || *str == '\\') {
+			(void)fprintf(fp, "\\%c", *str);
+		} else if ((unsigned char)*str < 0x20) {
+			(void)fprintf(fp, "\\u%04x", (unsigned char)*str);
+		} else {
+			(void)fputc(*str, fp);
+		}
+	}
+	(void)fputc('"', fp);
+}
+
+/*
+ * Sum every thread's accumulators and print them to stderr, or as JSON to
+ * file if it isn't NULL. Phase times are summed over threads, so with
+ * workers they can add up to more than the elapsed time.
+ */
+void
+stats_report(const char *file)
+{
+	int i;
+	int nthreads;
+	double elapsed;
+	double wall_ms[NPHASES], cpu_ms[NPHASES];
+	unsigned long counters[NCOUNTERS];
+	struct timespec now;
+	stats_thread_t *thread;
+	FILE *fp;
+
+	/* close the calling thread's current phase */
+	(void)stats_enter(PHASE_OTHER);
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = ms_since(&stats_start, &now);
+
+	(void)memset(wall_ms, 0, sizeof(wall_ms));
+	(void)memset(cpu_ms, 0, sizeof(cpu_ms));
+	(void)memset(counters, 0, sizeof(counters));
+	nthreads = 0;
+	pthread_mutex_lock(&stats_lock);
+	for (thread = stats_threads; thread != NULL; thread = thread->next) {
+		for (i = 0; i < NPHASES; ++i) {
+			wall_ms[i] += thread->wall_ms[i];
+			cpu_ms[i] += thread->cpu_ms[i];
+		}
+		for (i = 0; i < NCOUNTERS; ++i) {
+			counters[i] += thread->counters[i];
+		}
+		nthreads++;
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	if (file == NULL) {
+		(void)fprintf(stderr, "%-14s %10s %10s\n", "phase", "wall_ms",
+		              "cpu_ms");
+		for (i = 0; i < NPHASES; ++i) {
+			(void)fprintf(stderr, "%-14s %10.3f %10.3f\n",
+			              phase_names[i], wall_ms[i], cpu_ms[i]);
+		}
+		for (i = 0; i < NCOUNTERS; ++i) {
+			(void)fprintf(stderr, "%-14s %lu\n", counter_names[i],
+			              counters[i]);
+		}
+		(void)fprintf(stderr, "%-14s %lu\n", "directories", stats_dirs);
+		if (stats_largest_path != NULL) {
+			(void)fprintf(stderr, "%-14s %s (%ld entries)\n",
+			              "largest", stats_largest_path,
+			              stats_largest_entries);
+		}
+		(void)fprintf(stderr, "%-14s %d\n", "threads", nthreads);
+		(void)fprintf(stderr, "%-14s %.3f ms\n", "elapsed", elapsed);
+		return;
+	}
+
+	if ((fp = fopen(file, "w")) == NULL) {
+		err(EXIT_FAILURE, "%s", file);
+	}
+	(void)fprintf(fp, "{\n  \"elapsed_ms\": %.3f,\n  \"threads\": %d,\n",
+	              elapsed, nthreads);
+	(void)fprintf(fp, "  \"phases\": {\n");
+	for (i = 0; i < NPHASES; ++i) {
+		(void)fprintf(fp,
+		              "    \"%s\": { \"wall_ms\": %.3f, "
+		              "\"cpu_ms\": %.3f }%s\n",
+		              phase_names[i], wall_ms[i], cpu_ms[i],
+		              i + 1 < NPHASES ? "," : "");
+	}
+	(void)fprintf(fp, "  },\n  \"counters\": {\n");
+	for (i = 0; i < NCOUNTERS; ++i) {
+		(void)fprintf(fp, "    \"%s\": %lu%s\n", counter_names[i],
+		              counters[i], i + 1 < NCOUNTERS ? "," : "");
+	}
+	(void)fprintf(fp, "  },\n  \"directories\": %lu,\n", stats_dirs);
+	(void)fprintf(fp, "  \"largest_directory\": ");
+	if (stats_largest_path == NULL) {
+		(void)fprintf(fp, "null\n");
+	} else {
+		(void)fprintf(fp, "{ \"path\": ");
+		json_string(fp, stats_largest_path);
+		(void)fprintf(fp, ", \"entries\": %ld }\n",
+		              stats_largest_entries);
+	}
+	(void)fprintf(fp, "}\n");
+	if (fclose(fp) == EOF) {
+		err(EXIT_FAILURE, "%s", file);
+	}
+}
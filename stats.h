@@ -0,0 +1,63 @@
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/*
+ * What a thread is doing. Time is charged to the phase a thread is in, so the
+ * phases of one thread add up to its whole run.
+ */
+typedef enum stats_phase_t {
+	PHASE_OTHER,
+	PHASE_TRAVERSE, /* fts_read, fts_children, readdir, getdents */
+	PHASE_STAT,     /* stat and readlink of entries ls does itself */
+	PHASE_COLLECT,  /* building fileinfos */
+	PHASE_NSS,      /* uid and gid name lookups that missed the cache */
+	PHASE_SORT,
+	PHASE_FORMAT, /* rendering entries into the output buffer */
+	PHASE_WRITE,  /* write(2) of the output buffer */
+	NPHASES
+} stats_phase_t;
+
+typedef enum stats_counter_t {
+	COUNT_STAT,
+	COUNT_READLINK,
+	COUNT_GETPWUID,
+	COUNT_GETGRGID,
+	COUNT_ALLOC, /* heap allocations made by ls itself */
+	COUNT_BYTES_WRITTEN,
+	NCOUNTERS
+} stats_counter_t;
+
+extern bool stats_enabled;
+
+/* with --stats off each of these is a single test of stats_enabled */
+#define STATS_ENTER(phase) (stats_enabled ? stats_enter(phase) : PHASE_OTHER)
+#define STATS_LEAVE(prev)                                                      \
+	do {                                                                   \
+		if (stats_enabled) {                                           \
+			(void)stats_enter(prev);                               \
+		}                                                              \
+	} while (/* CONSTCOND */ 0)
+#define STATS_COUNT(counter, n)                                                \
+	do {                                                                   \
+		if (stats_enabled) {                                           \
+			stats_count(counter, n);                               \
+		}                                                              \
+	} while (/* CONSTCOND */ 0)
+#define STATS_DIR(path, nentries)                                              \
+	do {                                                                   \
+		if (stats_enabled) {                                           \
+			stats_dir(path, nentries);                             \
+		}                                                              \
+	} while (/* CONSTCOND */ 0)
+
+void stats_init(void);
+stats_phase_t stats_enter(stats_phase_t);
+void stats_count(stats_counter_t, unsigned long);
+void stats_dir(const char *, long);
+void stats_report(const char *);
+void json_string(FILE *, const char *);
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,144 @@
+#include "stream.h"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dir.h"
+#include "filter.h"
+#include "ls.h"
+#include "output.h"
+#include "trace.h"
+
+extern config_t ls_config;
+
+/* large enough that a huge directory takes few syscalls, small enough that
+ * memory doesn't grow with the directory */
+#define GETDENTS_BUFSIZE (256 * 1024)
+
+bool is_hidden_entry(const char *);
+int stream_dir(const FTSENT *);
+
+/*
+ * Same dotfile filtering fts_children and fileinfos_from_ftsents apply
+ * between them.
+ */
+bool
+is_hidden_entry(const char *name)
+{
+	switch (ls_config.dots) {
+	case NO_DOTS:
+		return name[0] == '.';
+	case DOTFILES:
+		return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+	case ALL_DOTS:
+		return false;
+	}
+	return false;
+}
+
+/*
+ * Print the entries of an unsorted directory listing as getdents(2) returns
+ * them instead of building the whole directory with fts_children first.
+ * Entries are only stat-ed when d_type doesn't cover ls_config.stat_needs,
+ * and not at all when their name or d_type is already filtered out.
+ * --head stops reading once it has listed enough.
+ */
+int
+stream_dir(const FTSENT *dir)
+{
+	int fd;
+	int nread, off;
+	long nentries, limit;
+	bool show_filetype_sym;
+	char *buf;
+	struct dirent *dp;
+	struct stat st, *statp;
+	mode_t mode;
+	uint64_t start;
+	stats_phase_t prev;
+
+	start = TRACE_START();
+	if ((fd = open(dir->fts_accpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) <
+	    0) {
+		/* fts_read reports it as FTS_DNR if it still descends here */
+		if (dir->fts_level < ls_config.max_depth) {
+			return EXIT_SUCCESS;
+		}
+		if (dir->fts_level > 0) {
+			warn("%s", dir->fts_name);
+		}
+		return EXIT_FAILURE;
+	}
+
+	if ((buf = malloc(GETDENTS_BUFSIZE)) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate getdents buffer");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+
+	show_filetype_sym = GET(ls_config.opts, SHOW_FILETYPE_SYM);
+
+	limit = ls_config.head > 0 ? ls_config.head : LONG_MAX;
+	nentries = 0;
+	prev = STATS_ENTER(PHASE_TRAVERSE);
+	while (nentries < limit &&
+	       (nread = getdents(fd, buf, GETDENTS_BUFSIZE)) > 0) {
+		(void)STATS_ENTER(PHASE_FORMAT);
+		for (off = 0; off < nread && nentries < limit;
+		     off += dp->d_reclen) {
+			dp = (struct dirent *)(buf + off);
+			if (is_hidden_entry(dp->d_name) ||
+			    (ls_config.filter &&
+			     !filter_name(dp->d_name, DTTOIF(dp->d_type)))) {
+				continue;
+			}
+			mode = DTTOIF(dp->d_type);
+			statp = NULL;
+			if (needs_stat(ls_config.stat_needs, dp->d_type)) {
+				(void)STATS_ENTER(PHASE_STAT);
+				STATS_COUNT(COUNT_STAT, 1);
+				if (fstatat(fd, dp->d_name, &st,
+				            AT_SYMLINK_NOFOLLOW) < 0) {
+					warn("%s", dp->d_name);
+					(void)STATS_ENTER(PHASE_FORMAT);
+					continue;
+				}
+				(void)STATS_ENTER(PHASE_FORMAT);
+				mode = st.st_mode;
+				statp = &st;
+			}
+			if (ls_config.filter &&
+			    !filter_match(dp->d_name, mode, statp)) {
+				continue;
+			}
+			nentries++;
+			print_name(dp->d_name);
+			if (show_filetype_sym) {
+				print_filetype_char(mode);
+			}
+			out_newline();
+		}
+		out_dir_end();
+		(void)STATS_ENTER(PHASE_TRAVERSE);
+	}
+	STATS_LEAVE(prev);
+	STATS_DIR(dir->fts_path, nentries);
+	TRACE_SPAN("stream", start, dir->fts_path, nentries);
+	if (nread < 0) {
+		warn("%s", dir->fts_name);
+	}
+
+	free(buf);
+	(void)close(fd);
+
+	return nread < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,10 @@
+#include <sys/types.h>
+
+#include <fts.h>
+
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+int stream_dir(const FTSENT *);
+
+#endif /* _STREAM_H_ */
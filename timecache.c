@@ -0,0 +1,98 @@
+#include "timecache.h"
+
+#include <err.h>
+#include <stdlib.h>
+
+#define DATE_FORMAT "%b %e "
+#define TIME_FORMAT "%H:%M"
+#define YEAR_FORMAT "%Y"
+
+/* 7 for month and day and spaces + 5 for date/time + 1 for nul */
+#define TIME_STR_LEN 13
+#define TIMECACHE_SIZE 64
+#define SECONDS_PER_MINUTE 60
+#define SECONDS_PER_DAY 86400
+
+/*
+ * A formatted time column and the range of tv_sec that formats to the same
+ * string. The range is empty (lo == hi) until the slot is first filled.
+ */
+typedef struct timecache_entry_t {
+	time_t lo;
+	time_t hi; /* exclusive */
+	size_t len;
+	char str[TIME_STR_LEN];
+} timecache_entry_t;
+
+/*
+ * Direct mapped: recent times ("Oct 17 04:05") are slotted by minute and
+ * older ones ("Mar  3  2024") by day. Only used from the printing thread, so
+ * there is no locking.
+ */
+timecache_entry_t recent_cache[TIMECACHE_SIZE];
+timecache_entry_t old_cache[TIMECACHE_SIZE];
+
+void timecache_fill(timecache_entry_t *, time_t, bool);
+const char *file_time_str(time_t, bool, size_t *);
+
+/*
+ * Format t into entry with localtime_r and strftime and record which other
+ * times share the string: the rest of its local minute, or of its local day
+ * for old times as long as the UTC offset doesn't change during that day.
+ */
+void
+timecache_fill(timecache_entry_t *entry, time_t t, bool old)
+{
+	time_t day_lo, day_last;
+	struct tm tm, edge;
+
+	if (localtime_r(&t, &tm) == NULL) {
+		err(EXIT_FAILURE, "failed to acquire localtime");
+	}
+	entry->len = strftime(entry->str, sizeof(entry->str),
+	                      old ? DATE_FORMAT " " YEAR_FORMAT
+	                          : DATE_FORMAT TIME_FORMAT,
+	                      &tm);
+	if (entry->len == 0) {
+		errx(EXIT_FAILURE, "strftime exceeded buffer");
+	}
+
+	entry->lo = t - tm.tm_sec;
+	entry->hi = entry->lo + SECONDS_PER_MINUTE;
+	if (!old) {
+		return;
+	}
+	day_lo = entry->lo - tm.tm_hour * 3600 - tm.tm_min * 60;
+	day_last = day_lo + SECONDS_PER_DAY - 1;
+	if (localtime_r(&day_lo, &edge) != NULL &&
+	    edge.tm_gmtoff == tm.tm_gmtoff &&
+	    localtime_r(&day_last, &edge) != NULL &&
+	    edge.tm_gmtoff == tm.tm_gmtoff) {
+		entry->lo = day_lo;
+		entry->hi = day_last + 1;
+	}
+}
+
+/*
+ * The -l time column for t, without the trailing space. old selects the
+ * format with the year instead of the time of day. Returns a string owned by
+ * the cache and valid until the next call, its length is put in lenp.
+ */
+const char *
+file_time_str(time_t t, bool old, size_t *lenp)
+{
+	timecache_entry_t *entry;
+
+	if (old) {
+		entry = &old_cache[(unsigned long)(t / SECONDS_PER_DAY) %
+		                   TIMECACHE_SIZE];
+	} else {
+		entry = &recent_cache[(unsigned long)(t / SECONDS_PER_MINUTE) %
+		                      TIMECACHE_SIZE];
+	}
+	if (t < entry->lo || t >= entry->hi) {
+		timecache_fill(entry, t, old);
+	}
+	*lenp = entry->len;
+	return entry->str;
+}
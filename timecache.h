@@ -0,0 +1,11 @@
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <time.h>
+
+#ifndef _TIMECACHE_H_
+#define _TIMECACHE_H_
+
+const char *file_time_str(time_t, bool, size_t *);
+
+#endif /* _TIMECACHE_H_ */
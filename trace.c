@@ -0,0 +1,213 @@
+#include "trace.h"
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/*
+ * One finished span. name points to a string literal, path is a copy since
+ * the directory it names is usually freed long before the trace is written.
+ */
+typedef struct trace_event_t {
+	const char *name;
+	uint64_t start; /* ns since trace_init */
+	uint64_t dur;
+	long n; /* entries or bytes the span handled, -1 if none */
+	char path[TRACE_PATH_LEN];
+} trace_event_t;
+
+/*
+ * Per-thread ring of spans. Only its own thread writes to it and it is only
+ * read once every other thread has been joined, so recording takes no lock.
+ */
+typedef struct trace_thread_t {
+	int tid;
+	const char *name;
+	uint64_t nevents; /* ever recorded, the next slot is nevents % size */
+	trace_event_t *ring;
+	struct trace_thread_t *next;
+} trace_thread_t;
+
+bool trace_enabled = false;
+pthread_key_t trace_key;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+trace_thread_t *trace_threads;
+int trace_nthreads;
+struct timespec trace_start;
+
+trace_thread_t *trace_self(void);
+void trace_init(void);
+uint64_t trace_now(void);
+void trace_thread(const char *);
+void trace_span(const char *, uint64_t, const char *, long);
+void trace_write(const char *);
+
+/*
+ * The calling thread's ring, allocated on its first span. Thread ids are
+ * handed out in that order, the main thread is 1.
+ */
+trace_thread_t *
+trace_self(void)
+{
+	trace_thread_t *thread;
+
+	if ((thread = pthread_getspecific(trace_key)) != NULL) {
+		return thread;
+	}
+	if ((thread = calloc(1, sizeof(trace_thread_t))) == NULL ||
+	    (thread->ring = malloc(TRACE_RING_SIZE * sizeof(trace_event_t))) ==
+	        NULL) {
+		err(EXIT_FAILURE, "failed to allocate trace buffer");
+	}
+	thread->name = "worker";
+	if ((errno = pthread_setspecific(trace_key, thread)) != 0) {
+		err(EXIT_FAILURE, "pthread_setspecific");
+	}
+	pthread_mutex_lock(&trace_lock);
+	thread->tid = ++trace_nthreads;
+	thread->next = trace_threads;
+	trace_threads = thread;
+	pthread_mutex_unlock(&trace_lock);
+	return thread;
+}
+
+/*
+ * Turn on tracing. Has to happen before any other thread starts.
+ */
+void
+trace_init(void)
+{
+	if ((errno = pthread_key_create(&trace_key, NULL)) != 0) {
+		err(EXIT_FAILURE, "pthread_key_create");
+	}
+	(void)clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	trace_enabled = true;
+	trace_thread("main");
+}
+
+/*
+ * nanoseconds since trace_init
+ */
+uint64_t
+trace_now(void)
+{
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - trace_start.tv_sec) * 1000000000 +
+	       now.tv_nsec - trace_start.tv_nsec;
+}
+
+/*
+ * Name the calling thread in the trace.
+ */
+void
+trace_thread(const char *name)
+{
+	trace_self()->name = name;
+}
+
+/*
+ * Record a span from start until now. path and n are shown as its arguments
+ * when they aren't NULL and -1.
+ */
+void
+trace_span(const char *name, uint64_t start, const char *path, long n)
+{
+	size_t len;
+	trace_thread_t *thread;
+	trace_event_t *event;
+
+	thread = trace_self();
+	event = &thread->ring[thread->nevents++ % TRACE_RING_SIZE];
+	event->name = name;
+	event->start = start;
+	event->dur = trace_now() - start;
+	event->n = n;
+	len = 0;
+	if (path != NULL) {
+		/* keep the end, it tells directories apart */
+		len = strlen(path);
+		if (len >= TRACE_PATH_LEN) {
+			path += len - (TRACE_PATH_LEN - 1);
+			len = TRACE_PATH_LEN - 1;
+			/* don't start in the middle of a UTF-8 sequence */
+			while ((*path & 0xc0) == 0x80) {
+				path++;
+				len--;
+			}
+		}
+		(void)memcpy(event->path, path, len);
+	}
+	event->path[len] = '\0';
+}
+
+/*
+ * Write every thread's spans to file in the Chrome trace event format, which
+ * chrome://tracing and Perfetto load. Every other thread must have been
+ * joined.
+ */
+void
+trace_write(const char *file)
+{
+	uint64_t i, first;
+	bool comma;
+	pid_t pid;
+	trace_thread_t *thread;
+	trace_event_t *event;
+	FILE *fp;
+
+	if ((fp = fopen(file, "w")) == NULL) {
+		err(EXIT_FAILURE, "%s", file);
+	}
+	pid = getpid();
+	comma = false;
+	(void)fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (thread = trace_threads; thread != NULL; thread = thread->next) {
+		(void)fprintf(fp,
+		              "%s{\"ph\":\"M\",\"name\":\"thread_name\","
+		              "\"pid\":%ld,\"tid\":%d,\"args\":{\"name\":",
+		              comma ? ",\n" : "", (long)pid, thread->tid);
+		json_string(fp, thread->name);
+		(void)fprintf(fp, "}}");
+		comma = true;
+
+		first = thread->nevents > TRACE_RING_SIZE
+		            ? thread->nevents - TRACE_RING_SIZE
+		            : 0;
+		for (i = first; i < thread->nevents; ++i) {
+			event = &thread->ring[i % TRACE_RING_SIZE];
+			(void)fprintf(fp,
+			              ",\n{\"ph\":\"X\",\"name\":\"%s\","
+			              "\"pid\":%ld,\"tid\":%d,\"ts\":%.3f,"
+			              "\"dur\":%.3f,\"args\":{",
+			              event->name, (long)pid, thread->tid,
+			              event->start / 1e3, event->dur / 1e3);
+			if (event->path[0] != '\0') {
+				(void)fprintf(fp, "\"path\":");
+				json_string(fp, event->path);
+			}
+			if (event->n >= 0) {
+				(void)fprintf(fp, "%s\"n\":%ld",
+				              event->path[0] != '\0' ? "," : "",
+				              event->n);
+			}
+			(void)fprintf(fp, "}}");
+		}
+		if (first > 0) {
+			warnx("trace: thread %d dropped its %llu oldest spans",
+			      thread->tid, (unsigned long long)first);
+		}
+	}
+	(void)fprintf(fp, "\n]}\n");
+	if (fclose(fp) == EOF) {
+		err(EXIT_FAILURE, "%s", file);
+	}
+}
@@ -0,0 +1,35 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/* spans each thread keeps, the oldest are overwritten past this */
+#define TRACE_RING_SIZE 16384
+/* longest path kept with a span, longer ones keep their last part */
+#define TRACE_PATH_LEN 56
+
+extern bool trace_enabled;
+
+/* with --trace off each of these is a single test of trace_enabled */
+#define TRACE_START() (trace_enabled ? trace_now() : 0)
+#define TRACE_SPAN(name, start, path, n)                                       \
+	do {                                                                   \
+		if (trace_enabled) {                                           \
+			trace_span(name, start, path, n);                      \
+		}                                                              \
+	} while (0)
+#define TRACE_THREAD(name)                                                     \
+	do {                                                                   \
+		if (trace_enabled) {                                           \
+			trace_thread(name);                                    \
+		}                                                              \
+	} while (0)
+
+void trace_init(void);
+uint64_t trace_now(void);
+void trace_thread(const char *);
+void trace_span(const char *, uint64_t, const char *, long);
+void trace_write(const char *);
+
+#endif /* _TRACE_H_ */
@@ -1,52 +1,60 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <grp.h>
 #include <limits.h>
-#include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "config.h"
+#include "du.h"
+#include "escape.h"
+#include "filter.h"
+#include "format.h"
+#include "head.h"
+#include "idcache.h"
 #include "ls.h"
+#include "output.h"
+#include "record.h"
+#include "timecache.h"
+#include "trace.h"
 
 extern config_t ls_config;
 
-size_t count_digits(size_t);
 int max(int, int);
-void print_raw_or_not(const char *);
-void print_filetype_char(fileinfo_t);
-char *human_readable_size_from(size_t, int);
+void print_filetype_char(mode_t);
 bool is_older_than_6months(const struct timespec);
-void print_file_time(fileinfo_t);
-void print_symlink_dest(fileinfo_t);
+void print_file_time(const struct timespec);
+ssize_t read_symlink(int, const char *, char *);
+void print_dir_header(const char *);
+void print_fileinfos_total(const fileinfos_t *);
+void select_rows_printer(void);
+void print_fileinfos_rows(const fileinfos_t *);
 void print_fileinfos(fileinfos_t *);
-fileinfos_t *fileinfos_from_ftsents(FTSENT *, bool, bool, bool);
+fileinfos_t *fileinfos_new(void);
+void fileinfos_clear(fileinfos_t *);
+void fileinfos_reset(fileinfos_t *);
+void *grow_column(void *, int, size_t);
+void fileinfos_grow(fileinfos_t *);
+size_t arena_reserve(fileinfos_t *, size_t);
+size_t arena_strcpy(fileinfos_t *, const char *);
+void fileinfos_add(fileinfos_t *, const char *, const struct stat *,
+                   const char *);
+void fileinfos_count(fileinfos_t *, blkcnt_t, off_t);
+const char *ftsent_parent(const FTSENT *);
+void fileinfos_from_ftsents(fileinfos_t *, FTSENT *, int, bool, bool, bool);
+const char *dentry_link(const dentry_t *);
+void dentry_record(const dentry_t *, const char *);
+bool fileinfos_add_dentry(fileinfos_t *, const dentry_t *, const char *);
+void fileinfos_from_dentries(fileinfos_t *, dentries_t *, const char *);
+bool print_dentry(const dentry_t *);
+void print_dentries(dentries_t *);
 void fileinfos_free(fileinfos_t *);
 
-/*
- * get the number of digits in a number
- */
-size_t
-count_digits(size_t n)
-{
-	size_t count;
-
-	if (n == 0) {
-		return 1;
-	}
-	for (count = 0; n > 0; count++, n /= 10) {
-		continue;
-	}
-	return count;
-}
-
 /*
  * max of two numbers
  */
@@ -60,156 +68,251 @@ max(int a, int b)
 	}
 }
 
+#define F_EXECUTABLE '*'
+#define F_DIRECTORY '/'
+#define F_SYMLINK '@'
+#define F_PIPE '|'
+#define S_ISEXEC (S_IXUSR | S_IXGRP | S_IXOTH)
+
 /*
- * Prints string based on raw printing config.
+ * Print filetype char for file based on its mode.
  */
 void
-print_raw_or_not(const char *str)
+print_filetype_char(mode_t mode)
 {
-	char c;
-	int i;
-	for (i = 0; i < (int)strlen(str); ++i) {
-		c = str[i];
-		if (isprint(c)) {
-			(void)putchar(c);
-		} else if (GET(ls_config.opts, RAW_PRINT)) {
-			(void)putchar(c);
-		} else {
-			(void)putchar('?');
-		}
+	if (S_ISLNK(mode)) {
+		out_char(F_SYMLINK);
+	} else if (S_ISFIFO(mode)) {
+		out_char(F_PIPE);
+	} else if (S_ISDIR(mode)) {
+		out_char(F_DIRECTORY);
+	} else if (GET(mode, S_ISEXEC)) {
+		out_char(F_EXECUTABLE);
 	}
 }
 
-#define F_EXECUTABLE '*'
-#define F_DIRECTORY '/'
-#define F_SYMLINK '@'
-#define F_PIPE '|'
-#define S_ISEXEC (S_IXUSR | S_IXGRP | S_IXOTH)
+#define SECONDS_PER_DAY 86400
 
 /*
- * Print filetype char for file based on the mode parsed by strmode.
+ * Compares the time the run started to time tim.
+ * returns true if the time is more than 6 months away.
  */
-void
-print_filetype_char(fileinfo_t fileinfo)
+bool
+is_older_than_6months(const struct timespec tim)
 {
-	switch (fileinfo.mode[0]) {
-	case 'l':
-		(void)putchar(F_SYMLINK);
-		break;
-	case 'p':
-		(void)putchar(F_PIPE);
-		break;
-	case 'd':
-		(void)putchar(F_DIRECTORY);
-		break;
-	default:
-		if (GET(fileinfo.statp->st_mode, S_ISEXEC)) {
-			(void)putchar(F_EXECUTABLE);
-		}
+	time_t diff;
+
+	diff = tim.tv_sec - ls_config.now;
+	if (diff < 0) {
+		diff = -diff;
 	}
+
+	return diff >= 365 * SECONDS_PER_DAY / 2;
 }
 
 /*
- * front end for humanize_number with the same options
- * AUTOSCALE, NOSPACE, and B are forced.
- * returns heap-allocated string of length 5 (including nul).
+ * Prints the time column for tim based on config. Files from the same minute
+ * (or day, for old ones) reuse the formatted string.
  */
-char *
-human_readable_size_from(size_t size, int options)
+void
+print_file_time(const struct timespec tim)
 {
-	int flags;
 	size_t len;
-	char *buf;
+	const char *str;
 
-	len = 5;
-	if ((buf = calloc(1, len)) == NULL) {
-		err(EXIT_FAILURE,
-		    "failed to allocate string for human readable format");
-	}
+	str = file_time_str(tim.tv_sec, is_older_than_6months(tim), &len);
+	out_mem(str, len);
+	out_char(' ');
+}
+
+/*
+ * Reads the destination of symlink name, relative to the directory open on
+ * dirfd, into link_dest, which must hold PATH_MAX + 1 bytes, and returns its
+ * length. Warns and returns an empty string if it can't be read.
+ */
+ssize_t
+read_symlink(int dirfd, const char *name, char *link_dest)
+{
+	ssize_t len;
 
-	flags = HN_NOSPACE | HN_B | options;
-	if (humanize_number(buf, len, size, NULL, HN_AUTOSCALE, flags) < 0) {
-		err(EXIT_FAILURE, "failed to humanize %ld", size);
+	STATS_COUNT(COUNT_READLINK, 1);
+	if ((len = readlinkat(dirfd, name, link_dest, PATH_MAX)) == -1) {
+		warn("%s", name);
+		len = 0;
 	}
-	return buf;
+	link_dest[len] = '\0';
+	return len;
 }
 
-#define SECONDS_PER_DAY 86400
-
 /*
- * Compares current time to time tm which is also in local time.
- * returns true if the time is more than 6 months away.
+ * Prints the "path:" line that precedes a directory's listing.
  */
-bool
-is_older_than_6months(const struct timespec tim)
+void
+print_dir_header(const char *path)
 {
-	time_t diff;
-	struct timespec current_tim;
+	int ignore_trailing_slash_len;
 
-	if (clock_gettime(CLOCK_REALTIME, &current_tim) < 0) {
-		err(EXIT_FAILURE, "couldn't get current time");
+	/* don't print trailing '/' like ls, unless path is just '/' */
+	ignore_trailing_slash_len = (int)strlen(path) - 1;
+	if (path[ignore_trailing_slash_len] != '/' ||
+	    ignore_trailing_slash_len == 0) {
+		ignore_trailing_slash_len++;
 	}
+	out_mem(path, ignore_trailing_slash_len);
+	out_char(':');
+	out_newline();
+}
 
-	diff = tim.tv_sec - current_tim.tv_sec;
-	if (diff < 0) {
-		diff = -diff;
+/*
+ * Prints the "total" line of -l, and of -s on a terminal
+ */
+void
+print_fileinfos_total(const fileinfos_t *fileinfos)
+{
+	if (!GET(ls_config.opts, LONG_FORMAT) &&
+	    !(GET(ls_config.opts, SHOW_BLKCOUNT) && ls_config.istty)) {
+		return;
+	}
+	out_str("total ");
+	if (ls_config.blkcount_fmt == HUMAN_READABLE) {
+		out_human(fileinfos->total_size, false, 0);
+	} else {
+		out_ulong((fileinfos->total_blocks * 512 +
+		           ls_config.blocksize - 1) /
+		              ls_config.blocksize,
+		          0);
 	}
+	out_newline();
+}
 
-	return diff >= 365 * SECONDS_PER_DAY / 2;
+/*
+ * Defines print_fileinfos_rows for one combination of -i (I), -s (S), -l or
+ * -n (L), -h (H) and -F (F), each 0 or 1. They are constants in the copy, so
+ * its loop is compiled down to the columns it prints.
+ */
+#define DEFINE_ROWS_PRINTER(I, S, L, H, F)                                     \
+void                                                                           \
+print_rows_##I##S##L##H##F(const fileinfos_t *fileinfos)                       \
+{                                                                              \
+	int i;                                                                 \
+	mode_t mode;                                                           \
+	char modestr[12];                                                      \
+                                                                               \
+	for (i = 0; i < fileinfos->size; ++i) {                                \
+		mode = fileinfos->mode[i];                                     \
+		if (I) {                                                       \
+			out_ulong(fileinfos->inode[i],                         \
+			          fileinfos->max_inode_len);                   \
+			out_char(' ');                                         \
+		}                                                              \
+		if (S && H && !L) {                                            \
+			out_human(fileinfos->file_size[i], true,               \
+			          fileinfos->max_file_size_len);               \
+			out_char(' ');                                         \
+		} else if (S && H) {                                           \
+			out_human(fileinfos->blocks[i] * 512, true,            \
+			          fileinfos->max_blockcount_len);              \
+			out_char(' ');                                         \
+		} else if (S) {                                                \
+			out_ulong((fileinfos->blocks[i] * 512 +                \
+			           ls_config.blocksize - 1) /                  \
+			              ls_config.blocksize,                     \
+			          fileinfos->max_blockcount_len);              \
+			out_char(' ');                                         \
+		}                                                              \
+		if (L) {                                                       \
+			strmode(mode, modestr);                                \
+			out_str(modestr);                                      \
+			out_char(' ');                                         \
+			out_ulong(fileinfos->nlink[i],                         \
+			          fileinfos->max_nlink_len);                   \
+			out_char(' ');                                         \
+			out_str_left(fileinfos->owner_name_or_id[i],           \
+			             fileinfos->max_owner_name_or_id_len);     \
+			out_spaces(2);                                         \
+			out_str_left(fileinfos->group_name_or_id[i],           \
+			             fileinfos->max_group_name_or_id_len);     \
+			out_spaces(2);                                         \
+			if (S_ISCHR(mode) || S_ISBLK(mode)) {                  \
+				out_spaces(                                    \
+				    fileinfos->max_size_or_rdev_nums_len -     \
+				    fileinfos->max_rdev_nums_len);             \
+				out_ulong(major(fileinfos->rdev[i]),           \
+				          fileinfos->max_major_len);           \
+				out_str(", ");                                 \
+				out_ulong(minor(fileinfos->rdev[i]),           \
+				          fileinfos->max_minor_len);           \
+			} else if (H) {                                        \
+				out_human(                                     \
+				    fileinfos->file_size[i], true,             \
+				    fileinfos->max_size_or_rdev_nums_len);     \
+			} else {                                               \
+				out_ulong(                                     \
+				    fileinfos->file_size[i],                   \
+				    fileinfos->max_size_or_rdev_nums_len);     \
+			}                                                      \
+			out_char(' ');                                         \
+			print_file_time(fileinfos->time[i]);                   \
+		}                                                              \
+		print_name(FILEINFOS_STR(fileinfos, name_off, i));             \
+		if (F) {                                                       \
+			print_filetype_char(mode);                             \
+		}                                                              \
+		if (L && fileinfos->link_off[i] != NO_LINK) {                  \
+			out_str(" -> ");                                       \
+			out_str(FILEINFOS_STR(fileinfos, link_off, i));        \
+		}                                                              \
+		out_newline();                                                 \
+	}                                                                      \
 }
 
-#define DATE_FORMAT "%b %e "
-#define TIME_FORMAT "%H:%M"
-#define YEAR_FORMAT "%Y"
+/* every combination, the flags as the bits of the index with I the highest */
+#define ROWS_F(m, I, S, L, H) m(I, S, L, H, 0) m(I, S, L, H, 1)
+#define ROWS_H(m, I, S, L) ROWS_F(m, I, S, L, 0) ROWS_F(m, I, S, L, 1)
+#define ROWS_L(m, I, S) ROWS_H(m, I, S, 0) ROWS_H(m, I, S, 1)
+#define ROWS_S(m, I) ROWS_L(m, I, 0) ROWS_L(m, I, 1)
+#define ROWS_ALL(m) ROWS_S(m, 0) ROWS_S(m, 1)
+#define ROWS_ENTRY(I, S, L, H, F) print_rows_##I##S##L##H##F,
+
+ROWS_ALL(DEFINE_ROWS_PRINTER)
+
+void (*const rows_printers[])(const fileinfos_t *) = { ROWS_ALL(ROWS_ENTRY) };
+
+/* the ones for ls_config, see select_rows_printer */
+void (*rows_printer)(const fileinfos_t *);
+void (*print_name)(const char *);
 
 /*
- * Returns heap-allocated string with correct time based on config
- * using strftime.
+ * Picks the row printer for the columns ls_config asks for, and the name
+ * printer for raw output, -q or -b, once the arguments are parsed
  */
 void
-print_file_time(fileinfo_t fileinfo)
+select_rows_printer(void)
 {
-	int total_len;
-	size_t size;
-	char *buf;
-
-	/* 7 for month and day and spaces + 5 for date/time + 1 for nul */
-	total_len = 13;
-	buf = calloc(1, total_len);
-	if (buf == NULL) {
-		err(EXIT_FAILURE, "failed to allocate buffer for strftime");
-	}
-	if (fileinfo.older_than_6months) {
-		size = strftime(buf, total_len, DATE_FORMAT " " YEAR_FORMAT,
-		                &fileinfo.time);
+	int idx;
+
+	idx = GET(ls_config.opts, SHOW_INODES) << 4 |
+	      GET(ls_config.opts, SHOW_BLKCOUNT) << 3 |
+	      GET(ls_config.opts, LONG_FORMAT) << 2 |
+	      (ls_config.blkcount_fmt == HUMAN_READABLE) << 1 |
+	      GET(ls_config.opts, SHOW_FILETYPE_SYM);
+	rows_printer = rows_printers[idx];
+	if (GET(ls_config.opts, RAW_PRINT)) {
+		print_name = out_str;
+	} else if (ls_config.escape) {
+		print_name = escape_print_b;
 	} else {
-		size = strftime(buf, total_len, DATE_FORMAT TIME_FORMAT,
-		                &fileinfo.time);
-	}
-	if (size == 0) {
-		errx(EXIT_FAILURE, "strftime exceeded buffer");
+		print_name = escape_print_q;
 	}
-	(void)printf("%s ", buf);
 }
 
 /*
- * Prints symlink destination assuming the destination is shorter than PATH_MAX
+ * Prints the entries of fileinfos, padded to its column widths
  */
 void
-print_symlink_dest(fileinfo_t fileinfo)
+print_fileinfos_rows(const fileinfos_t *fileinfos)
 {
-	ssize_t len;
-	char *link_path;
-	char link_dest[PATH_MAX + 1];
-
-	ASPRINTF("couldn't alloc string for symlink path", &link_path, "%s/%s",
-	         fileinfo.parent_accpath, fileinfo.name);
-	if ((len = readlink(link_path, link_dest, PATH_MAX)) == -1) {
-		warn("%s", link_path);
-	}
-	free(link_path);
-	link_dest[len] = '\0';
-	(void)printf(" -> %s", link_dest);
+	rows_printer(fileinfos);
 }
 
 /*
@@ -219,109 +322,315 @@ print_symlink_dest(fileinfo_t fileinfo)
 void
 print_fileinfos(fileinfos_t *fileinfos)
 {
-	bool long_format, show_inodes, show_blkcount, show_filetype_sym,
-	    human_readable;
-	int i;
-	fileinfo_t fileinfo;
-
-	long_format = GET(ls_config.opts, LONG_FORMAT);
-	show_inodes = GET(ls_config.opts, SHOW_INODES);
-	show_blkcount = GET(ls_config.opts, SHOW_BLKCOUNT);
-	show_filetype_sym = GET(ls_config.opts, SHOW_FILETYPE_SYM);
-	human_readable = (ls_config.blkcount_fmt == HUMAN_READABLE);
-
-	if ((long_format || (show_blkcount && ls_config.istty)) &&
-	    fileinfos->size > 0) {
-		if (human_readable) {
-			(void)printf("total %s\n", human_readable_size_from(
-						 fileinfos->total_size, 0));
-		} else {
-			(void)printf("total %ld\n", (fileinfos->total_blocks * 512 +
-			                       ls_config.blocksize - 1) /
-			                          ls_config.blocksize);
-		}
+	uint64_t start;
+	stats_phase_t prev;
+
+	start = TRACE_START();
+	prev = STATS_ENTER(PHASE_FORMAT);
+	if (fileinfos->size > 0) {
+		print_fileinfos_total(fileinfos);
 	}
+	print_fileinfos_rows(fileinfos);
+	out_dir_end();
+	STATS_LEAVE(prev);
+	TRACE_SPAN("format", start, NULL, fileinfos->size);
+}
 
-	for (i = 0; i < fileinfos->size; ++i) {
-		fileinfo = fileinfos->arr[i];
-		if (show_inodes) {
-			(void)printf("%*ld ", fileinfos->max_inode_len,
-			       fileinfo.statp->st_ino);
-		}
-		if (show_blkcount) {
-			if (human_readable && !long_format) {
-				(void)printf("%*s ", fileinfos->max_file_size_len,
-				       fileinfo.file_size);
-			} else {
-				(void)printf("%*s ", fileinfos->max_blockcount_len,
-				       fileinfo.block_count);
-			}
-		}
-		if (long_format) {
-			(void)printf("%s ", fileinfos->arr[i].mode);
-			(void)printf("%*d ", fileinfos->max_nlink_len,
-			       fileinfo.statp->st_nlink);
-			(void)printf("%-*s  ", fileinfos->max_owner_name_or_id_len,
-			       fileinfo.owner_name_or_id);
-			(void)printf("%-*s  ", fileinfos->max_group_name_or_id_len,
-			       fileinfo.group_name_or_id);
-			if (fileinfo.use_rdev_nums) {
-				(void)printf("%*s%*d, %*d ",
-				       fileinfos->max_size_or_rdev_nums_len -
-				           fileinfos->max_rdev_nums_len,
-				       "", /* print appropriate padding if the
-				            * max length is too short */
-				       fileinfos->max_major_len, fileinfo.major,
-				       fileinfos->max_minor_len,
-				       fileinfo.minor);
-			} else {
-				(void)printf("%*s ",
-				       fileinfos->max_size_or_rdev_nums_len,
-				       fileinfo.file_size);
-			}
-			print_file_time(fileinfo);
-		}
-		print_raw_or_not(fileinfo.name);
-		if (show_filetype_sym) {
-			print_filetype_char(fileinfo);
+/*
+ * allocates an empty fileinfos_t that entries can be added to
+ */
+fileinfos_t *
+fileinfos_new(void)
+{
+	fileinfos_t *fileinfos;
+
+	if ((fileinfos = calloc(1, sizeof(fileinfos_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate fileinfos");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+	return fileinfos;
+}
+
+/*
+ * drops the entries of fileinfos but keeps its totals and column widths, for
+ * a listing that is printed a batch at a time
+ */
+void
+fileinfos_clear(fileinfos_t *fileinfos)
+{
+	fileinfos->size = 0;
+	fileinfos->arena_len = 0;
+}
+
+/*
+ * empties fileinfos for the next directory, keeping the columns and the arena
+ * allocated
+ */
+void
+fileinfos_reset(fileinfos_t *fileinfos)
+{
+	fileinfos_clear(fileinfos);
+	fileinfos->total_blocks = 0;
+	fileinfos->total_size = 0;
+	fileinfos->max_inode_len = 0;
+	fileinfos->max_blockcount_len = 0;
+	fileinfos->max_nlink_len = 0;
+	fileinfos->max_owner_name_or_id_len = 0;
+	fileinfos->max_group_name_or_id_len = 0;
+	fileinfos->max_file_size_len = 0;
+	fileinfos->max_rdev_nums_len = 0;
+	fileinfos->max_size_or_rdev_nums_len = 0;
+	fileinfos->max_major_len = 0;
+	fileinfos->max_minor_len = 0;
+}
+
+/*
+ * realloc a column to cap elements
+ */
+void *
+grow_column(void *column, int cap, size_t elem_size)
+{
+	if ((column = realloc(column, cap * elem_size)) == NULL) {
+		err(EXIT_FAILURE, "failed to realloc fileinfos column");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+	return column;
+}
+
+/*
+ * double the capacity of every column
+ */
+void
+fileinfos_grow(fileinfos_t *fileinfos)
+{
+	int cap;
+
+	cap = fileinfos->cap == 0 ? INIT_CAP : fileinfos->cap * 2;
+	fileinfos->name_off =
+	    grow_column(fileinfos->name_off, cap, sizeof(size_t));
+	fileinfos->link_off =
+	    grow_column(fileinfos->link_off, cap, sizeof(size_t));
+	fileinfos->inode = grow_column(fileinfos->inode, cap, sizeof(ino_t));
+	fileinfos->file_size =
+	    grow_column(fileinfos->file_size, cap, sizeof(off_t));
+	fileinfos->blocks =
+	    grow_column(fileinfos->blocks, cap, sizeof(blkcnt_t));
+	fileinfos->nlink = grow_column(fileinfos->nlink, cap, sizeof(nlink_t));
+	fileinfos->mode = grow_column(fileinfos->mode, cap, sizeof(mode_t));
+	fileinfos->rdev = grow_column(fileinfos->rdev, cap, sizeof(dev_t));
+	fileinfos->time =
+	    grow_column(fileinfos->time, cap, sizeof(struct timespec));
+	fileinfos->owner_name_or_id =
+	    grow_column(fileinfos->owner_name_or_id, cap, sizeof(char *));
+	fileinfos->group_name_or_id =
+	    grow_column(fileinfos->group_name_or_id, cap, sizeof(char *));
+	fileinfos->cap = cap;
+}
+
+/*
+ * make room for len more bytes in the arena and return their offset
+ */
+size_t
+arena_reserve(fileinfos_t *fileinfos, size_t len)
+{
+	size_t off;
+
+	if (fileinfos->arena_len + len > fileinfos->arena_cap) {
+		while (fileinfos->arena_len + len > fileinfos->arena_cap) {
+			fileinfos->arena_cap = fileinfos->arena_cap == 0
+			                           ? BUFSIZ
+			                           : fileinfos->arena_cap * 2;
 		}
-		if (long_format) {
-			if (S_ISLNK(fileinfo.statp->st_mode)) {
-				print_symlink_dest(fileinfo);
-			}
+		fileinfos->arena =
+		    realloc(fileinfos->arena, fileinfos->arena_cap);
+		if (fileinfos->arena == NULL) {
+			err(EXIT_FAILURE, "failed to realloc fileinfos arena");
 		}
-		(void)putchar('\n');
+		STATS_COUNT(COUNT_ALLOC, 1);
 	}
+	off = fileinfos->arena_len;
+	fileinfos->arena_len += len;
+	return off;
 }
 
 /*
- * creates dynamic array object so the printing widths of the fields can be
- * determined dynamically
+ * copy str into the arena and return its offset
  */
-fileinfos_t *
-fileinfos_from_ftsents(FTSENT *trav, bool non_dir_only, bool dir_only,
-                       bool show_warn)
+size_t
+arena_strcpy(fileinfos_t *fileinfos, const char *str)
+{
+	size_t len, off;
+
+	len = strlen(str) + 1;
+	off = arena_reserve(fileinfos, len);
+	(void)memcpy(fileinfos->arena + off, str, len);
+	return off;
+}
+
+/*
+ * adds a single entry to fileinfos and updates the column widths, which are
+ * computed from the numbers without formatting them. name, statp and link
+ * are copied. link is the symlink target, NULL if it wasn't read.
+ */
+void
+fileinfos_add(fileinfos_t *fileinfos, const char *name,
+              const struct stat *statp, const char *link)
 {
-	uid_t uid;
-	gid_t gid;
+	int i;
 	mode_t mode;
-	dev_t rdev;
 	blkcnt_t block_count;
 	off_t file_size;
-	struct timespec tim;
-	struct passwd *pwd;
-	struct group *grp;
+	human_t h;
 
-	fileinfos_t *fileinfos;
-	fileinfo_t fileinfo;
+	if (fileinfos->size == fileinfos->cap) {
+		fileinfos_grow(fileinfos);
+	}
+	i = fileinfos->size++;
 
-	if ((fileinfos = calloc(1, sizeof(fileinfos_t))) == NULL) {
-		err(EXIT_FAILURE, "failed to allocate fileinfos");
+	fileinfos->name_off[i] = arena_strcpy(fileinfos, name);
+	fileinfos->link_off[i] =
+	    link == NULL ? NO_LINK : arena_strcpy(fileinfos, link);
+
+	fileinfos->owner_name_or_id[i] = user_name_or_id(
+	    statp->st_uid, GET(ls_config.opts, SHOW_ID_ONLY));
+	fileinfos->group_name_or_id[i] = group_name_or_id(
+	    statp->st_gid, GET(ls_config.opts, SHOW_ID_ONLY));
+
+	block_count = statp->st_blocks;
+	fileinfos->total_blocks += block_count;
+	file_size = statp->st_size;
+	fileinfos->total_size += file_size;
+
+	if (ls_config.blkcount_fmt == HUMAN_READABLE) {
+		human_size(&h, block_count * 512, true);
+		fileinfos->max_blockcount_len =
+		    max(fileinfos->max_blockcount_len, human_len(&h));
+		human_size(&h, file_size, true);
+		fileinfos->max_file_size_len =
+		    max(fileinfos->max_file_size_len, human_len(&h));
+	} else {
+		/* use ceiling */
+		block_count = (block_count * 512 + ls_config.blocksize - 1) /
+		              ls_config.blocksize;
+		fileinfos->max_blockcount_len =
+		    max(fileinfos->max_blockcount_len,
+		        count_digits(block_count));
+		fileinfos->max_file_size_len =
+		    max(fileinfos->max_file_size_len, count_digits(file_size));
+	}
+
+	mode = statp->st_mode;
+	fileinfos->inode[i] = statp->st_ino;
+	fileinfos->file_size[i] = file_size;
+	fileinfos->blocks[i] = statp->st_blocks;
+	fileinfos->nlink[i] = statp->st_nlink;
+	fileinfos->mode[i] = mode;
+	fileinfos->rdev[i] = statp->st_rdev;
+
+	switch (ls_config.time) {
+	case ATIME:
+		fileinfos->time[i] = statp->st_atim;
+		break;
+	case MTIME:
+		fileinfos->time[i] = statp->st_mtim;
+		break;
+	case CTIME:
+		fileinfos->time[i] = statp->st_ctim;
+		break;
+	}
+
+	/* update statistics */
+	fileinfos->max_inode_len =
+	    max(fileinfos->max_inode_len, count_digits(statp->st_ino));
+	fileinfos->max_nlink_len =
+	    max(fileinfos->max_nlink_len, count_digits(statp->st_nlink));
+	fileinfos->max_owner_name_or_id_len =
+	    max(fileinfos->max_owner_name_or_id_len,
+	        strlen(fileinfos->owner_name_or_id[i]));
+	fileinfos->max_group_name_or_id_len =
+	    max(fileinfos->max_group_name_or_id_len,
+	        strlen(fileinfos->group_name_or_id[i]));
+	if (S_ISCHR(mode) || S_ISBLK(mode)) {
+		fileinfos->max_major_len =
+		    max(fileinfos->max_major_len,
+		        count_digits(major(statp->st_rdev)));
+		fileinfos->max_minor_len =
+		    max(fileinfos->max_minor_len,
+		        count_digits(minor(statp->st_rdev)));
+	} else {
+		fileinfos->max_major_len = max(fileinfos->max_major_len, 1);
+		fileinfos->max_minor_len = max(fileinfos->max_minor_len, 1);
 	}
+	fileinfos->max_rdev_nums_len =
+	    max(fileinfos->max_rdev_nums_len,
+	        fileinfos->max_major_len + 2 +
+	            fileinfos->max_minor_len); /* + 2 for the ", " */
+	if (S_ISCHR(mode) || S_ISBLK(mode)) {
+		fileinfos->max_size_or_rdev_nums_len =
+		    max(fileinfos->max_size_or_rdev_nums_len,
+		        fileinfos->max_rdev_nums_len);
+	} else {
+		fileinfos->max_size_or_rdev_nums_len =
+		    max(fileinfos->max_size_or_rdev_nums_len,
+		        fileinfos->max_file_size_len);
+	}
+}
+
+/*
+ * adds the blocks and size of an entry --head doesn't list to the total, as
+ * if it were listed
+ */
+void
+fileinfos_count(fileinfos_t *fileinfos, blkcnt_t blocks, off_t size)
+{
+	fileinfos->total_blocks += blocks;
+	fileinfos->total_size += size;
+}
+
+/*
+ * returns the path of the directory an entry returned by fts is in, as
+ * records name it: "" for the operands
+ */
+const char *
+ftsent_parent(const FTSENT *ent)
+{
+	if (ent->fts_level == FTS_ROOTLEVEL) {
+		return "";
+	}
+	return ent->fts_parent->fts_path;
+}
+
+/*
+ * fills fileinfos (after resetting it) so the printing widths of the fields
+ * can be determined dynamically. With --ndjson or --binary the entries are
+ * printed as records right away instead, and with --head-global they are
+ * offered to it, so fileinfos stays empty. dirfd is the directory the
+ * entries are in, AT_FDCWD for the operands; -l reads the symlink targets
+ * relative to it, or not at all if it is -1 because the directory couldn't
+ * be opened. --head cuts directory contents short (the total still
+ * counts the rest), the filters drop some of them and --du counts them, not
+ * the operands.
+ */
+void
+fileinfos_from_ftsents(fileinfos_t *fileinfos, FTSENT *trav, int dirfd,
+                       bool non_dir_only, bool dir_only, bool show_warn)
+{
+	bool read_links, contents;
+	int nlisted, limit;
+	const char *link;
+	stats_phase_t prev;
+	char link_dest[PATH_MAX + 1];
+
+	prev = STATS_ENTER(PHASE_COLLECT);
+	fileinfos_reset(fileinfos);
+	read_links = GET(ls_config.stat_needs, META_LINK) && dirfd != -1;
+	contents = !non_dir_only && !dir_only;
+	limit = contents ? ls_config.head : 0;
+	nlisted = 0;
 
 	while (trav != NULL) {
 		if (trav->fts_errno != 0) {
-			if (show_warn) {
+			if (show_warn && (limit == 0 || nlisted < limit)) {
 				errno = trav->fts_errno;
 				warn("%s", trav->fts_name);
 			}
@@ -332,176 +641,217 @@ fileinfos_from_ftsents(FTSENT *trav, bool non_dir_only, bool dir_only,
 		if ((non_dir_only && S_ISDIR(trav->fts_statp->st_mode)) ||
 		    (dir_only && !S_ISDIR(trav->fts_statp->st_mode)) ||
 		    (ls_config.dots == NO_DOTS && trav->fts_name[0] == '.' &&
-		     !non_dir_only && !dir_only)) {
+		     !non_dir_only && !dir_only) ||
+		    (contents && ls_config.filter &&
+		     !filter_match(trav->fts_name, trav->fts_statp->st_mode,
+		                   trav->fts_statp))) {
 			trav = trav->fts_link;
 			continue;
 		}
-
-		if (fileinfos->size == fileinfos->cap) {
-			fileinfos->cap *= 2;
-			if (fileinfos->cap == 0) {
-				fileinfos->cap = INIT_CAP;
-			}
-			fileinfos->arr =
-			    realloc(fileinfos->arr,
-			            fileinfos->cap * sizeof(fileinfo_t));
-			if (fileinfos->arr == NULL) {
-				err(EXIT_FAILURE,
-				    "failed to realloc dynamic array");
-			}
+		/* past --head, only the total still counts it */
+		if (limit > 0 && nlisted >= limit) {
+			fileinfos_count(fileinfos, trav->fts_statp->st_blocks,
+			                trav->fts_statp->st_size);
+			trav = trav->fts_link;
+			continue;
 		}
 
-		fileinfo.name = trav->fts_name;
-		fileinfo.path = trav->fts_path;
-		fileinfo.statp = trav->fts_statp;
-
-		ASPRINTF("couldn't alloc string for parent accpath",
-		         &fileinfo.parent_accpath, "%s",
-		         trav->fts_parent->fts_accpath);
-
-		uid = trav->fts_statp->st_uid;
-		if ((pwd = getpwuid(uid)) == NULL ||
-		    GET(ls_config.opts, SHOW_ID_ONLY)) {
-			ASPRINTF("couldn't alloc string for owner id",
-			         &fileinfo.owner_name_or_id, "%d", uid);
-		} else {
-			STRDUP("couldn't strdup username",
-			       fileinfo.owner_name_or_id, pwd->pw_name);
+		link = NULL;
+		if (read_links && S_ISLNK(trav->fts_statp->st_mode)) {
+			(void)read_symlink(dirfd, trav->fts_name, link_dest);
+			link = link_dest;
 		}
-
-		gid = trav->fts_statp->st_gid;
-		if ((grp = getgrgid(gid)) == NULL ||
-		    GET(ls_config.opts, SHOW_ID_ONLY)) {
-			ASPRINTF("couldn't alloc string for group id",
-			         &fileinfo.group_name_or_id, "%d", gid);
-		} else {
-			STRDUP("couldn't strdup groupname",
-			       fileinfo.group_name_or_id, grp->gr_name);
+		if (ls_config.du && contents) {
+			du_add(trav->fts_name, trav->fts_statp);
 		}
-
-		block_count = trav->fts_statp->st_blocks;
-		fileinfos->total_blocks += block_count;
-		file_size = trav->fts_statp->st_size;
-		fileinfos->total_size += file_size;
-
-		if (ls_config.blkcount_fmt == HUMAN_READABLE) {
-			fileinfo.block_count = human_readable_size_from(
-			    block_count * 512, HN_DECIMAL);
-			fileinfo.file_size =
-			    human_readable_size_from(file_size, HN_DECIMAL);
+		if (ls_config.head_global > 0) {
+			head_add(ftsent_parent(trav), trav->fts_name,
+			         trav->fts_statp, link);
+		} else if (ls_config.records != NO_RECORDS) {
+			record_print(ftsent_parent(trav), trav->fts_name,
+			             trav->fts_statp, link);
 		} else {
-			/* use ceiling */
-			block_count =
-			    (block_count * 512 + ls_config.blocksize - 1) /
-			    ls_config.blocksize;
-			ASPRINTF("couldn't alloc string for block count",
-			         &fileinfo.block_count, "%ld", block_count);
-			ASPRINTF("couldn't alloc string for file size",
-			         &fileinfo.file_size, "%ld", file_size);
+			fileinfos_add(fileinfos, trav->fts_name,
+			              trav->fts_statp, link);
 		}
-
-		mode = trav->fts_statp->st_mode;
-
-		strmode(mode, fileinfo.mode);
-
-		fileinfo.use_rdev_nums =
-		    (S_ISCHR(mode) != 0 || S_ISBLK(mode) != 0);
-
-		if (fileinfo.use_rdev_nums) {
-			rdev = trav->fts_statp->st_rdev;
-			fileinfo.major = major(rdev);
-			fileinfo.minor = minor(rdev);
-		} else {
-			fileinfo.major = 0;
-			fileinfo.minor = 0;
+		nlisted++;
+		/* fts did the stat, the operands are seen twice */
+		if (!dir_only) {
+			STATS_COUNT(COUNT_STAT, 1);
 		}
 
-		switch (ls_config.time) {
-		case ATIME:
-			tim = fileinfo.statp->st_atim;
-			break;
-		case MTIME:
-			tim = fileinfo.statp->st_mtim;
-			break;
-		case CTIME:
-			tim = fileinfo.statp->st_ctim;
-			break;
-		}
-		if (localtime_r(&tim.tv_sec, &fileinfo.time) == NULL) {
-			err(EXIT_FAILURE, "failed to acquire localtime");
-		}
+		trav = trav->fts_link;
+	}
+	STATS_LEAVE(prev);
+}
 
-		fileinfo.older_than_6months = is_older_than_6months(tim);
+/*
+ * returns the symlink target of dentry for printing, warning if it couldn't
+ * be read. The fetch already read it relative to the directory, so this
+ * doesn't need a path.
+ */
+const char *
+dentry_link(const dentry_t *dentry)
+{
+	if (dentry->link != NULL || !S_ISLNK(dentry->st.st_mode) ||
+	    !GET(ls_config.stat_needs, META_LINK)) {
+		return dentry->link;
+	}
+	if (dentry->link_err != 0) {
+		errno = dentry->link_err;
+		warn("%s", dentry->name);
+	}
+	return "";
+}
 
-		fileinfos->arr[fileinfos->size++] = fileinfo;
+/*
+ * prints an entry read without fts as a --ndjson or --binary record
+ */
+void
+dentry_record(const dentry_t *dentry, const char *parent_path)
+{
+	record_print(parent_path, dentry->name, &dentry->st,
+	             dentry_link(dentry));
+}
 
-		/* update statistics */
-		fileinfos->max_inode_len =
-		    max(fileinfos->max_inode_len,
-		        count_digits(fileinfo.statp->st_ino));
-		fileinfos->max_blockcount_len =
-		    max(fileinfos->max_blockcount_len,
-		        strlen(fileinfo.block_count));
-		fileinfos->max_nlink_len =
-		    max(fileinfos->max_nlink_len,
-		        count_digits(fileinfo.statp->st_nlink));
-		fileinfos->max_owner_name_or_id_len =
-		    max(fileinfos->max_owner_name_or_id_len,
-		        strlen(fileinfo.owner_name_or_id));
-		fileinfos->max_group_name_or_id_len =
-		    max(fileinfos->max_group_name_or_id_len,
-		        strlen(fileinfo.group_name_or_id));
-		fileinfos->max_file_size_len = max(fileinfos->max_file_size_len,
-		                                   strlen(fileinfo.file_size));
-		fileinfos->max_major_len =
-		    max(fileinfos->max_major_len, count_digits(fileinfo.major));
-		fileinfos->max_minor_len =
-		    max(fileinfos->max_minor_len, count_digits(fileinfo.minor));
-		fileinfos->max_rdev_nums_len =
-		    max(fileinfos->max_rdev_nums_len,
-		        fileinfos->max_major_len + 2 +
-		            fileinfos->max_minor_len); /* + 2 for the ", " */
-		if (fileinfo.use_rdev_nums) {
-			fileinfos->max_size_or_rdev_nums_len =
-			    max(fileinfos->max_size_or_rdev_nums_len,
-			        fileinfos->max_rdev_nums_len);
-		} else {
-			fileinfos->max_size_or_rdev_nums_len =
-			    max(fileinfos->max_size_or_rdev_nums_len,
-			        fileinfos->max_file_size_len);
-		}
+/*
+ * adds one entry read without fts to fileinfos, or prints or offers it the
+ * way fileinfos_from_ftsents does, returning whether it is listed. A failed
+ * stat is reported instead. parent_path is only used for records and
+ * --head-global.
+ */
+bool
+fileinfos_add_dentry(fileinfos_t *fileinfos, const dentry_t *dentry,
+                     const char *parent_path)
+{
+	if (dentry->err != 0) {
+		errno = dentry->err;
+		warn("%s", dentry->name);
+		return false;
+	}
+	if ((ls_config.dots == NO_DOTS && dentry->name[0] == '.') ||
+	    (ls_config.filter && !filter_dentry(dentry))) {
+		return false;
+	}
+	if (ls_config.du) {
+		du_add(dentry->name, &dentry->st);
+	}
+	if (ls_config.head_global > 0) {
+		head_add(parent_path, dentry->name, &dentry->st,
+		         dentry_link(dentry));
+	} else if (ls_config.records != NO_RECORDS) {
+		dentry_record(dentry, parent_path);
+	} else {
+		fileinfos_add(fileinfos, dentry->name, &dentry->st,
+		              dentry_link(dentry));
+	}
+	return true;
+}
 
-		if (fileinfo.older_than_6months) {
-			fileinfos->max_time_or_year_len =
-			    max(fileinfos->max_time_or_year_len,
-			        count_digits(1900 + fileinfo.time.tm_year));
-		} else {
-			fileinfos->max_time_or_year_len =
-			    max(fileinfos->max_time_or_year_len, 5);
+/*
+ * same as fileinfos_from_ftsents for entries read without fts. Every entry
+ * must have been stat-ed.
+ */
+void
+fileinfos_from_dentries(fileinfos_t *fileinfos, dentries_t *dentries,
+                        const char *parent_path)
+{
+	int i, nlisted;
+	const dentry_t *dentry;
+	stats_phase_t prev;
+
+	prev = STATS_ENTER(PHASE_COLLECT);
+	fileinfos_reset(fileinfos);
+	nlisted = 0;
+	for (i = 0; i < dentries->size; ++i) {
+		dentry = &dentries->arr[i];
+		if (ls_config.head == 0 || nlisted < ls_config.head) {
+			if (fileinfos_add_dentry(fileinfos, dentry,
+			                         parent_path)) {
+				nlisted++;
+			}
+		} else if (dentry->err == 0 &&
+		           (ls_config.dots != NO_DOTS ||
+		            dentry->name[0] != '.') &&
+		           (!ls_config.filter || filter_dentry(dentry))) {
+			/* past --head, only the total still counts it */
+			fileinfos_count(fileinfos, dentry->st.st_blocks,
+			                dentry->st.st_size);
 		}
+	}
+	fileinfos_count(fileinfos, dentries->dropped_blocks,
+	                dentries->dropped_size);
+	STATS_LEAVE(prev);
+}
 
-		trav = trav->fts_link;
+/*
+ * Prints one entry with no columns to align, or reports its failed stat.
+ * Returns whether it is listed.
+ */
+bool
+print_dentry(const dentry_t *dentry)
+{
+	if (dentry->err != 0) {
+		errno = dentry->err;
+		warn("%s", dentry->name);
+		return false;
 	}
+	if ((ls_config.dots == NO_DOTS && dentry->name[0] == '.') ||
+	    (ls_config.filter && !filter_dentry(dentry))) {
+		return false;
+	}
+	print_name(dentry->name);
+	if (GET(ls_config.opts, SHOW_FILETYPE_SYM)) {
+		print_filetype_char(dentry->has_stat ? dentry->st.st_mode
+		                                     : dentry->type);
+	}
+	out_newline();
+	return true;
+}
 
-	return fileinfos;
+/*
+ * Prints entries when there are no columns to align, so only the name and
+ * the -F marker are needed. --head stops it early.
+ */
+void
+print_dentries(dentries_t *dentries)
+{
+	int i, nlisted;
+	uint64_t start;
+	stats_phase_t prev;
+
+	start = TRACE_START();
+	prev = STATS_ENTER(PHASE_FORMAT);
+	nlisted = 0;
+	for (i = 0; i < dentries->size &&
+	            (ls_config.head == 0 || nlisted < ls_config.head);
+	     ++i) {
+		if (print_dentry(&dentries->arr[i])) {
+			nlisted++;
+		}
+	}
+	out_dir_end();
+	STATS_LEAVE(prev);
+	TRACE_SPAN("format", start, NULL, dentries->size);
 }
 
 /*
- * deallocates fileinfos_t, making sure to free all the dynamically allocated
- * strings in the heap
+ * deallocates fileinfos_t, its columns and its arena
  */
 void
 fileinfos_free(fileinfos_t *fileinfos)
 {
-	int i;
-	/* Do not free statp or name since it was copied from FTSENT statp */
-	for (i = 0; i < fileinfos->size; ++i) {
-		free(fileinfos->arr[i].file_size);
-		free(fileinfos->arr[i].block_count);
-		free(fileinfos->arr[i].parent_accpath);
-		free(fileinfos->arr[i].owner_name_or_id);
-		free(fileinfos->arr[i].group_name_or_id);
-	}
-	free(fileinfos->arr);
+	free(fileinfos->name_off);
+	free(fileinfos->link_off);
+	free(fileinfos->inode);
+	free(fileinfos->file_size);
+	free(fileinfos->blocks);
+	free(fileinfos->nlink);
+	free(fileinfos->mode);
+	free(fileinfos->rdev);
+	free(fileinfos->time);
+	free(fileinfos->owner_name_or_id);
+	free(fileinfos->group_name_or_id);
+	free(fileinfos->arena);
 	free(fileinfos);
 }
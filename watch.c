@@ -0,0 +1,615 @@
+#include "watch.h"
+
+#include <sys/event.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "filter.h"
+#include "ls.h"
+#include "output.h"
+#include "trace.h"
+
+extern config_t ls_config;
+
+/* entries added, removed or renamed, or the directory itself went away.
+ * NOTE_ATTRIB is left out, reading the directory could trigger it. */
+#define WATCH_FFLAGS (NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE | NOTE_RENAME)
+/* events taken from the kqueue at once */
+#define WATCH_NEVENTS 64
+
+/* home cursor and erase display */
+#define CLEAR_SCREEN "\033[H\033[2J"
+
+/*
+ * Directories are found by the descriptor kqueue reports them with rather
+ * than udata, whose type isn't the same across releases.
+ */
+typedef struct watch_t {
+	int kq;
+	watch_dir_t **roots; /* directory operands in the order ls printed */
+	int nroots;
+	int cap;
+	watch_dir_t **by_fd;
+	int nfds;
+	fileinfos_t *fileinfos;
+	int exitcode; /* of watch_run, for roots that went away */
+} watch_t;
+
+watch_t watch;
+
+uint64_t watch_now_ms(void);
+watch_dir_t *watch_dir_new(watch_dir_t *, const char *, const char *,
+                           int);
+void watch_dir_free(watch_dir_t *);
+bool watch_is_cycle(const watch_dir_t *, const struct stat *);
+void watch_register(watch_dir_t *);
+watch_dir_t *watch_find(watch_dir_t **, int, int *, const dentry_t *);
+void watch_read(watch_dir_t *);
+void watch_rescan(watch_dir_t *);
+int watch_list(watch_dir_t *);
+int watch_print(watch_dir_t *);
+int watch_print_changed(watch_dir_t *);
+int watch_render(void);
+void watch_drop(watch_dir_t *, const char *);
+bool watch_gone(const watch_dir_t *);
+bool watch_mark(const struct kevent *);
+int watch_add(const FTSENT *, bool);
+int watch_run(void);
+
+/*
+ * Monotonic clock in milliseconds, for the debouncing
+ */
+uint64_t
+watch_now_ms(void)
+{
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Allocate a directory node. As in pwalk, the path is built the way fts
+ * builds fts_path so the headers match the first listing.
+ */
+watch_dir_t *
+watch_dir_new(watch_dir_t *parent, const char *path, const char *name,
+              int level)
+{
+	int len;
+	watch_dir_t *dir;
+
+	if ((dir = calloc(1, sizeof(watch_dir_t))) == NULL) {
+		err(EXIT_FAILURE, "failed to allocate directory node");
+	}
+	STATS_COUNT(COUNT_ALLOC, 1);
+	if (parent == NULL) {
+		STRDUP("couldn't strdup root path", dir->path, path);
+	} else {
+		len = (int)strlen(parent->path);
+		if (len > 0 && parent->path[len - 1] == '/') {
+			len--;
+		}
+		ASPRINTF("couldn't alloc string for directory path", &dir->path,
+		         "%.*s/%s", len, parent->path, name);
+	}
+	STRDUP("couldn't strdup directory name", dir->name, name);
+	dir->level = level;
+	dir->fd = -1;
+	dir->parent = parent;
+	return dir;
+}
+
+/*
+ * Free a directory and everything watched below it. Closing the descriptor
+ * also removes it from the kqueue.
+ */
+void
+watch_dir_free(watch_dir_t *dir)
+{
+	int i;
+
+	for (i = 0; i < dir->nsubdirs; ++i) {
+		watch_dir_free(dir->subdirs[i]);
+	}
+	if (dir->fd >= 0) {
+		watch.by_fd[dir->fd] = NULL;
+		(void)close(dir->fd);
+	}
+	dentries_free(&dir->dentries);
+	free(dir->subdirs);
+	free(dir->path);
+	free(dir->name);
+	free(dir);
+}
+
+/*
+ * Whether st is dir or one of its ancestors, i.e. following it would loop.
+ */
+bool
+watch_is_cycle(const watch_dir_t *dir, const struct stat *st)
+{
+	for (; dir != NULL; dir = dir->parent) {
+		if (dir->dev == st->st_dev && dir->ino == st->st_ino) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Ask for the vnode events of dir's descriptor.
+ */
+void
+watch_register(watch_dir_t *dir)
+{
+	int nfds;
+	struct kevent change;
+
+	if (dir->fd >= watch.nfds) {
+		nfds = watch.nfds == 0 ? INIT_CAP : watch.nfds;
+		while (nfds <= dir->fd) {
+			nfds *= 2;
+		}
+		watch.by_fd = realloc(watch.by_fd,
+		                      nfds * sizeof(watch_dir_t *));
+		if (watch.by_fd == NULL) {
+			err(EXIT_FAILURE, "failed to grow descriptor table");
+		}
+		STATS_COUNT(COUNT_ALLOC, 1);
+		(void)memset(watch.by_fd + watch.nfds, 0,
+		             (nfds - watch.nfds) * sizeof(watch_dir_t *));
+		watch.nfds = nfds;
+	}
+	watch.by_fd[dir->fd] = dir;
+
+	EV_SET(&change, dir->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, WATCH_FFLAGS,
+	       0, 0);
+	if (kevent(watch.kq, &change, 1, NULL, 0, NULL) < 0) {
+		err(EXIT_FAILURE, "kevent");
+	}
+}
+
+/*
+ * Find the subdirectory of old that dentry still refers to, the same name
+ * and inode, and take it out of old. The lists are usually in the same
+ * order, so the search starts after the previous match.
+ */
+watch_dir_t *
+watch_find(watch_dir_t **old, int nold, int *hint, const dentry_t *dentry)
+{
+	int i, j;
+	watch_dir_t *found;
+
+	for (i = 0; i < nold; ++i) {
+		j = (*hint + i) % nold;
+		if (old[j] != NULL && old[j]->ino == dentry->st.st_ino &&
+		    old[j]->dev == dentry->st.st_dev &&
+		    strcmp(old[j]->name, dentry->name) == 0) {
+			found = old[j];
+			old[j] = NULL;
+			*hint = j + 1;
+			return found;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * (Re)read the entries of dir and, with -R, bring its subdirectories in line
+ * with them: the ones still there are kept as they are, new ones are read in
+ * full and removed ones are dropped with their subtrees.
+ */
+void
+watch_read(watch_dir_t *dir)
+{
+	int i;
+	int fd;
+	int hint;
+	int nold;
+	uint64_t start;
+	dentry_t *dentry;
+	watch_dir_t **old;
+	watch_dir_t *sub;
+
+	dentries_free(&dir->dentries);
+	start = TRACE_START();
+	/* the descriptor is watched, so read through a new one */
+	if ((fd = openat(dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) <
+	    0) {
+		dir->err = errno;
+	} else {
+		dir->err = dentries_read(fd, &dir->dentries,
+		                         ls_config.stat_needs | META_DIRS);
+	}
+	TRACE_SPAN("readdir", start, dir->path, dir->dentries.size);
+	dentries_sort(&dir->dentries);
+	dir->changed = true;
+
+	old = dir->subdirs;
+	nold = dir->nsubdirs;
+	dir->subdirs = NULL;
+	dir->nsubdirs = 0;
+	hint = 0;
+
+	for (i = 0; i < dir->dentries.size; ++i) {
+		dentry = &dir->dentries.arr[i];
+		if (!dentry->has_stat || !S_ISDIR(dentry->st.st_mode) ||
+		    strcmp(dentry->name, ".") == 0 ||
+		    strcmp(dentry->name, "..") == 0 ||
+		    (ls_config.dots == NO_DOTS && dentry->name[0] == '.') ||
+		    (ls_config.filter && filter_pruned(dentry->name)) ||
+		    dir->level >= ls_config.max_depth ||
+		    watch_is_cycle(dir, &dentry->st)) {
+			continue;
+		}
+		if ((sub = watch_find(old, nold, &hint, dentry)) == NULL) {
+			sub = watch_dir_new(dir, NULL, dentry->name,
+			                    dir->level + 1);
+			sub->dev = dentry->st.st_dev;
+			sub->ino = dentry->st.st_ino;
+			if ((sub->fd = openat(dir->fd, dentry->name,
+			                      O_RDONLY | O_DIRECTORY |
+			                          O_CLOEXEC)) < 0) {
+				sub->err = errno;
+			} else {
+				watch_register(sub);
+				watch_read(sub);
+			}
+		}
+		if (dir->nsubdirs % INIT_CAP == 0) {
+			dir->subdirs = realloc(dir->subdirs,
+			                       (dir->nsubdirs + INIT_CAP) *
+			                           sizeof(watch_dir_t *));
+			if (dir->subdirs == NULL) {
+				err(EXIT_FAILURE,
+				    "failed to realloc subdirectory array");
+			}
+			STATS_COUNT(COUNT_ALLOC, 1);
+		}
+		dir->subdirs[dir->nsubdirs++] = sub;
+	}
+
+	for (i = 0; i < nold; ++i) {
+		if (old[i] != NULL) {
+			watch_dir_free(old[i]);
+		}
+	}
+	free(old);
+}
+
+/*
+ * Read again every directory under dir that kqueue reported.
+ */
+void
+watch_rescan(watch_dir_t *dir)
+{
+	int i;
+
+	if (dir->dirty) {
+		dir->dirty = false;
+		watch_read(dir);
+	}
+	for (i = 0; i < dir->nsubdirs; ++i) {
+		watch_rescan(dir->subdirs[i]);
+	}
+}
+
+/*
+ * Print the entries of dir, without its header.
+ */
+int
+watch_list(watch_dir_t *dir)
+{
+	int exitcode;
+
+	exitcode = EXIT_SUCCESS;
+	STATS_DIR(dir->path, dir->dentries.size);
+	if (ls_config.names_only) {
+		print_dentries(&dir->dentries);
+	} else {
+		fileinfos_from_dentries(watch.fileinfos, &dir->dentries,
+		                        dir->path);
+		print_fileinfos(watch.fileinfos);
+	}
+	if (dir->dentries.nerrs > 0) {
+		exitcode = EXIT_FAILURE;
+	}
+	if (dir->err != 0) {
+		if (dir->level > 0) {
+			errno = dir->err;
+			warn("%s", dir->name);
+		}
+		exitcode = EXIT_FAILURE;
+	}
+	dir->changed = false;
+	return exitcode;
+}
+
+/*
+ * Print dir and, headed by their paths, its subdirectories in the order
+ * fts_read would visit them. The caller prints dir's own header.
+ */
+int
+watch_print(watch_dir_t *dir)
+{
+	int i;
+	int exitcode;
+
+	exitcode = watch_list(dir);
+	for (i = 0; i < dir->nsubdirs; ++i) {
+		if (ls_config.records == NO_RECORDS) {
+			out_newline();
+			print_dir_header(dir->subdirs[i]->path);
+		}
+		if (watch_print(dir->subdirs[i]) != EXIT_SUCCESS) {
+			exitcode = EXIT_FAILURE;
+		}
+	}
+	return exitcode;
+}
+
+/*
+ * Print only the directories under dir that were read again, each headed by
+ * its path since the reader can't tell them apart otherwise.
+ */
+int
+watch_print_changed(watch_dir_t *dir)
+{
+	int i;
+	int exitcode;
+
+	exitcode = EXIT_SUCCESS;
+	if (dir->changed) {
+		if (ls_config.records == NO_RECORDS) {
+			out_newline();
+			print_dir_header(dir->path);
+		}
+		exitcode = watch_list(dir);
+	}
+	for (i = 0; i < dir->nsubdirs; ++i) {
+		if (watch_print_changed(dir->subdirs[i]) != EXIT_SUCCESS) {
+			exitcode = EXIT_FAILURE;
+		}
+	}
+	return exitcode;
+}
+
+/*
+ * Show the changes. A terminal gets the whole listing redrawn in place,
+ * anything else gets the changed directories appended.
+ */
+int
+watch_render(void)
+{
+	int i;
+	int exitcode;
+	struct timespec now;
+
+	/* -l picks between the time and the year by this */
+	if (clock_gettime(CLOCK_REALTIME, &now) == 0) {
+		ls_config.now = now.tv_sec;
+	}
+
+	exitcode = EXIT_SUCCESS;
+	if (ls_config.istty && ls_config.records == NO_RECORDS) {
+		out_str(CLEAR_SCREEN);
+		for (i = 0; i < watch.nroots; ++i) {
+			if (i > 0) {
+				out_newline();
+			}
+			if (watch.roots[i]->header) {
+				print_dir_header(watch.roots[i]->path);
+			}
+			if (watch_print(watch.roots[i]) != EXIT_SUCCESS) {
+				exitcode = EXIT_FAILURE;
+			}
+		}
+	} else {
+		for (i = 0; i < watch.nroots; ++i) {
+			if (watch_print_changed(watch.roots[i]) !=
+			    EXIT_SUCCESS) {
+				exitcode = EXIT_FAILURE;
+			}
+		}
+	}
+	out_flush();
+	return exitcode;
+}
+
+/*
+ * Stop watching the root dir, which can't be listed by its path any more.
+ */
+void
+watch_drop(watch_dir_t *dir, const char *why)
+{
+	int i;
+
+	warnx("%s: %s, not watching it", dir->path, why);
+	watch.exitcode = EXIT_FAILURE;
+	for (i = 0; watch.roots[i] != dir; ++i) {
+		continue;
+	}
+	(void)memmove(&watch.roots[i], &watch.roots[i + 1],
+	              (watch.nroots - i - 1) * sizeof(watch_dir_t *));
+	watch.nroots--;
+	watch_dir_free(dir);
+}
+
+/*
+ * Whether dir was removed. Some systems only report NOTE_DELETE once the
+ * last descriptor is closed, and ours is still open.
+ */
+bool
+watch_gone(const watch_dir_t *dir)
+{
+	struct stat st;
+
+	return fstat(dir->fd, &st) < 0 || st.st_nlink == 0;
+}
+
+/*
+ * Note the directory an event is about. Returns whether the listing has to
+ * be shown again.
+ */
+bool
+watch_mark(const struct kevent *ev)
+{
+	watch_dir_t *dir;
+
+	if ((int)ev->ident >= watch.nfds ||
+	    (dir = watch.by_fd[ev->ident]) == NULL) {
+		return false;
+	}
+	if (dir->parent == NULL && (ev->fflags & NOTE_RENAME) != 0) {
+		watch_drop(dir, "moved");
+		return true;
+	}
+	/* a removed subdirectory is dropped when its parent is read, a
+	 * removed root when it is found unlinked */
+	if ((ev->fflags & (NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE)) != 0) {
+		dir->dirty = true;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Start watching a directory operand (an FTS_D returned by fts_read at level
+ * 0) and list it the way ls would have. header is whether ls printed the
+ * "path:" line above it, which a redraw has to repeat.
+ */
+int
+watch_add(const FTSENT *root, bool header)
+{
+	watch_dir_t *dir;
+
+	if (watch.fileinfos == NULL) {
+		if ((watch.kq = kqueue()) < 0) {
+			err(EXIT_FAILURE, "kqueue");
+		}
+		watch.fileinfos = fileinfos_new();
+	}
+
+	dir = watch_dir_new(NULL, root->fts_path, root->fts_name,
+	                    root->fts_level);
+	dir->header = header;
+	dir->dev = root->fts_statp->st_dev;
+	dir->ino = root->fts_statp->st_ino;
+	if ((dir->fd = open(root->fts_accpath,
+	                    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		warn("%s", root->fts_path);
+		watch_dir_free(dir);
+		return EXIT_FAILURE;
+	}
+	watch_register(dir);
+	watch_read(dir);
+
+	if (watch.nroots == watch.cap) {
+		watch.cap = watch.cap == 0 ? INIT_CAP : watch.cap * 2;
+		watch.roots = realloc(watch.roots,
+		                      watch.cap * sizeof(watch_dir_t *));
+		if (watch.roots == NULL) {
+			err(EXIT_FAILURE, "failed to realloc root array");
+		}
+	}
+	watch.roots[watch.nroots++] = dir;
+
+	return watch_print(dir);
+}
+
+/*
+ * Wait for changes to the directories watch_add was given and show them
+ * until none of the roots are left. A burst of events is collected until
+ * it has been quiet for WATCH_QUIET_MS, or WATCH_MAX_DELAY_MS at most, so
+ * every directory is read once per burst.
+ */
+int
+watch_run(void)
+{
+	int i;
+	int n;
+	bool dirty;
+	uint64_t now, deadline, wait;
+	struct timespec timeout;
+	struct kevent events[WATCH_NEVENTS];
+
+	out_flush();
+
+	while (watch.nroots > 0) {
+		dirty = false;
+		deadline = 0;
+		for (;;) {
+			if (dirty) {
+				now = watch_now_ms();
+				if (now >= deadline) {
+					break;
+				}
+				wait = deadline - now;
+				if (wait > WATCH_QUIET_MS) {
+					wait = WATCH_QUIET_MS;
+				}
+				timeout.tv_sec = wait / 1000;
+				timeout.tv_nsec = (wait % 1000) * 1000000;
+			}
+			n = kevent(watch.kq, NULL, 0, events, WATCH_NEVENTS,
+			           dirty ? &timeout : NULL);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				err(EXIT_FAILURE, "kevent");
+			}
+			if (n == 0) {
+				/* quiet for long enough */
+				break;
+			}
+			for (i = 0; i < n; ++i) {
+				if (watch_mark(&events[i]) && !dirty) {
+					dirty = true;
+					deadline = watch_now_ms() +
+					           WATCH_MAX_DELAY_MS;
+				}
+			}
+			if (watch.nroots == 0) {
+				break;
+			}
+		}
+		if (!dirty) {
+			continue;
+		}
+
+		for (i = 0; i < watch.nroots;) {
+			if (watch.roots[i]->dirty &&
+			    watch_gone(watch.roots[i])) {
+				watch_drop(watch.roots[i], "removed");
+				continue;
+			}
+			watch_rescan(watch.roots[i++]);
+		}
+		if (watch.nroots == 0) {
+			break;
+		}
+		if (watch_render() != EXIT_SUCCESS) {
+			watch.exitcode = EXIT_FAILURE;
+		}
+	}
+
+	free(watch.roots);
+	free(watch.by_fd);
+	if (watch.fileinfos != NULL) {
+		fileinfos_free(watch.fileinfos);
+		(void)close(watch.kq);
+	}
+	return watch.exitcode;
+}
@@ -0,0 +1,41 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fts.h>
+#include <stdbool.h>
+
+#include "dir.h"
+
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+/* changes are collected until none came for this long... */
+#define WATCH_QUIET_MS 100
+/* ...but the listing is never more than this much behind */
+#define WATCH_MAX_DELAY_MS 1000
+
+/*
+ * A watched directory. Its entries are kept between renders and only read
+ * again when kqueue says the directory changed.
+ */
+typedef struct watch_dir_t {
+	char *path; /* equivalent of fts_path */
+	char *name;
+	int level;
+	int fd; /* registered with kqueue, -1 once the directory is gone */
+	bool header;  /* print the "path:" line */
+	bool dirty;   /* kqueue reported a change not read yet */
+	bool changed; /* read again since the last render */
+	dev_t dev;
+	ino_t ino;
+	int err; /* errno of the last read, 0 if it was read */
+	dentries_t dentries;
+	struct watch_dir_t *parent;
+	struct watch_dir_t **subdirs; /* in the order fts would visit them */
+	int nsubdirs;
+} watch_dir_t;
+
+int watch_add(const FTSENT *, bool);
+int watch_run(void);
+
+#endif /* _WATCH_H_ */